@@ -0,0 +1,75 @@
+#include "aggregate.h"
+
+#include <math.h>
+#include <string.h>
+
+const char* aggregate_function_names[AGGREGATE_FUNCTION_COUNT] = {"avg", "min", "max",
+                                                                  "sum", "count"};
+
+void aggregate_init(aggregate_t* aggregate) {
+    aggregate->count = 0;
+    for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        aggregate->sum[i] = 0;
+        aggregate->min[i] = INFINITY;
+        aggregate->max[i] = -INFINITY;
+    }
+}
+
+void aggregate_add(aggregate_t* aggregate, const double values[DATA_POINT_VALUE_COUNT]) {
+    aggregate->count++;
+    for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        aggregate->sum[i] += values[i];
+        aggregate->min[i] = values[i] < aggregate->min[i] ? values[i] : aggregate->min[i];
+        aggregate->max[i] = values[i] > aggregate->max[i] ? values[i] : aggregate->max[i];
+    }
+}
+
+void aggregate_merge(aggregate_t* aggregate, const aggregate_t* other) {
+    aggregate->count += other->count;
+    for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        aggregate->sum[i] += other->sum[i];
+        aggregate->min[i] =
+            other->min[i] < aggregate->min[i] ? other->min[i] : aggregate->min[i];
+        aggregate->max[i] =
+            other->max[i] > aggregate->max[i] ? other->max[i] : aggregate->max[i];
+    }
+}
+
+double aggregate_get(const aggregate_t* aggregate, aggregate_function_t function,
+                     size_t i) {
+    switch (function) {
+    case AGGREGATE_AVG:
+        return aggregate->sum[i] / aggregate->count;
+    case AGGREGATE_MIN:
+        return aggregate->min[i];
+    case AGGREGATE_MAX:
+        return aggregate->max[i];
+    case AGGREGATE_SUM:
+        return aggregate->sum[i];
+    default:
+        return aggregate->count;
+    }
+}
+
+unsigned aggregate_parse_functions(const char* list) {
+    unsigned functions = 0;
+    while (1) {
+        size_t size = strcspn(list, ",");
+
+        int i = 0;
+        while (i < AGGREGATE_FUNCTION_COUNT &&
+               (strlen(aggregate_function_names[i]) != size ||
+                strncmp(aggregate_function_names[i], list, size) != 0)) {
+            i++;
+        }
+        if (i == AGGREGATE_FUNCTION_COUNT) {
+            return 0;
+        }
+        functions |= 1 << i;
+
+        if (list[size] == '\0') {
+            return functions;
+        }
+        list += size + 1;
+    }
+}
@@ -0,0 +1,51 @@
+#ifndef __AGGREGATE_H
+#define __AGGREGATE_H
+
+#include "data_point.h"
+
+#include <stdint.h>
+
+// aggregates (count, sum, min, max) of the readings within a time bucket, accumulated in
+// a single pass over the rows
+// aggregates are mergeable: merging the aggregates of two buckets gives the aggregate of
+// the combined bucket, so small buckets can be combined into larger ones
+
+// aggregate functions of GET /data?agg=..., combined into a mask
+typedef enum aggregate_function {
+    AGGREGATE_AVG = 1 << 0,
+    AGGREGATE_MIN = 1 << 1,
+    AGGREGATE_MAX = 1 << 2,
+    AGGREGATE_SUM = 1 << 3,
+    AGGREGATE_COUNT = 1 << 4,
+} aggregate_function_t;
+
+#define AGGREGATE_FUNCTION_COUNT 5
+
+// names of the aggregate functions, indexed by bit
+extern const char* aggregate_function_names[AGGREGATE_FUNCTION_COUNT];
+
+typedef struct aggregate aggregate_t;
+
+// per measured value, in the order of data_point_fields
+struct aggregate {
+    uint64_t count;
+    double sum[DATA_POINT_VALUE_COUNT];
+    double min[DATA_POINT_VALUE_COUNT];
+    double max[DATA_POINT_VALUE_COUNT];
+};
+
+// resets to the aggregate of no readings
+void aggregate_init(aggregate_t* aggregate);
+// adds the measured values of a reading
+void aggregate_add(aggregate_t* aggregate, const double values[DATA_POINT_VALUE_COUNT]);
+// adds all readings of other
+void aggregate_merge(aggregate_t* aggregate, const aggregate_t* other);
+// value of an aggregate function (except count) for measured value i
+double aggregate_get(const aggregate_t* aggregate, aggregate_function_t function,
+                     size_t i);
+
+// parses a comma separated list of function names like "avg,min,max"
+// returns the mask of aggregate_function_t, 0 if the list contains an unknown name
+unsigned aggregate_parse_functions(const char* list);
+
+#endif // __AGGREGATE_H
@@ -0,0 +1,191 @@
+#include "data_point.h"
+
+#include <json-c/json.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// benchmark of the reading parser against json-c (which POST /data used before): parses
+// a single reading and an array of readings like a station sends them, reports the time
+// per reading and MB/s and checks that both parsers read the same values
+// usage: data-point-bench [seconds per measurement, default 0.5]
+
+// readings in the array payload
+#define BENCH_ARRAY_SIZE 1000
+
+#define BENCH_READING_MAX_SIZE 160
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// writes reading i of a day of readings a minute apart
+static int bench_write_reading(char* out, size_t i) {
+    return snprintf(out, BENCH_READING_MAX_SIZE,
+                    "{ \"temperature\": %.1f, \"humidity\": %.1f, \"windspeed\": %.2f, "
+                    "\"pressure\": %.1f, \"rain\": %.1f, \"timestamp\": %lld }",
+                    10 + (double)(i % 150) / 10, 60 + (double)(i % 400) / 10,
+                    (double)(i % 900) / 100, 960 + (double)(i % 700) / 10,
+                    (double)(i % 50) / 10, 1600000000LL + (long long)i * 60);
+}
+
+// parses the readings of input (a reading or an array of them) into points
+// returns the number of readings, -1 on error
+typedef long (*bench_parse_t)(const char* input, size_t size, int array,
+                              data_point_t* points);
+
+static long bench_parse_data_point(const char* input, size_t size, int array,
+                                   data_point_t* points) {
+    data_point_parser_t parser;
+    data_point_parser_init(&parser, input, size, time(NULL));
+    if (!array) {
+        return data_point_parse(&parser, points) == DATA_POINT_OK ? 1 : -1;
+    }
+
+    long count = 0;
+    data_point_status_t status;
+    while ((status = data_point_parse_array_item(&parser, &points[count])) ==
+           DATA_POINT_OK) {
+        count++;
+    }
+    return status == DATA_POINT_END ? count : -1;
+}
+
+// reads a reading from a json-c object, like the handler used to
+static int bench_read_json_c(struct json_object* object, data_point_t* point) {
+    double* values[DATA_POINT_VALUE_COUNT] = {&point->temperature, &point->humidity,
+                                              &point->windspeed, &point->pressure,
+                                              &point->rain};
+    struct json_object* field;
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        if (!json_object_object_get_ex(object, data_point_fields[i], &field)) {
+            return -1;
+        }
+        *values[i] = json_object_get_double(field);
+    }
+    if (!json_object_object_get_ex(object, "timestamp", &field)) {
+        return -1;
+    }
+    point->timestamp = json_object_get_int64(field);
+    return 0;
+}
+
+// input has to be null terminated for json_tokener_parse()
+static long bench_parse_json_c(const char* input, size_t size, int array,
+                               data_point_t* points) {
+    (void)size;
+    struct json_object* root = json_tokener_parse(input);
+    if (root == NULL) {
+        return -1;
+    }
+
+    long count = 0;
+    if (!array) {
+        count = bench_read_json_c(root, points) == 0 ? 1 : -1;
+    } else {
+        size_t length = json_object_array_length(root);
+        for (size_t i = 0; i < length && count >= 0; i++) {
+            count = bench_read_json_c(json_object_array_get_idx(root, i), &points[i]) == 0
+                        ? count + 1
+                        : -1;
+        }
+    }
+    json_object_put(root);
+    return count;
+}
+
+// returns the time per reading in ns, -1 if parsing failed
+static double bench_measure(bench_parse_t parse, const char* input, size_t size,
+                            int array, data_point_t* points, double seconds) {
+    long count = parse(input, size, array, points);
+    if (count < 0) {
+        return -1;
+    }
+
+    size_t runs = 0;
+    double start = bench_now();
+    double elapsed;
+    do {
+        parse(input, size, array, points);
+        runs++;
+    } while ((elapsed = bench_now() - start) < seconds);
+    return elapsed / runs / count * 1e9;
+}
+
+// runs both parsers on input and compares their results
+// returns -1 if they fail or disagree
+static int bench_compare(const char* name, const char* input, size_t size, int array,
+                         double seconds) {
+    data_point_t* points = malloc(sizeof(data_point_t) * BENCH_ARRAY_SIZE);
+    data_point_t* expected = malloc(sizeof(data_point_t) * BENCH_ARRAY_SIZE);
+    if (points == NULL || expected == NULL) {
+        fprintf(stderr, "malloc() failed\n");
+        free(points);
+        free(expected);
+        return -1;
+    }
+
+    double json_c_ns =
+        bench_measure(bench_parse_json_c, input, size, array, expected, seconds);
+    double parser_ns =
+        bench_measure(bench_parse_data_point, input, size, array, points, seconds);
+    long count = bench_parse_data_point(input, size, array, points);
+
+    int result = 0;
+    if (json_c_ns < 0 || parser_ns < 0) {
+        fprintf(stderr, "%s: parsing failed\n", name);
+        result = -1;
+    } else if (count != bench_parse_json_c(input, size, array, expected) ||
+               memcmp(points, expected, sizeof(data_point_t) * count) != 0) {
+        fprintf(stderr, "%s: data_point_parse() and json-c read different values\n",
+                name);
+        result = -1;
+    } else {
+        double bytes_per_reading = (double)size / count;
+        printf("%s (%zu bytes): json-c %8.1f ns/reading (%6.1f MB/s), data_point "
+               "%8.1f ns/reading (%6.1f MB/s, %.1fx)\n",
+               name, size, json_c_ns, bytes_per_reading / json_c_ns * 1e3, parser_ns,
+               bytes_per_reading / parser_ns * 1e3, json_c_ns / parser_ns);
+    }
+
+    free(points);
+    free(expected);
+    return result;
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    char reading[BENCH_READING_MAX_SIZE];
+    size_t reading_size = bench_write_reading(reading, 0);
+
+    // [ reading, reading, ... ]
+    char* array = malloc(BENCH_ARRAY_SIZE * (BENCH_READING_MAX_SIZE + 2) + 3);
+    if (array == NULL) {
+        fprintf(stderr, "malloc() failed\n");
+        return 1;
+    }
+    size_t array_size = 0;
+    array[array_size++] = '[';
+    for (size_t i = 0; i < BENCH_ARRAY_SIZE; i++) {
+        if (i > 0) {
+            array[array_size++] = ',';
+        }
+        array[array_size++] = '\n';
+        array_size += bench_write_reading(array + array_size, i);
+    }
+    array_size += sprintf(array + array_size, "\n]");
+
+    int failed = bench_compare("single reading", reading, reading_size, 0, seconds) != 0;
+    failed |= bench_compare("array of 1000", array, array_size, 1, seconds) != 0;
+
+    free(array);
+    return failed;
+}
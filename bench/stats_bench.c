@@ -0,0 +1,109 @@
+#include "stats.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// micro-benchmark of the stats kernels: runs the scalar kernel and the one
+// stats_select_kernel() picks over aligned columns of pressure-like values, reports GB/s
+// and checks that the selected kernel matches the scalar one
+// usage: stats-bench [seconds per measurement, default 0.5]
+
+// column sizes: one kernel call within the cache and one larger than it
+static const size_t bench_sizes[] = {STATS_BLOCK_SIZE, 1024 * 1024};
+
+// relative tolerance of the sums, the vector kernels add in a different order
+#define BENCH_TOLERANCE 1e-9
+
+static double bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// runs kernel over the column in blocks of STATS_BLOCK_SIZE, like stats_add()
+static void bench_run(stats_kernel_t kernel, const double* values, size_t count,
+                      stats_sums_t* total) {
+    total->sum = 0;
+    total->sum_squares = 0;
+    total->min = INFINITY;
+    total->max = -INFINITY;
+    for (size_t i = 0; i < count; i += STATS_BLOCK_SIZE) {
+        size_t size = count - i < STATS_BLOCK_SIZE ? count - i : STATS_BLOCK_SIZE;
+        stats_sums_t sums;
+        kernel(values + i, size, values[0], &sums);
+        total->sum += sums.sum;
+        total->sum_squares += sums.sum_squares;
+        total->min = sums.min < total->min ? sums.min : total->min;
+        total->max = sums.max > total->max ? sums.max : total->max;
+    }
+}
+
+// returns the throughput of kernel in GB/s, the result of the last run in *sums
+static double bench_measure(stats_kernel_t kernel, const double* values, size_t count,
+                            double seconds, stats_sums_t* sums) {
+    // warm up the cache and the branch predictors
+    bench_run(kernel, values, count, sums);
+
+    size_t runs = 0;
+    double start = bench_now();
+    double elapsed;
+    do {
+        bench_run(kernel, values, count, sums);
+        runs++;
+    } while ((elapsed = bench_now() - start) < seconds);
+    return (double)runs * count * sizeof(double) / elapsed / 1e9;
+}
+
+static int bench_close(double a, double b) {
+    return fabs(a - b) <= BENCH_TOLERANCE * fmax(1, fmax(fabs(a), fabs(b)));
+}
+
+int main(int argc, char** argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    if (seconds <= 0) {
+        fprintf(stderr, "usage: %s [seconds]\n", argv[0]);
+        return 1;
+    }
+
+    stats_select_kernel();
+    printf("selected kernel: %s\n", stats_kernel_name);
+
+    int failed = 0;
+    for (size_t s = 0; s < sizeof(bench_sizes) / sizeof(bench_sizes[0]); s++) {
+        size_t count = bench_sizes[s];
+        double* values = aligned_alloc(64, count * sizeof(double));
+        if (values == NULL) {
+            fprintf(stderr, "aligned_alloc() failed\n");
+            return 1;
+        }
+        srand(1);
+        for (size_t i = 0; i < count; i++) {
+            values[i] = 950 + 100.0 * rand() / RAND_MAX;
+        }
+
+        stats_sums_t scalar, selected;
+        double scalar_speed =
+            bench_measure(stats_kernel_scalar, values, count, seconds, &scalar);
+        double selected_speed =
+            bench_measure(stats_kernel, values, count, seconds, &selected);
+        printf("%8zu values (%6zu KiB): scalar %6.2f GB/s, %s %6.2f GB/s (%.1fx)\n", count,
+               count * sizeof(double) / 1024, scalar_speed, stats_kernel_name,
+               selected_speed, selected_speed / scalar_speed);
+
+        if (!bench_close(scalar.sum, selected.sum) ||
+            !bench_close(scalar.sum_squares, selected.sum_squares) ||
+            scalar.min != selected.min || scalar.max != selected.max) {
+            fprintf(stderr,
+                    "%s kernel differs from scalar: sum %.17g / %.17g, sum of squares "
+                    "%.17g / %.17g, min %.17g / %.17g, max %.17g / %.17g\n",
+                    stats_kernel_name, selected.sum, scalar.sum, selected.sum_squares,
+                    scalar.sum_squares, selected.min, scalar.min, selected.max,
+                    scalar.max);
+            failed = 1;
+        }
+        free(values);
+    }
+    return failed;
+}
@@ -0,0 +1,511 @@
+#include "cache.h"
+
+#include <json_writer.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a, the keys are short
+static uint64_t cache_hash_key(const char* key) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (; *key != '\0'; key++) {
+        hash = (hash ^ (unsigned char)*key) * 0x100000001b3;
+    }
+    return hash;
+}
+
+// hash of a body for its ETag, 8 bytes at a time
+static uint64_t cache_hash_body(const char* body, size_t size) {
+    uint64_t hash = size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, &body[i], 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; i++) {
+        hash = (hash ^ (unsigned char)body[i]) * 0x100000001b3;
+    }
+    return hash;
+}
+
+static cache_shard_t* cache_shard(cache_t* cache, uint64_t hash) {
+    return &cache->shards[hash % CACHE_SHARD_COUNT];
+}
+
+static cache_entry_t** cache_bucket(cache_shard_t* shard, uint64_t hash) {
+    return &shard->buckets[hash / CACHE_SHARD_COUNT % CACHE_BUCKET_COUNT];
+}
+
+static void cache_entry_free(cache_entry_t* entry) {
+    for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+        free(entry->encoded[i]);
+    }
+    free(entry->key);
+    free(entry->link);
+    free(entry);
+}
+
+static void cache_entry_release(void* ctx) {
+    cache_entry_t* entry = ctx;
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        cache_entry_free(entry);
+    }
+}
+
+// the body and its compressed copies
+static size_t cache_entry_size(cache_entry_t* entry) {
+    size_t size = entry->size;
+    for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+        size += entry->encoded_size[i];
+    }
+    return size;
+}
+
+// the functions below run with the shard locked
+
+static void cache_lru_unlink(cache_shard_t* shard, cache_entry_t* entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        shard->lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        shard->lru_tail = entry->lru_prev;
+    }
+}
+
+static void cache_lru_push(cache_shard_t* shard, cache_entry_t* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = entry;
+    } else {
+        shard->lru_tail = entry;
+    }
+    shard->lru_head = entry;
+}
+
+static cache_entry_t* cache_find(cache_shard_t* shard, const char* key, uint64_t hash) {
+    cache_entry_t* entry = *cache_bucket(shard, hash);
+    while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0)) {
+        entry = entry->next;
+    }
+    return entry;
+}
+
+static void cache_remove(cache_shard_t* shard, cache_entry_t* entry) {
+    cache_entry_t** link = cache_bucket(shard, entry->hash);
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    cache_lru_unlink(shard, entry);
+    shard->size -= cache_entry_size(entry);
+    shard->entry_count--;
+    cache_entry_release(entry);
+}
+
+cache_t* cache_new(size_t max_size, int compression_level, size_t compression_min_size) {
+    cache_t* cache = calloc(1, sizeof(cache_t));
+    if (cache == NULL) {
+        return NULL;
+    }
+    cache->shard_size = max_size / CACHE_SHARD_COUNT;
+    cache->compression_level = compression_level;
+    cache->compression_min_size = compression_min_size;
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    }
+    pthread_mutex_init(&cache->log_mutex, NULL);
+    return cache;
+}
+
+void cache_free(cache_t* cache) {
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        while (shard->lru_head != NULL) {
+            cache_remove(shard, shard->lru_head);
+        }
+        pthread_mutex_destroy(&shard->mutex);
+    }
+    pthread_mutex_destroy(&cache->log_mutex);
+    free(cache);
+}
+
+// compresses the body of an entry (referenced by the caller) and keeps the copy, unless
+// another request was faster, it only counts against the size of the shard while the
+// entry is cached
+// returns -1 if the body couldn't be compressed
+static int cache_entry_encode(cache_t* cache, cache_shard_t* shard, cache_entry_t* entry,
+                              http_encoding_t encoding) {
+    char* encoded;
+    size_t encoded_size = http_compress(encoding, cache->compression_level, entry->body,
+                                        entry->size, &encoded);
+    if (encoded_size == 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    if (entry->encoded[encoding] == NULL) {
+        entry->encoded[encoding] = encoded;
+        entry->encoded_size[encoding] = encoded_size;
+        encoded = NULL;
+        if (cache_find(shard, entry->key, entry->hash) == entry) {
+            shard->size += encoded_size;
+            while (shard->size > cache->shard_size && shard->lru_tail != entry) {
+                cache_remove(shard, shard->lru_tail);
+                __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    free(encoded);
+    return 0;
+}
+
+// ETag of the body in an encoding, every encoding has one of its own ("<hash>-gzip")
+// allocated with http_alloc() as the header only points to the value, the arena keeps it
+// until the response has been sent
+static char* cache_etag(cache_entry_t* entry, http_encoding_t encoding) {
+    char* etag = http_alloc(sizeof(entry->etag) + 16);
+    if (encoding == HTTP_ENCODING_IDENTITY) {
+        memcpy(etag, entry->etag, sizeof(entry->etag));
+    } else {
+        sprintf(etag, "%.*s-%s\"", (int)strlen(entry->etag) - 1, entry->etag,
+                http_encoding_names[encoding]);
+    }
+    return etag;
+}
+
+http_response_t* cache_response(cache_t* cache, const char* key, http_request_t* request,
+                                http_headers_t* headers, uint64_t* generation) {
+    uint64_t hash = cache_hash_key(key);
+    cache_shard_t* shard = cache_shard(cache, hash);
+
+    http_encoding_t encoding = request->encoding;
+    if (cache->compression_level <= 0) {
+        encoding = HTTP_ENCODING_IDENTITY;
+    }
+
+    pthread_mutex_lock(&shard->mutex);
+    cache_entry_t* entry = cache_find(shard, key, hash);
+    int encoded = 0;
+    if (entry != NULL) {
+        cache_lru_unlink(shard, entry);
+        cache_lru_push(shard, entry);
+        __atomic_add_fetch(&entry->refs, 1, __ATOMIC_RELAXED);
+        encoded = entry->encoded[encoding] != NULL;
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (entry == NULL) {
+        // taken before the response reads anything, see cache_fill_release()
+        pthread_mutex_lock(&cache->log_mutex);
+        *generation = cache->generation;
+        pthread_mutex_unlock(&cache->log_mutex);
+        __atomic_add_fetch(&cache->misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    __atomic_add_fetch(&cache->hits, 1, __ATOMIC_RELAXED);
+
+    if (entry->link != NULL) {
+        char* link = http_alloc(strlen(entry->link) + 1);
+        strcpy(link, entry->link);
+        http_headers_add(headers, http_header_new("Link", link));
+    }
+
+    // small bodies are sent as they are, like by the server
+    if (entry->size < cache->compression_min_size) {
+        encoding = HTTP_ENCODING_IDENTITY;
+    }
+
+    char* etag = cache_etag(entry, encoding);
+    http_header_t* if_none_match = http_headers_get(request->headers, "If-None-Match");
+    if (if_none_match != NULL && (strcmp(if_none_match->value, "*") == 0 ||
+                                  strstr(if_none_match->value, etag) != NULL)) {
+        __atomic_add_fetch(&cache->not_modified, 1, __ATOMIC_RELAXED);
+        http_headers_add(headers, http_header_new("ETag", etag));
+        cache_entry_release(entry);
+        return http_response_new(HTTP_STATUS_NOT_MODIFIED, headers, "", 0, NULL, NULL);
+    }
+
+    // compressed only once a client asks for it, not for the 304s
+    if (encoding != HTTP_ENCODING_IDENTITY && !encoded &&
+        cache_entry_encode(cache, shard, entry, encoding) != 0) {
+        encoding = HTTP_ENCODING_IDENTITY;
+        etag = cache_etag(entry, encoding);
+    }
+    http_headers_add(headers, http_header_new("ETag", etag));
+
+    if (encoding != HTTP_ENCODING_IDENTITY) {
+        http_headers_add(headers, http_header_new("Content-Encoding",
+                                                  (char*)http_encoding_names[encoding]));
+        return http_response_new(HTTP_STATUS_OK, headers, entry->encoded[encoding],
+                                 entry->encoded_size[encoding], cache_entry_release,
+                                 entry);
+    }
+    return http_response_new(HTTP_STATUS_OK, headers, entry->body, entry->size,
+                             cache_entry_release, entry);
+}
+
+// a response being copied into a new entry
+typedef struct cache_fill {
+    cache_t* cache;
+    int64_t from;
+    int64_t to;
+    // of the log when the response started, it is only cached if no later invalidation
+    // overlaps its range
+    uint64_t generation;
+    http_stream_callback_t stream;
+    http_body_release_t release;
+    void* ctx;
+    // grows with the body, NULL once the body turned out to be too large
+    cache_entry_t* entry;
+    size_t capacity;
+    // set once the stream callback succeeded
+    int complete;
+} cache_fill_t;
+
+static void cache_fill_tap(const char* data, size_t size, void* ctx) {
+    cache_fill_t* fill = ctx;
+    cache_entry_t* entry = fill->entry;
+    if (entry == NULL) {
+        return;
+    }
+
+    if (entry->size + size > fill->capacity) {
+        size_t capacity = fill->capacity * 2 > entry->size + size ? fill->capacity * 2
+                                                                 : entry->size + size;
+        cache_entry_t* grown = NULL;
+        if (entry->size + size <= fill->cache->shard_size) {
+            grown = realloc(entry, sizeof(cache_entry_t) + capacity);
+        }
+        if (grown == NULL) {
+            cache_entry_free(entry);
+            fill->entry = NULL;
+            return;
+        }
+        entry = fill->entry = grown;
+        fill->capacity = capacity;
+    }
+
+    memcpy(&entry->body[entry->size], data, size);
+    entry->size += size;
+}
+
+static int cache_fill_stream(http_stream_t* stream, void* ctx) {
+    cache_fill_t* fill = ctx;
+    http_stream_set_tap(stream, cache_fill_tap, fill);
+    int result = fill->stream(stream, fill->ctx);
+    fill->complete = result == HTTP_STREAM_DONE;
+    return result;
+}
+
+// whether one of the invalidations since generation overlaps the range, the log is
+// locked
+static int cache_invalidated(cache_t* cache, uint64_t generation, int64_t from,
+                             int64_t to) {
+    if (cache->generation - generation > CACHE_LOG_SIZE) {
+        return 1;
+    }
+    for (uint64_t g = generation + 1; g <= cache->generation; g++) {
+        cache_invalidation_t* invalidation = &cache->log[g % CACHE_LOG_SIZE];
+        if (invalidation->from <= to && invalidation->to >= from) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// runs once the response has been sent, the last chunk has gone through the tap by now
+static void cache_fill_release(void* ctx) {
+    cache_fill_t* fill = ctx;
+    cache_t* cache = fill->cache;
+    cache_entry_t* entry = fill->entry;
+    if (fill->release != NULL) {
+        fill->release(fill->ctx);
+    }
+
+    if (entry != NULL && fill->complete) {
+        snprintf(entry->etag, sizeof(entry->etag), "\"%016llx\"",
+                 (unsigned long long)cache_hash_body(entry->body, entry->size));
+        entry->refs = 1;
+        cache_shard_t* shard = cache_shard(cache, entry->hash);
+
+        // checked with the shard locked: an invalidation either shows up in the log
+        // now or removes the entry once it gets to the shard
+        pthread_mutex_lock(&shard->mutex);
+        pthread_mutex_lock(&cache->log_mutex);
+        int invalidated =
+            cache_invalidated(cache, fill->generation, fill->from, fill->to);
+        pthread_mutex_unlock(&cache->log_mutex);
+
+        if (!invalidated) {
+            // another miss for the same key may have been faster
+            cache_entry_t* existing = cache_find(shard, entry->key, entry->hash);
+            if (existing != NULL) {
+                cache_remove(shard, existing);
+            }
+            while (shard->size + entry->size > cache->shard_size) {
+                cache_remove(shard, shard->lru_tail);
+                __atomic_add_fetch(&cache->evictions, 1, __ATOMIC_RELAXED);
+            }
+
+            cache_entry_t** bucket = cache_bucket(shard, entry->hash);
+            entry->next = *bucket;
+            *bucket = entry;
+            cache_lru_push(shard, entry);
+            shard->size += entry->size;
+            shard->entry_count++;
+            entry = NULL;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    if (entry != NULL) {
+        cache_entry_free(entry);
+    }
+    free(fill);
+}
+
+http_response_t* cache_stream(cache_t* cache, const char* key, int64_t from, int64_t to,
+                              uint64_t generation, http_headers_t* headers,
+                              http_stream_callback_t stream, http_body_release_t release,
+                              void* ctx) {
+    cache_fill_t* fill = malloc(sizeof(cache_fill_t));
+    if (fill == NULL) {
+        return http_response_new_stream(HTTP_STATUS_OK, headers, stream, release, ctx);
+    }
+    fill->cache = cache;
+    fill->from = from;
+    fill->to = to;
+    fill->generation = generation;
+    fill->stream = stream;
+    fill->release = release;
+    fill->ctx = ctx;
+    fill->capacity = HTTP_STREAM_CHUNK_SIZE;
+    fill->complete = 0;
+
+    // the response is sent without being cached if this fails
+    cache_entry_t* entry = malloc(sizeof(cache_entry_t) + fill->capacity);
+    if (entry != NULL && (entry->key = strdup(key)) == NULL) {
+        free(entry);
+        entry = NULL;
+    }
+    http_header_t* link = http_headers_get(headers, "Link");
+    if (entry != NULL) {
+        entry->link = link != NULL ? strdup(link->value) : NULL;
+        if (link != NULL && entry->link == NULL) {
+            free(entry->key);
+            free(entry);
+            entry = NULL;
+        }
+    }
+    if (entry != NULL) {
+        entry->hash = cache_hash_key(key);
+        entry->from = from;
+        entry->to = to;
+        entry->size = 0;
+        for (int i = 0; i < HTTP_ENCODING_COUNT; i++) {
+            entry->encoded[i] = NULL;
+            entry->encoded_size[i] = 0;
+        }
+    }
+    fill->entry = entry;
+
+    return http_response_new_stream(HTTP_STATUS_OK, headers, cache_fill_stream,
+                                    cache_fill_release, fill);
+}
+
+// whether a timestamp (sorted ascending) is within [from, to]
+static int cache_range_hit(const int64_t* timestamps, size_t count, int64_t from,
+                           int64_t to) {
+    size_t low = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (timestamps[middle] < from) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < count && timestamps[low] <= to;
+}
+
+// logs an invalidation of the range, so responses being computed from it aren't cached
+static void cache_log(cache_t* cache, int64_t from, int64_t to) {
+    pthread_mutex_lock(&cache->log_mutex);
+    cache->generation++;
+    cache_invalidation_t* invalidation = &cache->log[cache->generation % CACHE_LOG_SIZE];
+    invalidation->from = from;
+    invalidation->to = to;
+    pthread_mutex_unlock(&cache->log_mutex);
+}
+
+// drops the entries of all shards whose range contains one of the timestamps, or all
+// entries if timestamps is NULL
+static void cache_drop(cache_t* cache, const int64_t* timestamps, size_t count) {
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        cache_shard_t* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        cache_entry_t* entry = shard->lru_head;
+        while (entry != NULL) {
+            cache_entry_t* next = entry->lru_next;
+            if (timestamps == NULL ||
+                cache_range_hit(timestamps, count, entry->from, entry->to)) {
+                cache_remove(shard, entry);
+                __atomic_add_fetch(&cache->invalidations, 1, __ATOMIC_RELAXED);
+            }
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+void cache_invalidate(cache_t* cache, const int64_t* timestamps, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    cache_log(cache, timestamps[0], timestamps[count - 1]);
+    cache_drop(cache, timestamps, count);
+}
+
+void cache_clear(cache_t* cache) {
+    cache_log(cache, INT64_MIN, INT64_MAX);
+    cache_drop(cache, NULL, 0);
+}
+
+size_t cache_write_counters(cache_t* cache, char* out) {
+    size_t entry_count = 0;
+    size_t size = 0;
+    for (int i = 0; i < CACHE_SHARD_COUNT; i++) {
+        pthread_mutex_lock(&cache->shards[i].mutex);
+        entry_count += cache->shards[i].entry_count;
+        size += cache->shards[i].size;
+        pthread_mutex_unlock(&cache->shards[i].mutex);
+    }
+
+    char* p = out;
+    p += JSON_WRITE_LITERAL(p, "{ \"hits\": ");
+    p += json_write_int(p, __atomic_load_n(&cache->hits, __ATOMIC_RELAXED));
+    p += JSON_WRITE_LITERAL(p, ", \"misses\": ");
+    p += json_write_int(p, __atomic_load_n(&cache->misses, __ATOMIC_RELAXED));
+    p += JSON_WRITE_LITERAL(p, ", \"not_modified\": ");
+    p += json_write_int(p, __atomic_load_n(&cache->not_modified, __ATOMIC_RELAXED));
+    p += JSON_WRITE_LITERAL(p, ", \"invalidations\": ");
+    p += json_write_int(p, __atomic_load_n(&cache->invalidations, __ATOMIC_RELAXED));
+    p += JSON_WRITE_LITERAL(p, ", \"evictions\": ");
+    p += json_write_int(p, __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED));
+    p += JSON_WRITE_LITERAL(p, ", \"entries\": ");
+    p += json_write_int(p, entry_count);
+    p += JSON_WRITE_LITERAL(p, ", \"size\": ");
+    p += json_write_int(p, size);
+    p += JSON_WRITE_LITERAL(p, " }");
+    return p - out;
+}
@@ -0,0 +1,135 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#include <http.h>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// cache of serialized GET responses, keyed by the normalized query (e.g.
+// "data?from=1600000000&to=1600086400&bucket=0&agg=1") and tagged with the time range
+// the response was computed from
+// a miss streams the response as usual and keeps a copy of the body on the side, which
+// goes into the cache once the response is complete, hits are answered from memory with
+// an ETag (a hash of the body), a matching If-None-Match gets a 304 without a body
+// the Link header of a response is kept with the body, it depends on the readings as well
+// clients accepting gzip or deflate get a compressed copy of the body, made on the first
+// hit that asks for it and kept with the entry, so hits never compress again
+// inserting a reading drops the entries whose range contains its timestamp, a response
+// that was being computed while readings were inserted into its range isn't cached at
+// all, as it may not include them
+// the cache is split into shards by key with their own lock and LRU list, the size of
+// the bodies is bounded per shard
+
+#define CACHE_SHARD_COUNT 16
+// hash buckets per shard
+#define CACHE_BUCKET_COUNT 256
+// number of recent invalidations checked before caching a response, a response that
+// took longer than this many inserts is dropped
+#define CACHE_LOG_SIZE 64
+
+typedef struct cache cache_t;
+typedef struct cache_shard cache_shard_t;
+typedef struct cache_entry cache_entry_t;
+typedef struct cache_invalidation cache_invalidation_t;
+
+// a cached response body, shared by the responses sending it, freed with the last
+// reference once it has left the cache
+struct cache_entry {
+    char* key;
+    uint64_t hash;
+    int64_t from;
+    int64_t to;
+    // quoted, like in the header
+    char etag[24];
+    size_t size;
+    // value of the response's Link header (the next page of GET /data), NULL if it had
+    // none, sent again with the hits
+    char* link;
+    // compressed copies of the body by encoding, NULL until first requested
+    char* encoded[HTTP_ENCODING_COUNT];
+    size_t encoded_size[HTTP_ENCODING_COUNT];
+    int refs;
+    // hash bucket chain and LRU list (most recently used first) of the shard
+    cache_entry_t* next;
+    cache_entry_t* lru_prev;
+    cache_entry_t* lru_next;
+    char body[];
+};
+
+struct cache_shard {
+    pthread_mutex_t mutex;
+    cache_entry_t* buckets[CACHE_BUCKET_COUNT];
+    cache_entry_t* lru_head;
+    cache_entry_t* lru_tail;
+    size_t size;
+    size_t entry_count;
+};
+
+// time range of the readings inserted by a cache_invalidate() call
+struct cache_invalidation {
+    int64_t from;
+    int64_t to;
+};
+
+struct cache {
+    cache_shard_t shards[CACHE_SHARD_COUNT];
+    // max size of the bodies (and their compressed copies) per shard, larger bodies are
+    // never cached
+    size_t shard_size;
+    // like the server's, bodies are compressed with this zlib level if they have at least
+    // compression_min_size bytes, 0 = never
+    int compression_level;
+    size_t compression_min_size;
+
+    // counts the calls of cache_invalidate(), log[generation % CACHE_LOG_SIZE] is the
+    // range of the last one
+    pthread_mutex_t log_mutex;
+    uint64_t generation;
+    cache_invalidation_t log[CACHE_LOG_SIZE];
+
+    // counters, updated atomically
+    uint64_t hits;
+    uint64_t misses;
+    // hits answered with 304
+    uint64_t not_modified;
+    // entries dropped because a reading was inserted into their range
+    uint64_t invalidations;
+    // entries dropped to make room
+    uint64_t evictions;
+};
+
+// max_size bounds the size of all cached bodies together, see cache_t for the compression
+// settings
+cache_t* cache_new(size_t max_size, int compression_level, size_t compression_min_size);
+// no responses may be running anymore
+void cache_free(cache_t* cache);
+
+// answers a request from the cache, with a 304 if its If-None-Match matches, compressed
+// with the request's encoding
+// returns NULL on a miss and sets *generation for cache_stream()
+http_response_t* cache_response(cache_t* cache, const char* key, http_request_t* request,
+                                http_headers_t* headers, uint64_t* generation);
+// a streamed response like http_response_new_stream() whose body is added to the cache
+// once it is complete, unless readings were inserted into its range since
+// cache_response() returned generation
+// from and to is the time range (inclusive) the body depends on
+http_response_t* cache_stream(cache_t* cache, const char* key, int64_t from, int64_t to,
+                              uint64_t generation, http_headers_t* headers,
+                              http_stream_callback_t stream, http_body_release_t release,
+                              void* ctx);
+
+// drops the entries whose range contains one of the timestamps (sorted ascending), call
+// once the readings are committed
+void cache_invalidate(cache_t* cache, const int64_t* timestamps, size_t count);
+// drops all entries, like an invalidation of every range, for when the inserted
+// readings aren't known precisely
+void cache_clear(cache_t* cache);
+
+// writes the counters and the current number and size of the entries as json
+// returns the number of bytes written, at most CACHE_COUNTERS_MAX_SIZE
+#define CACHE_COUNTERS_MAX_SIZE 256
+size_t cache_write_counters(cache_t* cache, char* out);
+
+#endif // __CACHE_H
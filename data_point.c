@@ -0,0 +1,534 @@
+#include "data_point.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// powers of ten that are exact doubles
+static const double data_point_pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                          1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                          1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                          1e18, 1e19, 1e20, 1e21, 1e22};
+
+// missing/invalid fields are reported in this order
+const char* data_point_fields[] = {"temperature", "humidity", "windspeed",
+                                   "pressure",    "rain",     "timestamp"};
+#define DATA_POINT_FIELD_COUNT (DATA_POINT_VALUE_COUNT + 1)
+#define DATA_POINT_TIMESTAMP DATA_POINT_VALUE_COUNT
+
+// error message if missing, error message if not a number
+static const char* data_point_field_errors[][2] = {
+    {"missing temperature", "temperature is not a number"},
+    {"missing humidity", "humidity is not a number"},
+    {"missing windspeed", "windspeed is not a number"},
+    {"missing pressure", "pressure is not a number"},
+    {"missing rain", "rain is not a number"},
+    {NULL, "timestamp is not a unix timestamp"},
+};
+
+typedef enum data_point_field_state {
+    // not in the object or null
+    DATA_POINT_FIELD_MISSING,
+    DATA_POINT_FIELD_SET,
+    // any other value, for the timestamp also fractions and out of range numbers
+    DATA_POINT_FIELD_INVALID,
+} data_point_field_state_t;
+
+static data_point_status_t data_point_error(data_point_parser_t* parser,
+                                            data_point_status_t status, const char* error,
+                                            const char* at) {
+    parser->error = error;
+    parser->error_offset = at - parser->input;
+    return status;
+}
+
+static data_point_status_t data_point_syntax_error(data_point_parser_t* parser,
+                                                   const char* error, const char* at) {
+    return data_point_error(parser, DATA_POINT_SYNTAX_ERROR, error, at);
+}
+
+static void data_point_skip_whitespace(data_point_parser_t* parser) {
+    while (parser->pos < parser->end && (*parser->pos == ' ' || *parser->pos == '\t' ||
+                                         *parser->pos == '\n' || *parser->pos == '\r')) {
+        parser->pos++;
+    }
+}
+
+// skips whitespace and consumes c if it comes next
+static int data_point_accept(data_point_parser_t* parser, char c) {
+    data_point_skip_whitespace(parser);
+    if (parser->pos < parser->end && *parser->pos == c) {
+        parser->pos++;
+        return 1;
+    }
+    return 0;
+}
+
+static int data_point_hex(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+        return (c | 0x20) - 'a' + 10;
+    }
+    return -1;
+}
+
+// parses the string at parser->pos (at the opening quote)
+// the decoded string is written to out as far as it fits into capacity bytes, *size is
+// its full size, escapes of non-ASCII characters are decoded as a single 0xff byte as
+// they never match a field name anyway
+static data_point_status_t data_point_parse_string(data_point_parser_t* parser, char* out,
+                                                   size_t capacity, size_t* size) {
+    const char* p = parser->pos + 1;
+    size_t decoded_size = 0;
+
+    while (1) {
+        if (p == parser->end) {
+            return data_point_syntax_error(parser, "unterminated string", parser->pos);
+        }
+
+        unsigned char c = *p;
+        if (c == '"') {
+            break;
+        }
+        if (c < 0x20) {
+            return data_point_syntax_error(parser, "control character in string", p);
+        }
+
+        if (c == '\\') {
+            const char* escape = p++;
+            if (p == parser->end) {
+                return data_point_syntax_error(parser, "unterminated string",
+                                               parser->pos);
+            }
+            switch (*p) {
+            case '"':
+            case '\\':
+            case '/':
+                c = *p;
+                break;
+            case 'b':
+                c = '\b';
+                break;
+            case 'f':
+                c = '\f';
+                break;
+            case 'n':
+                c = '\n';
+                break;
+            case 'r':
+                c = '\r';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case 'u': {
+                int code = 0;
+                for (int i = 0; i < 4; i++) {
+                    int digit = p + 1 < parser->end ? data_point_hex(p[1]) : -1;
+                    if (digit < 0) {
+                        return data_point_syntax_error(parser, "invalid escape sequence",
+                                                       escape);
+                    }
+                    code = code * 16 + digit;
+                    p++;
+                }
+                c = code < 0x80 ? code : 0xff;
+                break;
+            }
+            default:
+                return data_point_syntax_error(parser, "invalid escape sequence", escape);
+            }
+        }
+
+        if (decoded_size < capacity) {
+            out[decoded_size] = c;
+        }
+        decoded_size++;
+        p++;
+    }
+
+    *size = decoded_size;
+    parser->pos = p + 1;
+    return DATA_POINT_OK;
+}
+
+// parses the number at parser->pos, *integer is set if it has no fraction and no exponent
+// numbers with up to 15 significant digits and a small exponent (which covers all
+// readings) are converted exactly with a single multiplication/division of two exact
+// doubles, everything else goes through strtod()
+static data_point_status_t data_point_parse_number(data_point_parser_t* parser,
+                                                   double* value, int* integer) {
+    const char* start = parser->pos;
+    const char* p = start;
+    const char* end = parser->end;
+
+    uint64_t mantissa = 0;
+    int significant_digits = 0;
+    int exponent = 0;
+    int negative = p < end && *p == '-';
+    p += negative;
+
+    if (p == end || *p < '0' || *p > '9') {
+        return data_point_syntax_error(parser, "invalid number", start);
+    }
+
+    // no leading zeros
+    if (*p == '0') {
+        p++;
+    } else {
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            if (significant_digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant_digits++;
+            } else {
+                exponent++;
+                significant_digits++;
+            }
+        }
+    }
+
+    *integer = 1;
+    if (p < end && *p == '.') {
+        *integer = 0;
+        p++;
+        if (p == end || *p < '0' || *p > '9') {
+            return data_point_syntax_error(parser, "invalid number", start);
+        }
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            // leading zeros of the fraction aren't significant, e.g. 0.005
+            if (mantissa == 0 && *p == '0') {
+                exponent--;
+            } else if (significant_digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                significant_digits++;
+                exponent--;
+            } else {
+                significant_digits++;
+            }
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        *integer = 0;
+        p++;
+        int exponent_negative = 0;
+        if (p < end && (*p == '+' || *p == '-')) {
+            exponent_negative = *p == '-';
+            p++;
+        }
+        if (p == end || *p < '0' || *p > '9') {
+            return data_point_syntax_error(parser, "invalid number", start);
+        }
+        int explicit_exponent = 0;
+        for (; p < end && *p >= '0' && *p <= '9'; p++) {
+            // large enough to overflow/underflow any double
+            if (explicit_exponent < 100000) {
+                explicit_exponent = explicit_exponent * 10 + (*p - '0');
+            }
+        }
+        exponent += exponent_negative ? -explicit_exponent : explicit_exponent;
+    }
+
+    if (p - start > DATA_POINT_MAX_NUMBER_SIZE) {
+        return data_point_syntax_error(parser, "number too long", start);
+    }
+    parser->pos = p;
+
+    // 15 digits are always below 2^53, so the mantissa is exact
+    if (significant_digits <= 15 && exponent >= -22 && exponent <= 22) {
+        double result = (double)mantissa;
+        result = exponent < 0 ? result / data_point_pow10[-exponent]
+                              : result * data_point_pow10[exponent];
+        *value = negative ? -result : result;
+        return DATA_POINT_OK;
+    }
+
+    // the input isn't null terminated
+    char buffer[DATA_POINT_MAX_NUMBER_SIZE + 1];
+    memcpy(buffer, start, p - start);
+    buffer[p - start] = '\0';
+    *value = strtod(buffer, NULL);
+    return DATA_POINT_OK;
+}
+
+// parses true, false or null at parser->pos
+static data_point_status_t data_point_parse_literal(data_point_parser_t* parser) {
+    static const char* literals[] = {"true", "false", "null"};
+    for (int i = 0; i < 3; i++) {
+        size_t size = strlen(literals[i]);
+        if ((size_t)(parser->end - parser->pos) >= size &&
+            memcmp(parser->pos, literals[i], size) == 0) {
+            parser->pos += size;
+            return DATA_POINT_OK;
+        }
+    }
+    return data_point_syntax_error(parser, "unexpected character", parser->pos);
+}
+
+// validates and skips any json value (unknown fields, values of the wrong type)
+static data_point_status_t data_point_skip_value(data_point_parser_t* parser, int depth) {
+    data_point_skip_whitespace(parser);
+    if (parser->pos == parser->end) {
+        return data_point_syntax_error(parser, "unexpected end of input", parser->pos);
+    }
+
+    char c = *parser->pos;
+    if (c == '"') {
+        size_t size;
+        return data_point_parse_string(parser, NULL, 0, &size);
+    }
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        double value;
+        int integer;
+        return data_point_parse_number(parser, &value, &integer);
+    }
+    if (c != '{' && c != '[') {
+        return data_point_parse_literal(parser);
+    }
+
+    if (depth == DATA_POINT_MAX_DEPTH) {
+        return data_point_syntax_error(parser, "nesting too deep", parser->pos);
+    }
+    parser->pos++;
+
+    char close = c == '{' ? '}' : ']';
+    if (data_point_accept(parser, close)) {
+        return DATA_POINT_OK;
+    }
+
+    do {
+        if (c == '{') {
+            data_point_skip_whitespace(parser);
+            if (parser->pos == parser->end || *parser->pos != '"') {
+                return data_point_syntax_error(parser, "expected a key", parser->pos);
+            }
+            size_t size;
+            if (data_point_parse_string(parser, NULL, 0, &size) != DATA_POINT_OK) {
+                return DATA_POINT_SYNTAX_ERROR;
+            }
+            if (!data_point_accept(parser, ':')) {
+                return data_point_syntax_error(parser, "expected ':'", parser->pos);
+            }
+        }
+        if (data_point_skip_value(parser, depth + 1) != DATA_POINT_OK) {
+            return DATA_POINT_SYNTAX_ERROR;
+        }
+    } while (data_point_accept(parser, ','));
+
+    if (!data_point_accept(parser, close)) {
+        const char* error = c == '{' ? "expected ',' or '}'" : "expected ',' or ']'";
+        return data_point_syntax_error(parser, error, parser->pos);
+    }
+    return DATA_POINT_OK;
+}
+
+// parses the value of a reading field, numbers are stored in *value, null counts as
+// missing, anything else is skipped as an invalid value
+static data_point_status_t data_point_parse_field(data_point_parser_t* parser,
+                                                  size_t field, double* value,
+                                                  data_point_field_state_t* state) {
+    data_point_skip_whitespace(parser);
+    if (parser->pos == parser->end) {
+        return data_point_syntax_error(parser, "unexpected end of input", parser->pos);
+    }
+
+    char c = *parser->pos;
+    if (c == '-' || (c >= '0' && c <= '9')) {
+        int integer;
+        if (data_point_parse_number(parser, value, &integer) != DATA_POINT_OK) {
+            return DATA_POINT_SYNTAX_ERROR;
+        }
+        *state = DATA_POINT_FIELD_SET;
+        // unix seconds, no fractions
+        if (field == DATA_POINT_TIMESTAMP &&
+            (!integer || *value < 0 || *value >= DATA_MAX_TIMESTAMP)) {
+            *state = DATA_POINT_FIELD_INVALID;
+        }
+        return DATA_POINT_OK;
+    }
+
+    if (c == 'n') {
+        *state = DATA_POINT_FIELD_MISSING;
+        return data_point_parse_literal(parser);
+    }
+
+    *state = DATA_POINT_FIELD_INVALID;
+    return data_point_skip_value(parser, 0);
+}
+
+// parses one value that should be a reading, positioned after it on success and on
+// DATA_POINT_INVALID
+// fields can come in any order, if a field occurs more than once the last one counts
+static data_point_status_t data_point_parse_value(data_point_parser_t* parser,
+                                                  data_point_t* point) {
+    data_point_skip_whitespace(parser);
+    const char* start = parser->pos;
+    if (start == parser->end) {
+        return data_point_syntax_error(parser, "unexpected end of input", start);
+    }
+
+    if (*start != '{') {
+        if (data_point_skip_value(parser, 0) != DATA_POINT_OK) {
+            return DATA_POINT_SYNTAX_ERROR;
+        }
+        return data_point_error(parser, DATA_POINT_INVALID, "not an object", start);
+    }
+    parser->pos++;
+
+    double values[DATA_POINT_FIELD_COUNT];
+    data_point_field_state_t states[DATA_POINT_FIELD_COUNT] = {DATA_POINT_FIELD_MISSING};
+    const char* value_starts[DATA_POINT_FIELD_COUNT];
+
+    if (!data_point_accept(parser, '}')) {
+        do {
+            data_point_skip_whitespace(parser);
+            if (parser->pos == parser->end || *parser->pos != '"') {
+                return data_point_syntax_error(parser, "expected a key", parser->pos);
+            }
+
+            // longer keys can't be a field name, "temperature" is the longest
+            char key[16];
+            size_t key_size;
+            if (data_point_parse_string(parser, key, sizeof(key), &key_size) !=
+                DATA_POINT_OK) {
+                return DATA_POINT_SYNTAX_ERROR;
+            }
+            if (!data_point_accept(parser, ':')) {
+                return data_point_syntax_error(parser, "expected ':'", parser->pos);
+            }
+
+            size_t field = 0;
+            while (field < DATA_POINT_FIELD_COUNT &&
+                   (key_size != strlen(data_point_fields[field]) ||
+                    memcmp(key, data_point_fields[field], key_size) != 0)) {
+                field++;
+            }
+
+            data_point_status_t status;
+            if (field == DATA_POINT_FIELD_COUNT) {
+                status = data_point_skip_value(parser, 0);
+            } else {
+                data_point_skip_whitespace(parser);
+                value_starts[field] = parser->pos;
+                status =
+                    data_point_parse_field(parser, field, &values[field], &states[field]);
+            }
+            if (status != DATA_POINT_OK) {
+                return DATA_POINT_SYNTAX_ERROR;
+            }
+        } while (data_point_accept(parser, ','));
+
+        if (!data_point_accept(parser, '}')) {
+            return data_point_syntax_error(parser, "expected ',' or '}'", parser->pos);
+        }
+    }
+
+    for (size_t i = 0; i < DATA_POINT_FIELD_COUNT; i++) {
+        if (states[i] == DATA_POINT_FIELD_MISSING && i != DATA_POINT_TIMESTAMP) {
+            return data_point_error(parser, DATA_POINT_INVALID,
+                                    data_point_field_errors[i][0], start);
+        }
+        if (states[i] == DATA_POINT_FIELD_INVALID) {
+            return data_point_error(parser, DATA_POINT_INVALID,
+                                    data_point_field_errors[i][1], value_starts[i]);
+        }
+    }
+
+    if (states[DATA_POINT_TIMESTAMP] == DATA_POINT_FIELD_SET &&
+        values[DATA_POINT_TIMESTAMP] > (double)parser->now + DATA_MAX_CLOCK_SKEW) {
+        return data_point_error(parser, DATA_POINT_INVALID, "timestamp is in the future",
+                                value_starts[DATA_POINT_TIMESTAMP]);
+    }
+
+    point->temperature = values[0];
+    point->humidity = values[1];
+    point->windspeed = values[2];
+    point->pressure = values[3];
+    point->rain = values[4];
+    point->timestamp = states[DATA_POINT_TIMESTAMP] == DATA_POINT_FIELD_SET
+                           ? (time_t)values[DATA_POINT_TIMESTAMP]
+                           : parser->now;
+    return DATA_POINT_OK;
+}
+
+void data_point_parser_init(data_point_parser_t* parser, const char* input, size_t size,
+                            time_t now) {
+    parser->input = input;
+    parser->pos = input;
+    parser->end = input + size;
+    parser->now = now;
+    parser->in_array = 0;
+    parser->error = NULL;
+    parser->error_offset = 0;
+}
+
+int data_point_parser_peek(data_point_parser_t* parser) {
+    data_point_skip_whitespace(parser);
+    return parser->pos < parser->end ? (unsigned char)*parser->pos : -1;
+}
+
+data_point_status_t data_point_parse(data_point_parser_t* parser, data_point_t* point) {
+    data_point_status_t status = data_point_parse_value(parser, point);
+    if (status == DATA_POINT_SYNTAX_ERROR) {
+        return status;
+    }
+
+    // invalid json after an invalid reading is reported as invalid json
+    if (data_point_parser_peek(parser) != -1) {
+        return data_point_syntax_error(parser, "unexpected data after the value",
+                                       parser->pos);
+    }
+    return status;
+}
+
+data_point_status_t data_point_parse_array_item(data_point_parser_t* parser,
+                                                data_point_t* point) {
+    if (!parser->in_array) {
+        if (!data_point_accept(parser, '[')) {
+            return data_point_syntax_error(parser, "expected '['", parser->pos);
+        }
+        parser->in_array = 1;
+        if (!data_point_accept(parser, ']')) {
+            return data_point_parse_value(parser, point);
+        }
+    } else if (data_point_accept(parser, ',')) {
+        return data_point_parse_value(parser, point);
+    } else if (!data_point_accept(parser, ']')) {
+        return data_point_syntax_error(parser, "expected ',' or ']'", parser->pos);
+    }
+
+    if (data_point_parser_peek(parser) != -1) {
+        return data_point_syntax_error(parser, "unexpected data after the value",
+                                       parser->pos);
+    }
+    return DATA_POINT_END;
+}
+
+data_point_status_t data_point_parse_line(data_point_parser_t* parser,
+                                          data_point_t* point) {
+    const char* input_end = parser->end;
+
+    while (parser->pos < input_end) {
+        const char* line_end = memchr(parser->pos, '\n', input_end - parser->pos);
+        if (line_end == NULL) {
+            line_end = input_end;
+        }
+
+        // the line is parsed as if it were the whole input
+        parser->end = line_end;
+        data_point_status_t status = DATA_POINT_END;
+        if (data_point_parser_peek(parser) != -1) {
+            status = data_point_parse(parser, point);
+        }
+
+        parser->end = input_end;
+        parser->pos = line_end < input_end ? line_end + 1 : input_end;
+        // skip empty lines (e.g. the one after the trailing newline)
+        if (status != DATA_POINT_END) {
+            return status;
+        }
+    }
+
+    return DATA_POINT_END;
+}
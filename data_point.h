@@ -0,0 +1,93 @@
+#ifndef __DATA_POINT_H
+#define __DATA_POINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// single pass parser for readings, json objects like
+// { "temperature": 16.9, "humidity": 79.7, "windspeed": 1.76, "pressure": 973.9,
+//   "rain": 4.7, "timestamp": 1600000000 }
+// the values go straight into a data_point_t, nothing is allocated and the input doesn't
+// have to be null terminated
+// the json is validated strictly (RFC 8259) and errors report the byte offset in the
+// input where they were found, unknown fields are validated and skipped
+
+// timestamps are limited to 43 bits so timestamp << 20 fits into the id, see migration 2
+// in server.c
+#define DATA_MAX_TIMESTAMP ((int64_t)1 << 43)
+
+// seconds a reading's timestamp may be ahead of the server's clock, later readings are
+// invalid (a station with a wrong clock would otherwise post readings from the future)
+#define DATA_MAX_CLOCK_SKEW 300
+
+// max nesting of arrays/objects within a value, deeper input is a syntax error
+#define DATA_POINT_MAX_DEPTH 32
+
+// numbers longer than this (in characters) are a syntax error, readings never come close
+#define DATA_POINT_MAX_NUMBER_SIZE 127
+
+// number of measured values of a reading (all fields except the timestamp)
+#define DATA_POINT_VALUE_COUNT 5
+
+// field names of a reading, the measured values in the column order of the data table
+// followed by "timestamp"
+extern const char* data_point_fields[];
+
+typedef struct data_point data_point_t;
+typedef struct data_point_parser data_point_parser_t;
+
+// a row of the data table
+struct data_point {
+    double temperature;
+    double humidity;
+    double windspeed;
+    double pressure;
+    double rain;
+    time_t timestamp;
+};
+
+typedef enum data_point_status {
+    // a valid reading was parsed
+    DATA_POINT_OK,
+    // the value is valid json but not a valid reading (e.g. missing rain), the parser is
+    // positioned after it, so the next one can be parsed
+    DATA_POINT_INVALID,
+    // the input is not valid json
+    DATA_POINT_SYNTAX_ERROR,
+    // no more readings (closing ] of an array, end of the input)
+    DATA_POINT_END,
+} data_point_status_t;
+
+struct data_point_parser {
+    // start of the input, error offsets are relative to it
+    const char* input;
+    const char* pos;
+    const char* end;
+    // timestamp of readings without one
+    time_t now;
+    // set once data_point_parse_array_item() has consumed the opening [
+    int in_array;
+    // set with DATA_POINT_INVALID and DATA_POINT_SYNTAX_ERROR, e.g. "missing rain" or
+    // "expected ':'", offset of the value/character the error refers to
+    const char* error;
+    size_t error_offset;
+};
+
+void data_point_parser_init(data_point_parser_t* parser, const char* input, size_t size,
+                            time_t now);
+// skips whitespace, returns the next character or -1 at the end of the input
+int data_point_parser_peek(data_point_parser_t* parser);
+
+// parses an input consisting of a single reading (surrounded by whitespace)
+data_point_status_t data_point_parse(data_point_parser_t* parser, data_point_t* point);
+// parses the next element of an input consisting of an array of readings
+// returns DATA_POINT_END after the closing ], a syntax error ends the whole array
+data_point_status_t data_point_parse_array_item(data_point_parser_t* parser,
+                                                data_point_t* point);
+// parses the next non-empty line of newline-delimited json (one reading per line)
+// returns DATA_POINT_END at the end of the input, a syntax error only affects its line
+data_point_status_t data_point_parse_line(data_point_parser_t* parser,
+                                          data_point_t* point);
+
+#endif // __DATA_POINT_H
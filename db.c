@@ -0,0 +1,568 @@
+#include "db.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct db_cache db_cache_t;
+
+struct db_cache {
+    // most recently used first
+    db_stmt_t** stmts;
+    size_t count;
+    size_t capacity;
+    // all caches are linked so db_finalize() can reach them
+    db_cache_t* next;
+};
+
+static __thread db_cache_t* db_thread_cache;
+
+static pthread_mutex_t db_caches_mutex = PTHREAD_MUTEX_INITIALIZER;
+static db_cache_t* db_caches;
+
+// max number of cached statements per thread, DB_STMT_CACHE_SIZE for every connection a
+// thread may use, set by db_open()
+static size_t db_cache_limit = DB_STMT_CACHE_SIZE;
+
+static db_cache_t* db_cache_get() {
+    if (db_thread_cache == NULL) {
+        db_cache_t* cache = calloc(1, sizeof(db_cache_t));
+        if (cache == NULL) {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&db_caches_mutex);
+        cache->next = db_caches;
+        db_caches = cache;
+        pthread_mutex_unlock(&db_caches_mutex);
+
+        db_thread_cache = cache;
+    }
+    return db_thread_cache;
+}
+
+// makes room for a statement of db at the front of the cache, a full cache drops its
+// least recently used idle statement of db
+// statements of other connections are left alone, their connection may be in use by
+// another thread right now (connections are opened without a mutex)
+// returns 0 if there is no room
+static int db_cache_make_room(db_cache_t* cache, sqlite3* db) {
+    if (cache->count < db_cache_limit) {
+        if (cache->count == cache->capacity) {
+            size_t capacity = cache->capacity > 0 ? cache->capacity * 2 : 16;
+            capacity = capacity < db_cache_limit ? capacity : db_cache_limit;
+            db_stmt_t** stmts = realloc(cache->stmts, sizeof(db_stmt_t*) * capacity);
+            if (stmts == NULL) {
+                return 0;
+            }
+            cache->stmts = stmts;
+            cache->capacity = capacity;
+        }
+        memmove(&cache->stmts[1], &cache->stmts[0], sizeof(db_stmt_t*) * cache->count);
+        cache->count++;
+        return 1;
+    }
+
+    for (size_t i = cache->count; i-- > 0;) {
+        db_stmt_t* stmt = cache->stmts[i];
+        if (stmt->db == db && !__atomic_load_n(&stmt->in_use, __ATOMIC_ACQUIRE)) {
+            sqlite3_finalize(stmt->stmt);
+            free((char*)stmt->sql);
+            free(stmt);
+            memmove(&cache->stmts[1], &cache->stmts[0], sizeof(db_stmt_t*) * i);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+db_stmt_t* db_prepare(sqlite3* db, const char* sql) {
+    db_cache_t* cache = db_cache_get();
+
+    if (cache != NULL) {
+        for (size_t i = 0; i < cache->count; i++) {
+            db_stmt_t* stmt = cache->stmts[i];
+            if (stmt->db == db &&
+                (stmt->sql == sql || strcmp(stmt->sql, sql) == 0) &&
+                !__atomic_load_n(&stmt->in_use, __ATOMIC_ACQUIRE)) {
+                stmt->in_use = 1;
+                memmove(&cache->stmts[1], &cache->stmts[0], sizeof(db_stmt_t*) * i);
+                cache->stmts[0] = stmt;
+                return stmt;
+            }
+        }
+    }
+
+    db_stmt_t* stmt = malloc(sizeof(db_stmt_t));
+    if (stmt == NULL) {
+        return NULL;
+    }
+
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt->stmt, NULL) !=
+        SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(db));
+        free(stmt);
+        return NULL;
+    }
+
+    stmt->db = db;
+    stmt->sql = sql;
+    stmt->in_use = 1;
+    stmt->cached = 0;
+
+    // the cache keeps its own copy of the sql so callers may pass temporary strings
+    char* sql_copy;
+    if (cache != NULL && (sql_copy = strdup(sql)) != NULL) {
+        if (db_cache_make_room(cache, db)) {
+            stmt->sql = sql_copy;
+            stmt->cached = 1;
+            cache->stmts[0] = stmt;
+        } else {
+            free(sql_copy);
+        }
+    }
+
+    return stmt;
+}
+
+void db_release(db_stmt_t* stmt) {
+    if (!stmt->cached) {
+        sqlite3_finalize(stmt->stmt);
+        free(stmt);
+        return;
+    }
+
+    sqlite3_reset(stmt->stmt);
+    sqlite3_clear_bindings(stmt->stmt);
+    __atomic_store_n(&stmt->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void db_finalize(sqlite3* db) {
+    pthread_mutex_lock(&db_caches_mutex);
+    for (db_cache_t* cache = db_caches; cache != NULL; cache = cache->next) {
+        size_t count = 0;
+        for (size_t i = 0; i < cache->count; i++) {
+            db_stmt_t* stmt = cache->stmts[i];
+            if (stmt->db != db) {
+                cache->stmts[count++] = stmt;
+                continue;
+            }
+
+            sqlite3_finalize(stmt->stmt);
+            free((char*)stmt->sql);
+            free(stmt);
+        }
+        cache->count = count;
+    }
+    pthread_mutex_unlock(&db_caches_mutex);
+}
+
+// returns 0 on failure
+static int db_apply_pragmas(sqlite3* conn, char** pragmas, size_t pragma_count) {
+    for (size_t i = 0; i < pragma_count; i++) {
+        char* pragma = pragmas[i];
+
+        char sql[256];
+        snprintf(sql, sizeof(sql), "PRAGMA %s", pragma);
+        if (sqlite3_exec(conn, sql, NULL, NULL, NULL) != SQLITE_OK) {
+            printf("\033[31mERROR\033[0m PRAGMA %s: %s\n", pragma, sqlite3_errmsg(conn));
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+// returns NULL on failure, the connection is only used by one thread at a time
+static sqlite3* db_connect(const char* file, int flags, char** pragmas,
+                           size_t pragma_count) {
+    sqlite3* conn;
+    if (sqlite3_open_v2(file, &conn, flags | SQLITE_OPEN_NOMUTEX, NULL) != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s: %s\n", file, sqlite3_errmsg(conn));
+        sqlite3_close(conn);
+        return NULL;
+    }
+
+    char* defaults[] = {DB_DEFAULT_PRAGMAS};
+    if (!db_apply_pragmas(conn, defaults, sizeof(defaults) / sizeof(defaults[0])) ||
+        !db_apply_pragmas(conn, pragmas, pragma_count)) {
+        sqlite3_close(conn);
+        return NULL;
+    }
+
+    return conn;
+}
+
+// runs a statement without results through the statement cache of the writer thread
+static int db_run(sqlite3* conn, const char* sql) {
+    db_stmt_t* stmt = db_prepare(conn, sql);
+    if (stmt == NULL) {
+        return SQLITE_ERROR;
+    }
+
+    int rc = sqlite3_step(stmt->stmt);
+    if (rc == SQLITE_DONE) {
+        rc = SQLITE_OK;
+    } else {
+        printf("\033[31mERROR\033[0m %s: %s\n", sql, sqlite3_errmsg(conn));
+    }
+
+    db_release(stmt);
+    return rc;
+}
+
+// wait-free for the submitters: a single atomic exchange, the previous tail is linked
+// to the write right after
+static void db_writes_push(db_t* db, db_write_t* write) {
+    write->next = NULL;
+    db_write_t* prev = __atomic_exchange_n(&db->writes_tail, write, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&prev->next, write, __ATOMIC_RELEASE);
+}
+
+// returns NULL if the queue is empty or a push is halfway done (tail exchanged, but not
+// linked yet)
+static db_write_t* db_writes_try_pop(db_t* db) {
+    db_write_t* head = db->writes_head;
+    db_write_t* next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+
+    if (head == &db->writes_stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        db->writes_head = next;
+        head = next;
+        next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    }
+
+    if (next != NULL) {
+        db->writes_head = next;
+        return head;
+    }
+
+    if (head != __atomic_load_n(&db->writes_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    // head is the last write, put the stub behind it so it can be unlinked
+    db_writes_push(db, &db->writes_stub);
+    next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        db->writes_head = next;
+        return head;
+    }
+
+    return NULL;
+}
+
+// only called after taking a writes_pending token, the write is in the queue (or
+// about to be linked by its submitter)
+static db_write_t* db_writes_pop(db_t* db) {
+    db_write_t* write;
+    while ((write = db_writes_try_pop(db)) == NULL) {
+        sched_yield();
+    }
+    return write;
+}
+
+// waits for the next write until deadline, returns 0 on timeout
+static int db_writes_wait(db_t* db, struct timespec* deadline) {
+    int rc;
+    do {
+        rc = deadline != NULL ? sem_timedwait(&db->writes_pending, deadline)
+                              : sem_trywait(&db->writes_pending);
+    } while (rc != 0 && errno == EINTR);
+    return rc == 0;
+}
+
+static void* db_writer_run(void* arg) {
+    db_t* db = arg;
+
+    int stopping = 0;
+    while (!stopping) {
+        while (sem_wait(&db->writes_pending) != 0) {
+            // EINTR
+        }
+
+        struct timespec deadline;
+        if (db->commit_window > 0) {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += (long)db->commit_window * 1000000;
+            deadline.tv_sec += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+        }
+
+        int rc = db_run(db->writer, "BEGIN IMMEDIATE");
+
+        size_t batch_size = 0;
+        db_write_t* write = db_writes_pop(db);
+        while (1) {
+            if (write->callback == NULL) {
+                stopping = 1;
+                break;
+            }
+
+            // a failing write only rolls back its own changes
+            if (rc == SQLITE_OK) {
+                db_run(db->writer, "SAVEPOINT db_write");
+                write->rc = write->callback(db->writer, write->ctx);
+                if (write->rc != SQLITE_OK) {
+                    db_run(db->writer, "ROLLBACK TO db_write");
+                }
+                db_run(db->writer, "RELEASE db_write");
+            } else {
+                write->rc = rc;
+            }
+            db->batch[batch_size++] = write;
+
+            if (batch_size == db->batch_size ||
+                !db_writes_wait(db, db->commit_window > 0 ? &deadline : NULL)) {
+                break;
+            }
+            write = db_writes_pop(db);
+        }
+
+        if (rc == SQLITE_OK && db->before_commit != NULL) {
+            rc = db->before_commit(db->writer, db->before_commit_ctx);
+            if (rc != SQLITE_OK) {
+                db_run(db->writer, "ROLLBACK");
+            }
+        }
+        if (rc == SQLITE_OK) {
+            rc = db_run(db->writer, "COMMIT");
+            if (rc != SQLITE_OK) {
+                db_run(db->writer, "ROLLBACK");
+            }
+        }
+        if (db->after_commit != NULL) {
+            db->after_commit(rc, db->after_commit_ctx);
+        }
+
+        // acknowledge the writes only now that they are durable (as far as the
+        // synchronous mode goes)
+        for (size_t i = 0; i < batch_size; i++) {
+            if (rc != SQLITE_OK) {
+                db->batch[i]->rc = rc;
+            }
+            sem_post(&db->batch[i]->done);
+        }
+    }
+
+    return NULL;
+}
+
+db_t* db_open(const char* file, db_config_t* config) {
+    size_t reader_count = config->reader_count;
+    if (reader_count == 0) {
+        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+        reader_count = cpu_count > 0 ? cpu_count : 1;
+    }
+
+    db_t* db = calloc(1, sizeof(db_t));
+    if (db == NULL) {
+        return NULL;
+    }
+    // any thread may use any reader (and the writer thread the writer), so a thread may
+    // end up with the statements of every connection
+    db_cache_limit = DB_STMT_CACHE_SIZE * (reader_count + 1);
+
+    // the writer creates the database file and switches it to WAL before the readers
+    // open it
+    db->writer = db_connect(file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE,
+                            config->pragmas, config->pragma_count);
+    if (db->writer == NULL) {
+        free(db);
+        return NULL;
+    }
+    char* writer_pragmas[] = {"journal_mode=WAL", NULL};
+    char synchronous[64];
+    if (config->synchronous != NULL) {
+        snprintf(synchronous, sizeof(synchronous), "synchronous=%s", config->synchronous);
+        writer_pragmas[1] = synchronous;
+    }
+    if (!db_apply_pragmas(db->writer, writer_pragmas, writer_pragmas[1] != NULL ? 2 : 1)) {
+        sqlite3_close(db->writer);
+        free(db);
+        return NULL;
+    }
+
+    db->readers = malloc(sizeof(sqlite3*) * reader_count);
+    db->idle_readers = malloc(sizeof(sqlite3*) * reader_count);
+    db->batch_size = config->batch_size > 0 ? config->batch_size : DB_BATCH_SIZE;
+    db->commit_window = config->commit_window;
+    db->before_commit = config->before_commit;
+    db->before_commit_ctx = config->before_commit_ctx;
+    db->after_commit = config->after_commit;
+    db->after_commit_ctx = config->after_commit_ctx;
+    db->batch = malloc(sizeof(db_write_t*) * db->batch_size);
+    if (db->readers == NULL || db->idle_readers == NULL || db->batch == NULL) {
+        db_close(db);
+        return NULL;
+    }
+    for (size_t i = 0; i < reader_count; i++) {
+        sqlite3* reader = db_connect(file, SQLITE_OPEN_READONLY, config->pragmas,
+                                     config->pragma_count);
+        if (reader == NULL) {
+            db_close(db);
+            return NULL;
+        }
+        db->readers[db->reader_count++] = reader;
+        db->idle_readers[db->idle_count++] = reader;
+    }
+    // the reader timeout must not jump with the wall clock
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&db->readers_mutex, NULL);
+    pthread_cond_init(&db->readers_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    db->writes_stub.next = NULL;
+    db->writes_head = &db->writes_stub;
+    db->writes_tail = &db->writes_stub;
+    sem_init(&db->writes_pending, 0, 0);
+    if (pthread_create(&db->writer_thread, NULL, db_writer_run, db) != 0) {
+        printf("\033[31mERROR\033[0m pthread_create(): %s\n", strerror(errno));
+        db_close(db);
+        return NULL;
+    }
+    db->writer_running = 1;
+
+    return db;
+}
+
+void db_close(db_t* db) {
+    if (db->writer_running) {
+        // queued after all pending writes, the writer thread commits them first
+        db_write_t stop = {.callback = NULL};
+        db_writes_push(db, &stop);
+        sem_post(&db->writes_pending);
+        pthread_join(db->writer_thread, NULL);
+    }
+
+    for (size_t i = 0; i < db->reader_count; i++) {
+        db_finalize(db->readers[i]);
+        sqlite3_close(db->readers[i]);
+    }
+    db_finalize(db->writer);
+    sqlite3_close(db->writer);
+
+    free(db->readers);
+    free(db->idle_readers);
+    free(db->batch);
+    free(db);
+}
+
+sqlite3* db_reader_acquire(db_t* db) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_nsec += (long)DB_READER_TIMEOUT * 1000000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    sqlite3* reader = NULL;
+    pthread_mutex_lock(&db->readers_mutex);
+    int rc = 0;
+    while (db->idle_count == 0 && rc != ETIMEDOUT) {
+        rc = pthread_cond_timedwait(&db->readers_cond, &db->readers_mutex, &deadline);
+    }
+    if (db->idle_count > 0) {
+        reader = db->idle_readers[--db->idle_count];
+    }
+    pthread_mutex_unlock(&db->readers_mutex);
+    return reader;
+}
+
+void db_reader_release(db_t* db, sqlite3* reader) {
+    pthread_mutex_lock(&db->readers_mutex);
+    db->idle_readers[db->idle_count++] = reader;
+    pthread_cond_signal(&db->readers_cond);
+    pthread_mutex_unlock(&db->readers_mutex);
+}
+
+int db_write(db_t* db, db_write_callback_t callback, void* ctx) {
+    db_write_t write = {
+        .callback = callback,
+        .ctx = ctx,
+        .rc = SQLITE_OK,
+    };
+    sem_init(&write.done, 0, 0);
+
+    db_writes_push(db, &write);
+    sem_post(&db->writes_pending);
+
+    while (sem_wait(&write.done) != 0) {
+        // EINTR
+    }
+    sem_destroy(&write.done);
+
+    return write.rc;
+}
+
+static int db_exec_callback(sqlite3* conn, void* sql) {
+    int rc = sqlite3_exec(conn, sql, NULL, NULL, NULL);
+    if (rc != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(conn));
+    }
+    return rc;
+}
+
+int db_exec(db_t* db, const char* sql) {
+    return db_write(db, db_exec_callback, (void*)sql);
+}
+
+typedef struct db_migrations {
+    const char** migrations;
+    size_t count;
+} db_migrations_t;
+
+static int db_migrate_callback(sqlite3* conn, void* ctx) {
+    db_migrations_t* migrations = ctx;
+
+    sqlite3_stmt* stmt;
+    int rc = sqlite3_prepare_v2(conn, "PRAGMA user_version", -1, &stmt, NULL);
+    if (rc != SQLITE_OK || sqlite3_step(stmt) != SQLITE_ROW) {
+        printf("\033[31mERROR\033[0m PRAGMA user_version: %s\n", sqlite3_errmsg(conn));
+        sqlite3_finalize(stmt);
+        return SQLITE_ERROR;
+    }
+    size_t version = sqlite3_column_int(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    if (version > migrations->count) {
+        printf("\033[31mERROR\033[0m database version %zu is newer than this server "
+               "(version %zu)\n",
+               version, migrations->count);
+        return SQLITE_ERROR;
+    }
+
+    for (; version < migrations->count; version++) {
+        rc = sqlite3_exec(conn, migrations->migrations[version], NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            printf("\033[31mERROR\033[0m migration to version %zu: %s\n", version + 1,
+                   sqlite3_errmsg(conn));
+            return rc;
+        }
+
+        char sql[64];
+        snprintf(sql, sizeof(sql), "PRAGMA user_version = %zu", version + 1);
+        rc = sqlite3_exec(conn, sql, NULL, NULL, NULL);
+        if (rc != SQLITE_OK) {
+            printf("\033[31mERROR\033[0m %s: %s\n", sql, sqlite3_errmsg(conn));
+            return rc;
+        }
+
+        printf("\033[32mINFO\033[0m migrated database to version %zu\n", version + 1);
+    }
+
+    return SQLITE_OK;
+}
+
+int db_migrate(db_t* db, const char** migrations, size_t migration_count) {
+    db_migrations_t ctx = {.migrations = migrations, .count = migration_count};
+    return db_write(db, db_migrate_callback, &ctx);
+}
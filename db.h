@@ -0,0 +1,161 @@
+#ifndef __DB_H
+#define __DB_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sqlite3.h>
+#include <stddef.h>
+
+// the database is accessed through a pool of read-only connections for the queries and
+// a single writer connection owned by a dedicated thread, with WAL journaling the
+// readers never block behind the writer
+// the writer thread commits writes in groups: everything queued while the previous
+// transaction was committing (up to batch_size writes, optionally waiting commit_window
+// ms for more) goes into one transaction, so the fsync cost is shared by the batch
+
+// defaults applied to every connection before the pragmas passed to db_open()
+// journal_mode=WAL is only set on the writer, it is persistent in the database file
+#define DB_DEFAULT_PRAGMAS                                                               \
+    "synchronous=NORMAL", "mmap_size=268435456", "cache_size=-16384",                  \
+        "temp_store=MEMORY", "busy_timeout=5000"
+
+// per-thread cache of prepared statements, keyed by database handle and sql
+// db_prepare() hands out a cached statement that isn't in use or compiles a new one,
+// db_release() resets it for the next request instead of finalizing it
+// the cache has room for DB_STMT_CACHE_SIZE statements per connection, when it is full
+// the least recently used idle statement of the connection is finalized to make room
+
+// max number of cached statements per thread and connection, statements beyond that
+// (all cached ones in use) are finalized on release
+#define DB_STMT_CACHE_SIZE 16
+
+// ms db_reader_acquire() waits for an idle reader
+#define DB_READER_TIMEOUT 5000
+
+// default max number of writes committed in one transaction
+#define DB_BATCH_SIZE 512
+
+typedef struct db db_t;
+typedef struct db_config db_config_t;
+typedef struct db_stmt db_stmt_t;
+typedef struct db_write db_write_t;
+
+// runs on the writer thread with the writer connection, returns an sqlite result code
+typedef int (*db_write_callback_t)(sqlite3* conn, void* ctx);
+// runs on the writer thread once a transaction is over, rc is the result of the commit
+// (SQLITE_OK if it was committed)
+typedef void (*db_commit_callback_t)(int rc, void* ctx);
+
+// a write waiting for the writer thread, lives on the submitter's stack
+struct db_write {
+    // NULL = stop the writer thread
+    db_write_callback_t callback;
+    void* ctx;
+    int rc;
+    // posted once the write's transaction is committed (or rolled back)
+    sem_t done;
+    db_write_t* next;
+};
+
+struct db_config {
+    // number of read-only connections, 0 = number of cpus
+    size_t reader_count;
+    // applied to every connection after the defaults, e.g. "cache_size=-8000"
+    char** pragmas;
+    size_t pragma_count;
+    // max number of writes per transaction
+    size_t batch_size;
+    // ms the writer waits for more writes before committing a batch, 0 = only batch
+    // what is already queued
+    int commit_window;
+    // synchronous mode of the writer (OFF, NORMAL or FULL), in WAL mode NORMAL keeps
+    // the database consistent but may lose the last commits on power loss, FULL syncs
+    // every commit
+    char* synchronous;
+    // optional, runs on the writer thread at the end of every transaction before it is
+    // committed, e.g. to write what the writes of the transaction accumulated in memory
+    // if it fails the whole transaction is rolled back
+    db_write_callback_t before_commit;
+    void* before_commit_ctx;
+    // optional, runs on the writer thread after every transaction, before its writes are
+    // acknowledged, e.g. to publish or drop what the writes of the transaction collected
+    db_commit_callback_t after_commit;
+    void* after_commit_ctx;
+};
+
+struct db {
+    // read-only connections, idle ones are handed out by db_reader_acquire()
+    sqlite3** readers;
+    size_t reader_count;
+    sqlite3** idle_readers;
+    size_t idle_count;
+    pthread_mutex_t readers_mutex;
+    pthread_cond_t readers_cond;
+
+    // only used by the writer thread
+    sqlite3* writer;
+    pthread_t writer_thread;
+    int writer_running;
+    size_t batch_size;
+    int commit_window;
+    db_write_callback_t before_commit;
+    void* before_commit_ctx;
+    db_commit_callback_t after_commit;
+    void* after_commit_ctx;
+    // writes of the current transaction
+    db_write_t** batch;
+
+    // lock-free multi-producer single-consumer queue of writes, submitters push at the
+    // tail, the writer thread pops at the head, the stub keeps the queue non-empty
+    db_write_t* writes_head;
+    db_write_t* writes_tail;
+    db_write_t writes_stub;
+    // counts the queued writes, the writer thread sleeps on it
+    sem_t writes_pending;
+};
+
+struct db_stmt {
+    sqlite3_stmt* stmt;
+    sqlite3* db;
+    const char* sql;
+    // set while handed out, cleared by db_release() which may run on another thread
+    // (e.g. once a streamed response is done)
+    int in_use;
+    // 0 = not part of a cache, finalized by db_release()
+    int cached;
+};
+
+// opens the writer and reader connections and starts the writer thread
+// returns NULL and logs the sqlite error on failure
+db_t* db_open(const char* file, db_config_t* config);
+// stops the writer thread and closes all connections, no requests may be running
+void db_close(db_t* db);
+
+// blocks while all readers are in use (e.g. held by streamed responses to slow clients)
+// returns NULL if none became idle within DB_READER_TIMEOUT, the request should be
+// answered with 503 then
+sqlite3* db_reader_acquire(db_t* db);
+void db_reader_release(db_t* db, sqlite3* reader);
+
+// runs callback on the writer thread and waits until its transaction is committed
+// returns the callback's result, or the error of the commit
+// callback must not begin or end transactions, it runs inside a savepoint that is
+// rolled back if it fails, so the other writes of the batch are not affected
+int db_write(db_t* db, db_write_callback_t callback, void* ctx);
+// runs sql on the writer thread, e.g. for schema changes
+int db_exec(db_t* db, const char* sql);
+// brings the schema up to date: migrations[i] upgrades the database from version i to
+// i + 1, the version is kept in PRAGMA user_version
+// runs the pending migrations on the writer thread in one transaction, so a failing
+// migration leaves the database untouched
+int db_migrate(db_t* db, const char** migrations, size_t migration_count);
+
+// returns NULL and logs the sqlite error if the statement can't be compiled
+db_stmt_t* db_prepare(sqlite3* db, const char* sql);
+// resets the statement and clears its bindings so it can be handed out again
+void db_release(db_stmt_t* stmt);
+// finalizes the cached statements of all threads for db, call before sqlite3_close()
+// once no requests are running anymore
+void db_finalize(sqlite3* db);
+
+#endif // __DB_H
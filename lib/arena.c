@@ -0,0 +1,113 @@
+// Copyright (C) 2021 Lennard Walter
+// License: MIT
+
+#include "arena.h"
+
+#include <stdlib.h>
+
+#define ARENA_ALIGN(size) (((size) + 15) & ~(size_t)15)
+
+static arena_block_t* arena_block_new(size_t size, arena_block_t* next) {
+    arena_block_t* block = malloc(sizeof(arena_block_t) + size);
+    if (block == NULL) {
+        return NULL;
+    }
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+// returns NULL if out of memory
+arena_t* arena_new() {
+    arena_t* arena = malloc(sizeof(arena_t));
+    if (arena == NULL) {
+        return NULL;
+    }
+
+    arena->blocks = arena_block_new(ARENA_BLOCK_SIZE, NULL);
+    if (arena->blocks == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    arena->used = 0;
+    return arena;
+}
+
+void arena_free(arena_t* arena) {
+    arena_block_t* block = arena->blocks;
+    while (block != NULL) {
+        arena_block_t* next = block->next;
+        free(block);
+        block = next;
+    }
+    free(arena);
+}
+
+// returns memory aligned to 16 bytes or NULL if out of memory
+void* arena_alloc(arena_t* arena, size_t size) {
+    size = ARENA_ALIGN(size);
+
+    arena_block_t* block = arena->blocks;
+    if (block->size - block->used < size) {
+        // double the block size so large requests only need a few blocks
+        size_t block_size = block->size * 2;
+        if (block_size < size) {
+            block_size = size;
+        }
+        block = arena_block_new(block_size, block);
+        if (block == NULL) {
+            return NULL;
+        }
+        arena->blocks = block;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += size;
+    arena->used += size;
+    return ptr;
+}
+
+// releases everything allocated from the arena
+// if more than one block was needed, they are merged into a single block of the total
+// size so the next similar request fits into it (up to ARENA_MAX_RETAINED_SIZE)
+void arena_reset(arena_t* arena) {
+    arena_block_t* block = arena->blocks;
+
+    if (block->next != NULL) {
+        size_t size = arena->used;
+        if (size > ARENA_MAX_RETAINED_SIZE) {
+            size = ARENA_MAX_RETAINED_SIZE;
+        } else if (size < ARENA_BLOCK_SIZE) {
+            size = ARENA_BLOCK_SIZE;
+        }
+
+        arena_block_t* merged = arena_block_new(size, NULL);
+
+        // keep the oldest block if there is no memory for the merged one
+        while (block->next != NULL) {
+            arena_block_t* next = block->next;
+            free(block);
+            block = next;
+        }
+
+        if (merged != NULL) {
+            free(block);
+            block = merged;
+        }
+        arena->blocks = block;
+    }
+
+    block->used = 0;
+    arena->used = 0;
+}
+
+int arena_owns(arena_t* arena, void* ptr) {
+    for (arena_block_t* block = arena->blocks; block != NULL; block = block->next) {
+        if ((char*)ptr >= block->data && (char*)ptr < block->data + block->size) {
+            return 1;
+        }
+    }
+    return 0;
+}
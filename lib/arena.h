@@ -0,0 +1,42 @@
+// Copyright (C) 2021 Lennard Walter
+// License: MIT
+
+#ifndef __ARENA_H
+#define __ARENA_H
+
+#include <stddef.h>
+
+// bump allocator for objects that all die at the same time (e.g. everything belonging
+// to one http request), individual allocations are never freed, arena_reset() releases
+// all of them at once
+
+// size of the first block, large enough for a typical request/response pair
+#define ARENA_BLOCK_SIZE 4096
+// max size of the block that is kept around by arena_reset()
+#define ARENA_MAX_RETAINED_SIZE (64 * 1024)
+
+typedef struct arena arena_t;
+typedef struct arena_block arena_block_t;
+
+struct arena_block {
+    arena_block_t* next;
+    size_t size;
+    size_t used;
+    _Alignas(16) char data[];
+};
+
+struct arena {
+    // current block first, the older blocks follow
+    arena_block_t* blocks;
+    // bytes allocated since the last reset
+    size_t used;
+};
+
+arena_t* arena_new();
+void arena_free(arena_t* arena);
+
+void* arena_alloc(arena_t* arena, size_t size);
+void arena_reset(arena_t* arena);
+int arena_owns(arena_t* arena, void* ptr);
+
+#endif // __ARENA_H
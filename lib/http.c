@@ -1,149 +1,1645 @@
 // Copyright (C) 2021 Lennard Walter
 // License: MIT
 
+#define _GNU_SOURCE // memmem(), accept4(), strcasestr()
+
 #include "http.h"
 
+#include "arena.h"
+#include "router.h"
+
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 
 static char* HTTP_METHOD_STRINGS[] = {"GET", "POST"};
 
+const char* http_encoding_names[HTTP_ENCODING_COUNT] = {NULL, "gzip", "deflate"};
+
+// arena of the request the current thread is working on, NULL outside of requests
+static __thread arena_t* http_arena = NULL;
+
+// incremental request reader
+// buffers a request until its head and Content-Length bytes of body have arrived,
+// the buffer grows as needed up to the server's max_request_size
+struct http_reader {
+    char* buffer;
+    size_t capacity;
+    // bytes in the buffer, may include the start of the next pipelined request
+    size_t size;
+    // how far the buffer has been searched for the end of the head
+    size_t scanned;
+    // 0 until the end of the head has been found
+    size_t head_size;
+    size_t content_length;
+    // size of the complete request, the parser writes a \0 at this offset so the
+    // overwritten byte is kept in saved_byte
+    size_t request_size;
+    char saved_byte;
+};
+
+// buffered body data of a streamed response, queued as one chunk when full
+// the head goes out together with the first chunk, by then it is known whether the body
+// reaches the size for compression
+// the callback is called again once the queued output has been sent, so a slow client
+// doesn't keep a worker busy (epoll mode)
+struct http_stream {
+    int failed;
+    size_t chunk_count;
+    size_t size;
+    http_stream_tap_t tap;
+    void* tap_ctx;
+    http_response_t* response;
+    int compression_level;
+    size_t compression_min_size;
+    // set once the encoding has been decided (first flush)
+    int started;
+    int head_sent;
+    // set if the body is compressed with zstream into encoded
+    int compressing;
+    z_stream zstream;
+    size_t encoded_size;
+    // output waiting to be sent (head, chunk size lines and chunks), out_offset bytes of
+    // it have been sent
+    char* out;
+    size_t out_size;
+    size_t out_capacity;
+    size_t out_offset;
+    // set once the callback is done and the last chunk is queued
+    int done;
+    char buffer[HTTP_STREAM_CHUNK_SIZE];
+    char encoded[HTTP_STREAM_CHUNK_SIZE];
+};
+
+// returned by http_reader_fill() if a request exceeds max_request_size
+#define HTTP_READER_TOO_LARGE (-2)
+
+typedef struct http_reactor http_reactor_t;
+
+// per-socket state of the epoll loop
+enum http_connection_state {
+    HTTP_CONNECTION_READING,    // reactor reads until a request is complete
+    HTTP_CONNECTION_PROCESSING, // queued or owned by a worker running the handler
+    HTTP_CONNECTION_WRITING,    // reactor writes the response
+    HTTP_CONNECTION_STREAMING,  // reactor writes the queued output of a streamed body
+    HTTP_CONNECTION_CLOSED,     // closed, reused after the current batch of events
+};
+
+typedef struct http_connection {
+    int sock_fd;
+    http_reactor_t* reactor;
+    enum http_connection_state state;
+    // set if an error is reported while a worker owns the connection, it is closed
+    // once the worker hands it back
+    int closed;
+    http_request_t* request;
+    http_response_t* response;
+    // streamed body being produced by the workers, NULL for other responses
+    http_stream_t* stream;
+    // set by the worker once it has sent a streamed response, -1 if that failed, 0 while
+    // the reactor has to wait for the socket
+    int sent;
+    // number of requests handled on this connection (keep-alive)
+    size_t request_count;
+    char head[HTTP_MAX_RESPONSE_HEAD_SIZE];
+    size_t head_size;
+    size_t bytes_written;
+    http_reader_t reader;
+    // request and response objects, reset once the response is written
+    arena_t* arena;
+    // next finished connection in the reactor's completion list, or next free
+    // connection object
+    struct http_connection* next;
+    // list of connections ordered by last activity, used for the idle timeout
+    // connections owned by a worker are not part of it
+    struct http_connection* idle_prev;
+    struct http_connection* idle_next;
+    time_t last_active;
+} http_connection_t;
+
+// bounded fifo between the accepting/reading threads and the workers
+typedef struct http_work_queue {
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    void** items;
+    size_t capacity;
+    size_t head;
+    size_t length;
+} http_work_queue_t;
+
+struct http_reactor {
+    http_server_t* server;
+    http_work_queue_t* queue;
+    int epoll_fd;
+    int listen_fd;
+    // workers write to the eventfd after pushing a connection to the completion list
+    int event_fd;
+    pthread_mutex_t completions_mutex;
+    http_connection_t* completions;
+    // streamed responses to go back to the workers once the work queue has room, oldest
+    // first
+    http_connection_t* deferred_head;
+    http_connection_t* deferred_tail;
+    // connection objects are reused instead of malloc()ing one per accept()
+    http_connection_t* free_connections;
+    // connections closed during the current batch of events, later events of the
+    // batch may still point to them
+    http_connection_t* closed_connections;
+    // least recently active connection first
+    http_connection_t* idle_head;
+    http_connection_t* idle_tail;
+};
+
+static http_work_queue_t* http_work_queue_new(size_t capacity) {
+    http_work_queue_t* queue = malloc(sizeof(http_work_queue_t));
+    HTTP_EXPECT(queue != NULL, "malloc()");
+    queue->items = malloc(capacity * sizeof(void*));
+    HTTP_EXPECT(queue->items != NULL, "malloc()");
+    queue->capacity = capacity;
+    queue->head = 0;
+    queue->length = 0;
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->not_empty, NULL);
+    pthread_cond_init(&queue->not_full, NULL);
+    return queue;
+}
+
+// blocking: waits for a free slot
+static void http_work_queue_push(http_work_queue_t* queue, void* item) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->length == queue->capacity) {
+        pthread_cond_wait(&queue->not_full, &queue->mutex);
+    }
+    queue->items[(queue->head + queue->length) % queue->capacity] = item;
+    queue->length++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// non-blocking: returns 0 if the queue is full
+static int http_work_queue_try_push(http_work_queue_t* queue, void* item) {
+    pthread_mutex_lock(&queue->mutex);
+    int pushed = queue->length < queue->capacity;
+    if (pushed) {
+        queue->items[(queue->head + queue->length) % queue->capacity] = item;
+        queue->length++;
+        pthread_cond_signal(&queue->not_empty);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+    return pushed;
+}
+
+static void* http_work_queue_pop(http_work_queue_t* queue) {
+    pthread_mutex_lock(&queue->mutex);
+    while (queue->length == 0) {
+        pthread_cond_wait(&queue->not_empty, &queue->mutex);
+    }
+    void* item = queue->items[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->length--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->mutex);
+    return item;
+}
+
+// while a request is handled, requests, responses, headers, query params and their
+// lists come from the connection's arena and are released all at once after the
+// response is sent instead of being free()d one by one
+void* http_alloc(size_t size) {
+    void* ptr = http_arena != NULL ? arena_alloc(http_arena, size) : malloc(size);
+    HTTP_EXPECT(ptr != NULL, "malloc()");
+    return ptr;
+}
+
+void http_dealloc(void* ptr) {
+    // arena memory is released by arena_reset()
+    if (http_arena == NULL || !arena_owns(http_arena, ptr)) {
+        free(ptr);
+    }
+}
+
 http_server_t* http_server_new() {
     http_server_t* server = malloc(sizeof(http_server_t));
-    server->handlers = LIST_NEW(http_handlers_t);
+    server->router = http_router_new();
+    server->mode = HTTP_SERVER_MODE_EPOLL;
+    server->worker_count = 0;
+    server->queue_size = 0;
+    server->max_request_size = HTTP_MAX_REQUEST_SIZE;
+    server->keep_alive_timeout = HTTP_KEEP_ALIVE_TIMEOUT;
+    server->max_keep_alive_requests = HTTP_MAX_KEEP_ALIVE_REQUESTS;
+    server->listener_count = 1;
+    server->backlog = HTTP_LISTEN_BACKLOG;
+    server->pin_listeners = 0;
+    server->compression_level = HTTP_COMPRESSION_LEVEL;
+    server->compression_min_size = HTTP_COMPRESSION_MIN_SIZE;
     return server;
 }
 
 void http_server_free(http_server_t* server) {
-    LIST_FREE(server->handlers);
+    http_router_free(server->router);
     free(server);
 }
 
+void http_server_add_route(http_server_t* server, http_method_t method, char* path,
+                           http_handler_callback_t callback) {
+    http_router_add(server->router, method, path, callback);
+}
+
 void http_server_add_handler(http_server_t* server, char* path,
                              http_handler_callback_t callback) {
-    http_handler_t* handler = http_handler_new(path, callback);
-    LIST_APPEND(server->handlers, handler);
+    for (int method = 0; method < HTTP_METHOD_COUNT; method++) {
+        http_router_add(server->router, method, path, callback);
+    }
+}
+
+static void http_reader_init(http_reader_t* reader) {
+    reader->buffer = malloc(HTTP_REQUEST_BUFFER_SIZE + 1); // +1 for \0
+    HTTP_EXPECT(reader->buffer != NULL, "malloc()");
+    reader->capacity = HTTP_REQUEST_BUFFER_SIZE;
+    reader->size = 0;
+    reader->scanned = 0;
+    reader->head_size = 0;
+    reader->content_length = 0;
+    reader->request_size = 0;
+}
+
+// makes room for at least capacity bytes (+1 for the \0 written by the parser)
+static void http_reader_reserve(http_reader_t* reader, size_t capacity) {
+    if (capacity <= reader->capacity) {
+        return;
+    }
+
+    char* buffer = realloc(reader->buffer, capacity + 1);
+    HTTP_EXPECT(buffer != NULL, "realloc()");
+    reader->buffer = buffer;
+    reader->capacity = capacity;
+}
+
+// returns the value of the Content-Length header or 0 if there is none
+static size_t http_reader_content_length(http_reader_t* reader) {
+    char* head_end = reader->buffer + reader->head_size;
+
+    // the first line is the request line
+    char* line = memchr(reader->buffer, '\n', reader->head_size);
+    while (line != NULL && ++line < head_end) {
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            return strtoull(line + 15, NULL, 10);
+        }
+        line = memchr(line, '\n', head_end - line);
+    }
+
+    return 0;
+}
+
+// reads from the socket until the buffer holds a complete request
+// returns the size of the request, 0 if the socket has no more data for now (or the
+// receive timeout expired), -1 if the connection has to be closed and
+// HTTP_READER_TOO_LARGE if the request exceeds max_size
+static ssize_t http_reader_fill(http_reader_t* reader, int sock_fd, size_t max_size) {
+    while (1) {
+        if (reader->head_size == 0 && reader->size >= 4) {
+            // only search the new bytes (and the 3 before them, the terminator may be
+            // split across reads)
+            size_t start = reader->scanned > 3 ? reader->scanned - 3 : 0;
+            char* head_end =
+                memmem(reader->buffer + start, reader->size - start, "\r\n\r\n", 4);
+            reader->scanned = reader->size;
+
+            if (head_end != NULL) {
+                reader->head_size = head_end + 4 - reader->buffer;
+                reader->content_length = http_reader_content_length(reader);
+
+                if (reader->head_size > max_size ||
+                    reader->content_length > max_size - reader->head_size) {
+                    HTTP_DEBUG("request of %zu + %zu bytes exceeds the limit",
+                               reader->head_size, reader->content_length);
+                    return HTTP_READER_TOO_LARGE;
+                }
+
+                // the body size is known now, allocate exactly what is needed
+                http_reader_reserve(reader, reader->head_size + reader->content_length);
+            }
+        }
+
+        if (reader->head_size != 0 &&
+            reader->size >= reader->head_size + reader->content_length) {
+            reader->request_size = reader->head_size + reader->content_length;
+            reader->saved_byte = reader->buffer[reader->request_size];
+            return reader->request_size;
+        }
+
+        if (reader->size == reader->capacity) {
+            if (reader->capacity >= max_size) {
+                HTTP_DEBUG("request head exceeds %zu bytes", max_size);
+                return HTTP_READER_TOO_LARGE;
+            }
+            http_reader_reserve(reader, reader->capacity * 2 < max_size
+                                            ? reader->capacity * 2
+                                            : max_size);
+        }
+
+        ssize_t bytes_read = read(sock_fd, reader->buffer + reader->size,
+                                  reader->capacity - reader->size);
+        if (bytes_read == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            HTTP_DEBUG("read() failed: %s", strerror(errno));
+            return -1;
+        } else if (bytes_read == 0) {
+            HTTP_DEBUG("read() returned 0");
+            return -1;
+        }
+
+        HTTP_DEBUG("read() %zd bytes", bytes_read);
+        reader->size += bytes_read;
+    }
+}
+
+// drops the request returned by http_reader_fill() once it has been handled and moves
+// the next request (or the part of it that was read) to the front
+static void http_reader_consume(http_reader_t* reader) {
+    size_t request_size = reader->request_size;
+
+    reader->buffer[request_size] = reader->saved_byte;
+    reader->size -= request_size;
+    memmove(reader->buffer, reader->buffer + request_size, reader->size);
+
+    reader->scanned = 0;
+    reader->head_size = 0;
+    reader->content_length = 0;
+    reader->request_size = 0;
+
+    // don't keep a large buffer around after an upload
+    if (reader->capacity > HTTP_REQUEST_BUFFER_SIZE &&
+        reader->size <= HTTP_REQUEST_BUFFER_SIZE) {
+        reader->buffer = realloc(reader->buffer, HTTP_REQUEST_BUFFER_SIZE + 1);
+        HTTP_EXPECT(reader->buffer != NULL, "realloc()");
+        reader->capacity = HTTP_REQUEST_BUFFER_SIZE;
+    }
 }
 
+static void http_reader_reset(http_reader_t* reader) {
+    reader->request_size = 0;
+    reader->saved_byte = reader->buffer[0];
+    reader->size = 0;
+    http_reader_consume(reader);
+}
+
+static void http_reader_free(http_reader_t* reader) {
+    free(reader->buffer);
+}
+
+static http_response_t* http_response_too_large() {
+    return http_response_new(HTTP_STATUS_PAYLOAD_TOO_LARGE, NULL, "Payload Too Large",
+                             17, NULL, NULL);
+}
+
+// HTTP/1.1 connections are persistent unless the client sends "Connection: close"
+static int http_request_keep_alive(http_request_t* request) {
+    http_header_t* connection = http_headers_get(request->headers, "Connection");
+    return connection == NULL || strcasestr(connection->value, "close") == NULL;
+}
+
+// handles one connection with blocking io, runs on a worker thread in threads mode
+// args->reader is the worker's scratch buffer and is reused for every connection
 void http_server_handle_connection(http_thread_args_t* args) {
     http_server_t* server = args->server;
     int sock_fd = args->sock_fd;
+    http_reader_t* reader = args->reader;
+    http_reader_reset(reader);
+
+    http_arena = args->arena;
+
+    // idle keep-alive connections block a worker, so don't wait forever
+    struct timeval timeout = {.tv_sec = server->keep_alive_timeout};
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0) {
+        HTTP_DEBUG("setsockopt() failed: %s", strerror(errno));
+    }
+    // nor for a client that stops reading its response
+    struct timeval send_timeout = {.tv_sec = HTTP_SEND_TIMEOUT};
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+                   sizeof(send_timeout)) != 0) {
+        HTTP_DEBUG("setsockopt() failed: %s", strerror(errno));
+    }
+
+    for (size_t request_count = 1;; request_count++) {
+        ssize_t request_size = http_reader_fill(reader, sock_fd, server->max_request_size);
+        if (request_size == HTTP_READER_TOO_LARGE) {
+            http_response_t* response = http_response_too_large();
+            http_server_send_response(server, response, sock_fd);
+            http_response_free(response);
+            arena_reset(args->arena);
+            break;
+        } else if (request_size <= 0) {
+            break;
+        }
+
+        http_request_t* request = http_request_parse(reader->buffer, request_size);
+        if (request == NULL) {
+            HTTP_DEBUG("request parse failed");
+            arena_reset(args->arena);
+            break;
+        }
+
+        http_response_t* response = http_server_dispatch(server, request);
+        response->keep_alive = http_request_keep_alive(request) &&
+                               request_count < server->max_keep_alive_requests;
+
+        int sent = http_server_send_response(server, response, sock_fd) == 0;
+
+        HTTP_INFO("%s %s %d", HTTP_METHOD_STRINGS[request->method], request->path,
+                  response->status);
+
+        int keep_alive = sent && response->keep_alive;
+
+        http_response_free(response);
+
+        http_request_free(request);
+
+        arena_reset(args->arena);
 
-    char* buffer = malloc(HTTP_MAX_REQUEST_SIZE + 1); // +1 for \0
-    HTTP_EXPECT(buffer != NULL, "malloc()");
+        if (!keep_alive) {
+            break;
+        }
+
+        http_reader_consume(reader);
+    }
+
+    http_arena = NULL;
 
     // TODO: write a macro to handle error but don't kill like HTTP_ERROR
-    ssize_t bytes_read = read(sock_fd, buffer, HTTP_MAX_REQUEST_SIZE);
-    if (bytes_read == -1) {
-        HTTP_DEBUG("read() failed: %s", strerror(errno));
-        goto shared_cleanup;
-    } else if (bytes_read == 0) {
-        HTTP_DEBUG("read() returned 0");
-        goto shared_cleanup;
+    if (close(sock_fd) != 0) {
+        HTTP_DEBUG("close() failed %s", strerror(errno));
     }
+}
+
+// zlib's windowBits for the encoding, 15 (32 KiB window) with the zlib wrapper for
+// deflate and the gzip wrapper (+16) for gzip
+static int http_encoding_window_bits(http_encoding_t encoding) {
+    return encoding == HTTP_ENCODING_GZIP ? 15 + 16 : 15;
+}
 
-    HTTP_DEBUG("read() %zd bytes", bytes_read);
+size_t http_compress(http_encoding_t encoding, int level, const char* data, size_t size,
+                     char** out) {
+    z_stream zstream = {0};
+    if (size > UINT_MAX ||
+        deflateInit2(&zstream, level, Z_DEFLATED, http_encoding_window_bits(encoding), 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+
+    size_t capacity = deflateBound(&zstream, size);
+    *out = malloc(capacity);
+    if (*out == NULL) {
+        deflateEnd(&zstream);
+        return 0;
+    }
 
-    http_request_t* request = http_request_parse(buffer, bytes_read);
-    if (request == NULL) {
-        HTTP_DEBUG("request parse failed");
-        goto shared_cleanup;
+    zstream.next_in = (Bytef*)data;
+    zstream.avail_in = size;
+    zstream.next_out = (Bytef*)*out;
+    zstream.avail_out = capacity;
+    int result = deflate(&zstream, Z_FINISH);
+    size_t encoded_size = zstream.total_out;
+    deflateEnd(&zstream);
+
+    if (result != Z_STREAM_END) {
+        free(*out);
+        return 0;
     }
+    return encoded_size;
+}
 
-    http_handler_callback_t callback = NULL;
+// picks the encoding for the request's Accept-Encoding header, gzip before deflate,
+// identity if neither is acceptable (not listed or q=0, * stands for the ones not listed)
+static http_encoding_t http_request_negotiate_encoding(http_request_t* request) {
+    http_header_t* header = http_headers_get(request->headers, "Accept-Encoding");
+    if (header == NULL) {
+        return HTTP_ENCODING_IDENTITY;
+    }
 
-    LIST_FOREACH(server->handlers, handler) {
-        if (strcmp(handler->path, request->path) == 0) {
-            callback = handler->callback;
-            goto after_loop;
+    // -1 = not listed, 0 = not acceptable, 1 = acceptable
+    int gzip = -1;
+    int deflate = -1;
+    int wildcard = -1;
+
+    const char* p = header->value;
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        size_t element_size = strcspn(p, ",");
+        size_t name_size = strcspn(p, " \t;,");
+
+        // the only parameter that matters is the weight
+        const char* weight = memmem(p + name_size, element_size - name_size, "q=", 2);
+        int acceptable = weight == NULL || strtod(weight + 2, NULL) > 0;
+
+        if ((name_size == 4 && strncasecmp(p, "gzip", 4) == 0) ||
+            (name_size == 6 && strncasecmp(p, "x-gzip", 6) == 0)) {
+            gzip = acceptable;
+        } else if (name_size == 7 && strncasecmp(p, "deflate", 7) == 0) {
+            deflate = acceptable;
+        } else if (name_size == 1 && *p == '*') {
+            wildcard = acceptable;
         }
+
+        p += element_size;
     }
 
-    http_response_t* response;
+    if (gzip == 1 || (gzip == -1 && wildcard == 1)) {
+        return HTTP_ENCODING_GZIP;
+    } else if (deflate == 1 || (deflate == -1 && wildcard == 1)) {
+        return HTTP_ENCODING_DEFLATE;
+    }
+    return HTTP_ENCODING_IDENTITY;
+}
+
+// compresses the body of a successful response with the request's encoding, streamed
+// bodies are only marked, they are compressed while they are sent
+// responses with a Content-Encoding (e.g. compressed by the handler) are left alone
+static void http_response_encode(http_server_t* server, http_request_t* request,
+                                 http_response_t* response) {
+    if (server->compression_level <= 0 ||
+        (response->status != HTTP_STATUS_OK &&
+         response->status != HTTP_STATUS_NOT_MODIFIED)) {
+        return;
+    }
+
+    // the body depends on the Accept-Encoding header, so caches keep the variants apart
+    if (http_headers_get(response->headers, "Vary") == NULL) {
+        http_headers_add(response->headers, http_header_new("Vary", "Accept-Encoding"));
+    }
+
+    if (request->encoding == HTTP_ENCODING_IDENTITY ||
+        response->status != HTTP_STATUS_OK ||
+        http_headers_get(response->headers, "Content-Encoding") != NULL) {
+        return;
+    }
+
+    if (response->stream != NULL) {
+        response->encoding = request->encoding;
+        return;
+    } else if (response->body_size < server->compression_min_size) {
+        return;
+    }
+
+    char* encoded;
+    size_t encoded_size =
+        http_compress(request->encoding, server->compression_level, response->body,
+                      response->body_size, &encoded);
+    if (encoded_size == 0) {
+        return;
+    } else if (encoded_size >= response->body_size) {
+        // doesn't compress
+        free(encoded);
+        return;
+    }
+
+    if (response->body_release != NULL) {
+        response->body_release(response->body_ctx);
+    }
+    response->body = encoded;
+    response->body_size = encoded_size;
+    response->body_release = free;
+    response->body_ctx = encoded;
+    http_headers_add(response->headers,
+                     http_header_new("Content-Encoding",
+                                     (char*)http_encoding_names[request->encoding]));
+}
+
+// looks up the route handler for the request and runs it
+// never returns NULL, missing routes and failing handlers are turned into error responses
+// successful responses are compressed if the client accepts it
+http_response_t* http_server_dispatch(http_server_t* server, http_request_t* request) {
+    http_route_t* route = http_router_match(server->router, request);
+    if (route == NULL) {
+        HTTP_DEBUG("no handler for path: %s", request->path);
+        return http_response_new(HTTP_STATUS_NOT_FOUND, NULL, "Not Found", 9, NULL, NULL);
+    }
+
+    http_handler_callback_t callback = route->callbacks[request->method];
+    if (callback == NULL) {
+        HTTP_DEBUG("method not allowed for path: %s", request->path);
+        return http_response_new(HTTP_STATUS_METHOD_NOT_ALLOWED,
+                                 HTTP_HEADERS(("Allow", route->allow)),
+                                 "Method Not Allowed", 18, NULL, NULL);
+    }
+
+    if (server->compression_level > 0) {
+        request->encoding = http_request_negotiate_encoding(request);
+    }
+
+    http_response_t* response = callback(request);
+    if (response == NULL) {
+        HTTP_DEBUG("route handler returned NULL");
+        response = http_response_new(HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL,
+                                     "Internal Server Error", 21, NULL, NULL);
+    }
+
+    http_response_encode(server, request, response);
+    return response;
+}
+
+
+// sends the response head and body starting at *offset, both are passed to a single
+// sendmsg() call so small responses take one syscall and the body is never copied
+// returns 1 when everything was written, 0 if the socket would block and -1 on error
+static int http_send(int sock_fd, char* head, size_t head_size, char* body,
+                     size_t body_size, size_t* offset) {
+    size_t total_size = head_size + body_size;
+
+    while (*offset < total_size) {
+        struct iovec iov[2];
+        int iov_count = 0;
+
+        if (*offset < head_size) {
+            iov[iov_count++] = (struct iovec){head + *offset, head_size - *offset};
+        }
+        if (body_size > 0) {
+            size_t body_offset = *offset > head_size ? *offset - head_size : 0;
+            iov[iov_count++] = (struct iovec){body + body_offset, body_size - body_offset};
+        }
+
+        // MSG_NOSIGNAL: a client closing the connection must not kill the process with
+        // SIGPIPE
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iov_count};
+        ssize_t bytes_written = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+        if (bytes_written == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            HTTP_DEBUG("sendmsg() failed: %s", strerror(errno));
+            return -1;
+        }
+
+        HTTP_DEBUG("sendmsg() %zd bytes", bytes_written);
+        *offset += bytes_written;
+    }
+
+    return 1;
+}
+
+// like http_send() but waits for the socket to become writable instead of returning
+// on EAGAIN, works with blocking and non-blocking sockets
+// blocking sockets wait in sendmsg() up to their SO_SNDTIMEO, EAGAIN means it expired
+// returns 0 on success and -1 if the connection failed or timed out
+static int http_send_all(int sock_fd, char* head, size_t head_size, char* body,
+                         size_t body_size) {
+    size_t offset = 0;
+    int blocking = !(fcntl(sock_fd, F_GETFL) & O_NONBLOCK);
+
+    while (1) {
+        int result = http_send(sock_fd, head, head_size, body, body_size, &offset);
+        if (result != 0) {
+            return result == 1 ? 0 : -1;
+        } else if (blocking) {
+            HTTP_DEBUG("send timed out, %zu bytes written", offset);
+            return -1;
+        }
+
+        struct pollfd pollfd = {.fd = sock_fd, .events = POLLOUT};
+        int ready = poll(&pollfd, 1, HTTP_SEND_TIMEOUT * 1000);
+        if (ready == -1 && errno == EINTR) {
+            continue;
+        } else if (ready != 1) {
+            HTTP_DEBUG("failed to send response, %zu bytes written", offset);
+            return -1;
+        }
+    }
+}
+
+// appends size bytes of data to the queued output
+static int http_stream_queue(http_stream_t* stream, const char* data, size_t size) {
+    if (stream->out_size + size > stream->out_capacity) {
+        size_t capacity = stream->out_capacity * 2 > stream->out_size + size
+                              ? stream->out_capacity * 2
+                              : stream->out_size + size;
+        char* out = realloc(stream->out, capacity);
+        if (out == NULL) {
+            HTTP_WARN("realloc() failed");
+            stream->failed = 1;
+            return -1;
+        }
+        stream->out = out;
+        stream->out_capacity = capacity;
+    }
+    memcpy(stream->out + stream->out_size, data, size);
+    stream->out_size += size;
+    return 0;
+}
+
+// queues data as one chunk, the \r\n ending the previous chunk is sent together with
+// the size line of this one and the head with the first chunk (an empty chunk only
+// queues the head if it is still pending)
+static int http_stream_send(http_stream_t* stream, const char* data, size_t size) {
+    char prefix[HTTP_MAX_RESPONSE_HEAD_SIZE + 32];
+    size_t prefix_size = 0;
+
+    if (!stream->head_sent) {
+        prefix_size = http_response_head_to_buffer(stream->response, prefix,
+                                                   HTTP_MAX_RESPONSE_HEAD_SIZE);
+        if (prefix_size == 0) {
+            HTTP_WARN("response head exceeds %d bytes", HTTP_MAX_RESPONSE_HEAD_SIZE);
+            stream->failed = 1;
+            return -1;
+        }
+        stream->head_sent = 1;
+    }
+    if (size > 0) {
+        prefix_size += snprintf(prefix + prefix_size, sizeof(prefix) - prefix_size,
+                                "%s%zx\r\n", stream->chunk_count > 0 ? "\r\n" : "", size);
+        stream->chunk_count++;
+    }
+
+    if (http_stream_queue(stream, prefix, prefix_size) != 0 ||
+        http_stream_queue(stream, data, size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// decides the encoding of the body once the first chunk is full or the body is complete
+// (last), bodies below the server's compression_min_size are sent as they are
+static void http_stream_start(http_stream_t* stream, int last) {
+    http_response_t* response = stream->response;
+    stream->started = 1;
+
+    if (response->encoding == HTTP_ENCODING_IDENTITY ||
+        (last && stream->size < stream->compression_min_size)) {
+        return;
+    }
+
+    // default allocators
+    stream->zstream.zalloc = Z_NULL;
+    stream->zstream.zfree = Z_NULL;
+    stream->zstream.opaque = Z_NULL;
+    if (deflateInit2(&stream->zstream, stream->compression_level, Z_DEFLATED,
+                     http_encoding_window_bits(response->encoding), 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        HTTP_WARN("deflateInit2() failed, sending the body uncompressed");
+        return;
+    }
+    stream->compressing = 1;
+    http_headers_add(response->headers,
+                     http_header_new("Content-Encoding",
+                                     (char*)http_encoding_names[response->encoding]));
+}
+
+// compresses the buffered data, the output is sent in full chunks, the rest stays in
+// encoded until more data arrives or the body is complete (last)
+static int http_stream_deflate(http_stream_t* stream, int last) {
+    z_stream* zstream = &stream->zstream;
+    zstream->next_in = (Bytef*)stream->buffer;
+    zstream->avail_in = stream->size;
+
+    do {
+        zstream->next_out = (Bytef*)stream->encoded + stream->encoded_size;
+        zstream->avail_out = HTTP_STREAM_CHUNK_SIZE - stream->encoded_size;
+        deflate(zstream, last ? Z_FINISH : Z_NO_FLUSH);
+        stream->encoded_size = HTTP_STREAM_CHUNK_SIZE - zstream->avail_out;
+
+        if (zstream->avail_out == 0 || last) {
+            if (http_stream_send(stream, stream->encoded, stream->encoded_size) != 0) {
+                return -1;
+            }
+            stream->encoded_size = 0;
+        }
+    } while (zstream->avail_out == 0);
+
+    return 0;
+}
+
+// sends the buffered data, as one chunk or through the compressor
+// last ends the body, the head is sent even if the body is empty
+static int http_stream_flush(http_stream_t* stream, int last) {
+    if (stream->failed) {
+        return -1;
+    } else if (stream->size == 0 && !last) {
+        return 0;
+    }
+
+    if (stream->tap != NULL && stream->size > 0) {
+        stream->tap(stream->buffer, stream->size, stream->tap_ctx);
+    }
+
+    if (!stream->started) {
+        http_stream_start(stream, last);
+    }
+
+    int result = stream->compressing
+                     ? http_stream_deflate(stream, last)
+                     : http_stream_send(stream, stream->buffer, stream->size);
+    stream->size = 0;
+    return result;
+}
+
+// appends data to the body of a streamed response, full chunks are sent right away
+// returns 0 on success and -1 if the connection failed (the callback should stop then)
+int http_stream_write(http_stream_t* stream, const char* data, size_t size) {
+    while (size > 0) {
+        size_t free_size = HTTP_STREAM_CHUNK_SIZE - stream->size;
+        size_t copy_size = size < free_size ? size : free_size;
+
+        memcpy(stream->buffer + stream->size, data, copy_size);
+        stream->size += copy_size;
+        data += copy_size;
+        size -= copy_size;
+
+        if (stream->size == HTTP_STREAM_CHUNK_SIZE && http_stream_flush(stream, 0) != 0) {
+            return -1;
+        }
+    }
+
+    return stream->failed ? -1 : 0;
+}
+
+int http_stream_write_string(http_stream_t* stream, const char* str) {
+    return http_stream_write(stream, str, strlen(str));
+}
+
+// returns memory for size bytes (at most HTTP_STREAM_CHUNK_SIZE) at the end of the
+// current chunk, sending the chunk first if it doesn't have enough room left
+// lets callbacks serialize straight into the chunk instead of into a buffer of their own
+// returns NULL if the connection failed
+char* http_stream_reserve(http_stream_t* stream, size_t size) {
+    if (size > HTTP_STREAM_CHUNK_SIZE || stream->failed) {
+        return NULL;
+    }
+
+    if (HTTP_STREAM_CHUNK_SIZE - stream->size < size &&
+        http_stream_flush(stream, 0) != 0) {
+        return NULL;
+    }
+
+    return stream->buffer + stream->size;
+}
+
+// appends the first size bytes written to the memory returned by http_stream_reserve()
+void http_stream_commit(http_stream_t* stream, size_t size) {
+    stream->size += size;
+}
+
+// passes the rest of the body to tap as it is sent, including the chunk being filled
+void http_stream_set_tap(http_stream_t* stream, http_stream_tap_t tap, void* ctx) {
+    stream->tap = tap;
+    stream->tap_ctx = ctx;
+}
+
+// whether output is waiting to be sent, the callback should return HTTP_STREAM_MORE then
+int http_stream_full(http_stream_t* stream) {
+    return stream->out_size > stream->out_offset || stream->failed;
+}
+
+static http_stream_t* http_stream_new(http_server_t* server, http_response_t* response) {
+    http_stream_t* stream = malloc(sizeof(http_stream_t));
+    HTTP_EXPECT(stream != NULL, "malloc()");
+    stream->failed = 0;
+    stream->chunk_count = 0;
+    stream->size = 0;
+    stream->tap = NULL;
+    stream->tap_ctx = NULL;
+    stream->response = response;
+    stream->compression_level = server->compression_level;
+    stream->compression_min_size = server->compression_min_size;
+    stream->started = 0;
+    stream->head_sent = 0;
+    stream->compressing = 0;
+    stream->encoded_size = 0;
+    stream->out = NULL;
+    stream->out_size = 0;
+    stream->out_capacity = 0;
+    stream->out_offset = 0;
+    stream->done = 0;
+    return stream;
+}
+
+static void http_stream_free(http_stream_t* stream) {
+    if (stream->compressing) {
+        deflateEnd(&stream->zstream);
+    }
+    free(stream->out);
+    free(stream);
+}
+
+// runs the response's stream callback until it has queued output or the body is
+// complete, the output sent so far is dropped from the queue
+// returns -1 if the callback failed, the status has already been sent then, all that
+// can be done is to end the connection without the last chunk so the client notices the
+// incomplete body
+static int http_stream_produce(http_stream_t* stream) {
+    http_response_t* response = stream->response;
+    if (stream->out_offset == stream->out_size) {
+        stream->out_size = 0;
+        stream->out_offset = 0;
+    }
+
+    while (stream->out_size == 0 && !stream->done) {
+        int result = response->stream(stream, response->body_ctx);
+        if (result == HTTP_STREAM_ERROR || stream->failed) {
+            HTTP_DEBUG("streamed response failed after %zu chunks", stream->chunk_count);
+            return -1;
+        } else if (result == HTTP_STREAM_DONE) {
+            if (http_stream_flush(stream, 1) != 0) {
+                return -1;
+            }
+            // last chunk, no trailers
+            char* end = stream->chunk_count > 0 ? "\r\n0\r\n\r\n" : "0\r\n\r\n";
+            if (http_stream_queue(stream, end, strlen(end)) != 0) {
+                return -1;
+            }
+            stream->done = 1;
+        }
+    }
+    return 0;
+}
 
-after_loop:
+// sends as much of the queued output as the socket takes
+// returns 1 when everything was written, 0 if the socket is full and -1 on error
+static int http_stream_write_out(http_stream_t* stream, int sock_fd) {
+    return http_send(sock_fd, NULL, 0, stream->out, stream->out_size,
+                     &stream->out_offset);
+}
 
-    if (callback != NULL) {
-        response = callback(request);
-        if (response == NULL) {
-            HTTP_DEBUG("route handler returned NULL");
-            response = http_response_new(HTTP_STATUS_INTERNAL_SERVER_ERROR, NULL,
-                                         "Internal Server Error", 22);
+// runs the response's stream callback and sends the head and the produced body with
+// chunked transfer encoding, waiting for the socket (threads mode)
+static int http_server_send_stream(http_server_t* server, http_response_t* response,
+                                   int sock_fd) {
+    http_stream_t* stream = http_stream_new(server, response);
+
+    int result = 0;
+    while (result == 0 && !(stream->done && stream->out_offset == stream->out_size)) {
+        if (http_stream_produce(stream) != 0 ||
+            http_send_all(sock_fd, NULL, 0, stream->out, stream->out_size) != 0) {
+            result = -1;
         }
+        stream->out_offset = stream->out_size;
+    }
+
+    http_stream_free(stream);
+    return result;
+}
+
+// sends the whole response, waiting for the socket if it is non-blocking
+// returns 0 on success and -1 if the connection failed and has to be closed
+int http_server_send_response(http_server_t* server, http_response_t* response,
+                              int sock_fd) {
+    if (response->stream != NULL) {
+        return http_server_send_stream(server, response, sock_fd);
+    }
+
+    char head[HTTP_MAX_RESPONSE_HEAD_SIZE];
+
+    size_t head_size =
+        http_response_head_to_buffer(response, head, HTTP_MAX_RESPONSE_HEAD_SIZE);
+    if (head_size == 0) {
+        HTTP_WARN("response head exceeds %d bytes", HTTP_MAX_RESPONSE_HEAD_SIZE);
+        return -1;
+    }
+
+    if (http_send_all(sock_fd, head, head_size, response->body, response->body_size) !=
+        0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static http_connection_t* http_connection_new(http_reactor_t* reactor, int sock_fd) {
+    http_connection_t* conn = reactor->free_connections;
+    if (conn != NULL) {
+        reactor->free_connections = conn->next;
+        http_reader_reset(&conn->reader);
     } else {
-        HTTP_DEBUG("no handler for path: %s", request->path);
-        response = http_response_new(HTTP_STATUS_NOT_FOUND, NULL, "Not Found", 9);
+        conn = malloc(sizeof(http_connection_t));
+        HTTP_EXPECT(conn != NULL, "malloc()");
+        http_reader_init(&conn->reader);
+        conn->arena = arena_new();
+        HTTP_EXPECT(conn->arena != NULL, "arena_new()");
     }
 
-    http_server_send_response(server, response, sock_fd);
+    conn->sock_fd = sock_fd;
+    conn->reactor = reactor;
+    conn->state = HTTP_CONNECTION_READING;
+    conn->closed = 0;
+    conn->request = NULL;
+    conn->response = NULL;
+    conn->stream = NULL;
+    conn->sent = 0;
+    conn->request_count = 0;
+    conn->next = NULL;
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+    return conn;
+}
 
-    HTTP_INFO("%s %s %d", HTTP_METHOD_STRINGS[request->method], request->path,
-              response->status);
+static time_t http_now() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec;
+}
 
-    http_response_free(response);
+static void http_reactor_untrack(http_reactor_t* reactor, http_connection_t* conn) {
+    if (conn->idle_prev != NULL) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else if (reactor->idle_head == conn) {
+        reactor->idle_head = conn->idle_next;
+    } else {
+        // not tracked
+        return;
+    }
 
-    http_request_free(request);
+    if (conn->idle_next != NULL) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else {
+        reactor->idle_tail = conn->idle_prev;
+    }
 
-shared_cleanup:
-    // TODO: write a macro to handle error but don't kill like HTTP_ERROR
-    if (close(sock_fd) != 0) {
+    conn->idle_prev = NULL;
+    conn->idle_next = NULL;
+}
+
+// marks the connection as active, moving it to the end of the idle list
+static void http_reactor_touch(http_reactor_t* reactor, http_connection_t* conn) {
+    http_reactor_untrack(reactor, conn);
+
+    conn->last_active = http_now();
+    conn->idle_prev = reactor->idle_tail;
+    if (reactor->idle_tail != NULL) {
+        reactor->idle_tail->idle_next = conn;
+    } else {
+        reactor->idle_head = conn;
+    }
+    reactor->idle_tail = conn;
+}
+
+// frees the request and response once the response is written
+static void http_connection_release(http_connection_t* conn) {
+    http_arena = conn->arena;
+
+    if (conn->stream != NULL) {
+        http_stream_free(conn->stream);
+        conn->stream = NULL;
+    }
+    if (conn->response != NULL) {
+        http_response_free(conn->response);
+        conn->response = NULL;
+    }
+    if (conn->request != NULL) {
+        http_request_free(conn->request);
+        conn->request = NULL;
+    }
+
+    http_arena = NULL;
+    arena_reset(conn->arena);
+}
+
+static void http_connection_close(http_connection_t* conn) {
+    http_connection_release(conn);
+    http_reactor_untrack(conn->reactor, conn);
+
+    // closing the fd also removes it from the epoll set
+    if (close(conn->sock_fd) != 0) {
         HTTP_DEBUG("close() failed %s", strerror(errno));
     }
 
-    http_thread_args_free(args);
+    http_reactor_t* reactor = conn->reactor;
+    conn->state = HTTP_CONNECTION_CLOSED;
+    conn->next = reactor->closed_connections;
+    reactor->closed_connections = conn;
+}
 
-    free(buffer);
+// writes as much of the pending response as the socket takes
+// returns 1 when everything was written, 0 if the socket is full and -1 on error
+static int http_connection_write(http_connection_t* conn) {
+    http_response_t* response = conn->response;
+    return http_send(conn->sock_fd, conn->head, conn->head_size, response->body,
+                     response->body_size, &conn->bytes_written);
 }
 
-void http_server_send_response(http_server_t* server, http_response_t* response,
-                               int sock_fd) {
-    char* buffer = malloc(HTTP_MAX_RESPONSE_HEAD_SIZE);
-    HTTP_EXPECT(buffer != NULL, "malloc()");
+static int http_connection_read(http_connection_t* conn);
+
+// called once the response is written: keep-alive connections continue with the next
+// (possibly already buffered) request, returns -1 if the connection has to be closed
+static int http_connection_finish(http_connection_t* conn) {
+    if (!conn->response->keep_alive) {
+        return -1;
+    }
+
+    http_connection_release(conn);
+    conn->sent = 0;
 
-    size_t response_size =
-        http_response_head_to_buffer(response, buffer, HTTP_MAX_RESPONSE_HEAD_SIZE);
+    http_reader_consume(&conn->reader);
+
+    conn->state = HTTP_CONNECTION_READING;
+
+    // events that arrived while the request was processed were ignored, so the socket
+    // has to be read now (edge-triggered epoll won't report the data again)
+    return http_connection_read(conn);
+}
 
-    ssize_t bytes_written = write(sock_fd, buffer, response_size);
-    if (bytes_written == -1) {
-        HTTP_WARN("write() failed");
+// sets the response and starts writing it, returns -1 if the connection has to be
+// closed
+static int http_connection_respond(http_connection_t* conn, http_response_t* response) {
+    conn->response = response;
+    conn->head_size =
+        http_response_head_to_buffer(response, conn->head, HTTP_MAX_RESPONSE_HEAD_SIZE);
+    if (conn->head_size == 0) {
+        HTTP_WARN("response head exceeds %d bytes", HTTP_MAX_RESPONSE_HEAD_SIZE);
+        return -1;
+    }
+    conn->bytes_written = 0;
+    conn->state = HTTP_CONNECTION_WRITING;
+    http_reactor_touch(conn->reactor, conn);
+
+    // the socket is usually writable right away, only wait for EPOLLOUT if it is not
+    int result = http_connection_write(conn);
+    return result == 1 ? http_connection_finish(conn) : result;
+}
+
+// produces and sends the body of a streamed response for as long as the socket takes it,
+// up to HTTP_STREAM_TURN_CHUNKS chunks, runs on a worker thread
+// returns 1 when the body is complete, 0 if the socket is full or the turn is over (the
+// reactor sends the rest of the queued output and queues the connection again) and -1
+// on error
+static int http_connection_stream(http_connection_t* conn) {
+    http_stream_t* stream = conn->stream;
+    size_t turn_end = stream->chunk_count + HTTP_STREAM_TURN_CHUNKS;
+    while (1) {
+        if (http_stream_produce(stream) != 0) {
+            return -1;
+        }
+        int result = http_stream_write_out(stream, conn->sock_fd);
+        if (result != 1 || stream->done || stream->chunk_count >= turn_end) {
+            return result == 1 && !stream->done ? 0 : result;
+        }
+    }
+}
+
+// runs on a worker thread: parses the request, runs the handler and hands the
+// connection back to its reactor
+// streamed bodies are produced by the handler's callback (e.g. while stepping through
+// query results) on the workers as well, a chunk at a time: once the socket is full the
+// reactor waits until it has sent the queued output and queues the connection again
+static void http_connection_process(http_connection_t* conn) {
+    http_reactor_t* reactor = conn->reactor;
+    http_server_t* server = reactor->server;
+
+    http_arena = conn->arena;
+
+    if (conn->stream != NULL) {
+        conn->sent = http_connection_stream(conn);
+    } else {
+        conn->request =
+            http_request_parse(conn->reader.buffer, conn->reader.request_size);
+        if (conn->request == NULL) {
+            HTTP_DEBUG("request parse failed");
+        } else {
+            conn->response = http_server_dispatch(server, conn->request);
+            conn->response->keep_alive =
+                http_request_keep_alive(conn->request) &&
+                conn->request_count < server->max_keep_alive_requests;
+
+            if (conn->response->stream != NULL) {
+                conn->stream = http_stream_new(server, conn->response);
+                conn->sent = http_connection_stream(conn);
+            }
+
+            HTTP_INFO("%s %s %d", HTTP_METHOD_STRINGS[conn->request->method],
+                      conn->request->path, conn->response->status);
+        }
+    }
+
+    http_arena = NULL;
+
+    pthread_mutex_lock(&reactor->completions_mutex);
+    conn->next = reactor->completions;
+    reactor->completions = conn;
+    pthread_mutex_unlock(&reactor->completions_mutex);
+
+    uint64_t one = 1;
+    if (write(reactor->event_fd, &one, sizeof(one)) != sizeof(one)) {
+        HTTP_WARN("write() to eventfd failed: %s", strerror(errno));
+    }
+}
+
+// hands a connection to the workers, connections with a streamed response that don't
+// fit into the full queue are deferred, they can't be answered with a 503 anymore
+static void http_reactor_dispatch_stream(http_reactor_t* reactor,
+                                         http_connection_t* conn) {
+    conn->state = HTTP_CONNECTION_PROCESSING;
+    http_reactor_untrack(reactor, conn);
+    if (reactor->deferred_head == NULL &&
+        http_work_queue_try_push(reactor->queue, conn)) {
+        return;
+    }
+
+    conn->next = NULL;
+    if (reactor->deferred_tail != NULL) {
+        reactor->deferred_tail->next = conn;
     } else {
-        HTTP_DEBUG("write() %zd bytes", bytes_written);
+        reactor->deferred_head = conn;
     }
+    reactor->deferred_tail = conn;
+}
 
-    if (bytes_written != response_size) {
-        HTTP_ERROR("write() failed to write all bytes");
+// hands the deferred streamed responses to the workers while the queue has room
+static void http_reactor_retry(http_reactor_t* reactor) {
+    while (reactor->deferred_head != NULL) {
+        http_connection_t* conn = reactor->deferred_head;
+        // a worker may reuse next as soon as it has the connection
+        http_connection_t* next = conn->next;
+        if (!http_work_queue_try_push(reactor->queue, conn)) {
+            return;
+        }
+        reactor->deferred_head = next;
+        if (next == NULL) {
+            reactor->deferred_tail = NULL;
+        }
     }
+}
 
-    if (response->body != NULL) {
-        bytes_written = write(sock_fd, response->body, response->body_size);
-        if (bytes_written == -1) {
-            HTTP_WARN("write() failed");
+// writes the queued output of a streamed response, once it is sent the connection goes
+// back to a worker for the next chunks
+// returns -1 if the connection has to be closed
+static int http_connection_drain(http_connection_t* conn) {
+    int result = http_stream_write_out(conn->stream, conn->sock_fd);
+    if (result != 1) {
+        return result;
+    } else if (conn->stream->done) {
+        return http_connection_finish(conn);
+    }
+    http_reactor_dispatch_stream(conn->reactor, conn);
+    return 0;
+}
+
+// reads until a request is complete and queues it for the workers
+// returns -1 if the connection has to be closed
+static int http_connection_read(http_connection_t* conn) {
+    http_reactor_t* reactor = conn->reactor;
+
+    ssize_t request_size = http_reader_fill(&conn->reader, conn->sock_fd,
+                                            reactor->server->max_request_size);
+    if (request_size == HTTP_READER_TOO_LARGE) {
+        return http_connection_respond(conn, http_response_too_large());
+    } else if (request_size == -1) {
+        return -1;
+    }
+
+    http_reactor_touch(conn->reactor, conn);
+
+    if (request_size == 0) {
+        // wait for the rest of the request
+        return 0;
+    }
+
+    conn->request_count++;
+    conn->state = HTTP_CONNECTION_PROCESSING;
+    http_reactor_untrack(conn->reactor, conn);
+
+    // never block the event loop on a full queue, shed load instead
+    if (!http_work_queue_try_push(conn->reactor->queue, conn)) {
+        HTTP_WARN("work queue is full, rejecting request");
+        return http_connection_respond(
+            conn, http_response_new(HTTP_STATUS_SERVICE_UNAVAILABLE, NULL,
+                                    "Service Unavailable", 19, NULL, NULL));
+    }
+
+    return 0;
+}
+
+static void http_reactor_accept(http_reactor_t* reactor) {
+    // edge-triggered: accept until the backlog is empty
+    while (1) {
+        int client_sock_fd =
+            accept4(reactor->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_sock_fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                HTTP_WARN("accept4() failed: %s", strerror(errno));
+            }
+            return;
+        }
+
+        HTTP_DEBUG("Connection accepted, client_sock_fd = %d", client_sock_fd);
+
+        http_connection_t* conn = http_connection_new(reactor, client_sock_fd);
+        // the keep-alive timeout also covers the first request, a client that connects
+        // and never sends anything is closed like an idle keep-alive connection
+        http_reactor_touch(reactor, conn);
+
+        // register for both directions once, edge-triggered events only fire on
+        // state changes so this doesn't cause wakeups while the socket stays writable
+        struct epoll_event event = {
+            .events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+            .data.ptr = conn,
+        };
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_sock_fd, &event) != 0) {
+            HTTP_WARN("epoll_ctl() failed: %s", strerror(errno));
+            http_connection_close(conn);
+        }
+    }
+}
+
+// picks up the connections the workers are done with and starts writing the responses
+static void http_reactor_complete(http_reactor_t* reactor) {
+    uint64_t count;
+    if (read(reactor->event_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        HTTP_WARN("read() from eventfd failed: %s", strerror(errno));
+    }
+
+    pthread_mutex_lock(&reactor->completions_mutex);
+    http_connection_t* conn = reactor->completions;
+    reactor->completions = NULL;
+    pthread_mutex_unlock(&reactor->completions_mutex);
+
+    while (conn != NULL) {
+        http_connection_t* next = conn->next;
+
+        if (conn->closed || conn->response == NULL || conn->sent == -1) {
+            http_connection_close(conn);
+        } else if (conn->sent == 1) {
+            conn->state = HTTP_CONNECTION_WRITING;
+            if (http_connection_finish(conn) == -1) {
+                http_connection_close(conn);
+            }
+        } else if (conn->stream != NULL) {
+            // the socket was full, the first EPOLLOUT may have been missed while the
+            // worker owned the connection, so try right away
+            conn->state = HTTP_CONNECTION_STREAMING;
+            http_reactor_touch(reactor, conn);
+            if (http_connection_drain(conn) == -1) {
+                http_connection_close(conn);
+            }
+        } else if (http_connection_respond(conn, conn->response) == -1) {
+            http_connection_close(conn);
+        }
+
+        conn = next;
+    }
+}
+
+// closes connections that have been idle for longer than the keep-alive timeout
+static void http_reactor_expire(http_reactor_t* reactor) {
+    time_t deadline = http_now() - reactor->server->keep_alive_timeout;
+
+    while (reactor->idle_head != NULL && reactor->idle_head->last_active <= deadline) {
+        HTTP_DEBUG("closing idle connection, sock_fd = %d", reactor->idle_head->sock_fd);
+        http_connection_close(reactor->idle_head);
+    }
+}
+
+static void http_reactor_run(http_reactor_t* reactor) {
+    struct epoll_event events[HTTP_MAX_EVENTS];
+
+    while (1) {
+        // wake up once per second to expire idle connections, more often while streamed
+        // responses wait for room in the work queue
+        int timeout = reactor->idle_head != NULL ? 1000 : -1;
+        if (reactor->deferred_head != NULL) {
+            timeout = 10;
+        }
+        int event_count =
+            epoll_wait(reactor->epoll_fd, events, HTTP_MAX_EVENTS, timeout);
+        if (event_count == -1 && errno == EINTR) {
+            continue;
+        }
+        HTTP_EXPECT(event_count != -1, "epoll_wait()");
+
+        for (int i = 0; i < event_count; i++) {
+            void* ptr = events[i].data.ptr;
+            uint32_t flags = events[i].events;
+
+            // the listening socket is registered with a NULL pointer, the eventfd with
+            // the reactor itself
+            if (ptr == NULL) {
+                http_reactor_accept(reactor);
+                continue;
+            } else if (ptr == reactor) {
+                http_reactor_complete(reactor);
+                continue;
+            }
+
+            http_connection_t* conn = ptr;
+            int result = 0;
+
+            if (conn->state == HTTP_CONNECTION_CLOSED) {
+                continue;
+            } else if (conn->state == HTTP_CONNECTION_PROCESSING) {
+                // a worker owns the connection, it can't be closed right now
+                if (flags & (EPOLLERR | EPOLLHUP)) {
+                    conn->closed = 1;
+                }
+                continue;
+            }
+
+            if (flags & EPOLLERR) {
+                result = -1;
+            } else if (conn->state == HTTP_CONNECTION_READING &&
+                       (flags & (EPOLLIN | EPOLLRDHUP))) {
+                result = http_connection_read(conn);
+            } else if (conn->state == HTTP_CONNECTION_WRITING && (flags & EPOLLOUT)) {
+                http_reactor_touch(reactor, conn);
+                result = http_connection_write(conn);
+                if (result == 1) {
+                    result = http_connection_finish(conn);
+                }
+            } else if (conn->state == HTTP_CONNECTION_STREAMING && (flags & EPOLLOUT)) {
+                http_reactor_touch(reactor, conn);
+                result = http_connection_drain(conn);
+            }
+
+            if (result == -1) {
+                http_connection_close(conn);
+            }
+        }
+
+        http_reactor_expire(reactor);
+        http_reactor_retry(reactor);
+
+        // no events of this batch are left, the closed connections can be reused
+        while (reactor->closed_connections != NULL) {
+            http_connection_t* conn = reactor->closed_connections;
+            reactor->closed_connections = conn->next;
+            conn->next = reactor->free_connections;
+            reactor->free_connections = conn;
+        }
+    }
+}
+
+static http_reactor_t* http_reactor_new(http_server_t* server, http_work_queue_t* queue,
+                                        int listen_fd) {
+    http_reactor_t* reactor = malloc(sizeof(http_reactor_t));
+    HTTP_EXPECT(reactor != NULL, "malloc()");
+    reactor->server = server;
+    reactor->queue = queue;
+    reactor->listen_fd = listen_fd;
+    reactor->completions = NULL;
+    reactor->deferred_head = NULL;
+    reactor->deferred_tail = NULL;
+    reactor->free_connections = NULL;
+    reactor->closed_connections = NULL;
+    reactor->idle_head = NULL;
+    reactor->idle_tail = NULL;
+    pthread_mutex_init(&reactor->completions_mutex, NULL);
+
+    reactor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    HTTP_EXPECT(reactor->epoll_fd != -1, "epoll_create1()");
+
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    HTTP_EXPECT(reactor->event_fd != -1, "eventfd()");
+
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET, .data.ptr = NULL};
+    HTTP_EXPECT(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_fd, &event) == 0,
+                "epoll_ctl()");
+
+    event.data.ptr = reactor;
+    HTTP_EXPECT(epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &event) ==
+                    0,
+                "epoll_ctl()");
+
+    return reactor;
+}
+
+// main loop of the worker threads
+// threads mode: the queue holds accepted sockets, the whole connection is handled here
+// epoll mode: the queue holds connections with a complete request
+static void* http_server_worker(void* arg) {
+    http_thread_args_t* args = arg;
+
+    while (1) {
+        void* item = http_work_queue_pop(args->queue);
+
+        if (args->server->mode == HTTP_SERVER_MODE_THREADS) {
+            args->sock_fd = (int)(intptr_t)item;
+            http_server_handle_connection(args);
         } else {
-            HTTP_DEBUG("write() %zd bytes", bytes_written);
+            http_connection_process(item);
         }
+    }
+
+    return NULL;
+}
+
+static size_t http_cpu_count() {
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpu_count > 0 ? cpu_count : 1;
+}
 
-        if (bytes_written != response->body_size) {
-            HTTP_ERROR("write() failed to write all bytes");
+static http_work_queue_t* http_server_start_workers(http_server_t* server) {
+    size_t worker_count = server->worker_count;
+    if (worker_count == 0) {
+        worker_count = http_cpu_count();
+    }
+
+    size_t queue_size = server->queue_size;
+    if (queue_size == 0) {
+        queue_size = worker_count * HTTP_QUEUE_SIZE_PER_WORKER;
+    }
+
+    http_work_queue_t* queue = http_work_queue_new(queue_size);
+
+    for (size_t i = 0; i < worker_count; i++) {
+        http_thread_args_t* args = http_thread_args_new(server, queue);
+
+        pthread_t thread;
+        HTTP_EXPECT(pthread_create(&thread, NULL, http_server_worker, args) == 0,
+                    "pthread_create()");
+        HTTP_EXPECT(pthread_detach(thread) == 0, "pthread_detach()");
+    }
+
+    HTTP_INFO("Started %zu workers, queue size %zu", worker_count, queue_size);
+
+    return queue;
+}
+
+// a listening socket with its accept loop, each listener runs on its own thread
+typedef struct http_listener {
+    http_server_t* server;
+    http_work_queue_t* queue;
+    int sock_fd;
+    // cpu the thread is pinned to, -1 = not pinned
+    int cpu;
+} http_listener_t;
+
+static void http_server_run_threads(http_server_t* server, http_work_queue_t* queue,
+                                    int sock_fd) {
+    while (1) {
+        int client_sock_fd = accept(sock_fd, NULL, NULL);
+        HTTP_EXPECT(client_sock_fd > 0, "accept()");
+
+        HTTP_DEBUG("Connection accepted, client_sock_fd = %d", client_sock_fd);
+
+        // blocks while all workers are busy and the queue is full, further
+        // connections wait in the listen backlog
+        http_work_queue_push(queue, (void*)(intptr_t)client_sock_fd);
+    }
+}
+
+static void* http_listener_run(void* arg) {
+    http_listener_t* listener = arg;
+
+    if (listener->cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(listener->cpu, &cpus);
+        // not fatal, e.g. the cpu may be excluded by the process' cpuset
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            HTTP_WARN("Could not pin listener to cpu %d", listener->cpu);
         }
     }
 
-    free(buffer);
+    if (listener->server->mode == HTTP_SERVER_MODE_THREADS) {
+        http_server_run_threads(listener->server, listener->queue, listener->sock_fd);
+    } else {
+        int sock_fd = listener->sock_fd;
+        HTTP_EXPECT(fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK) == 0,
+                    "fcntl()");
+        http_reactor_run(http_reactor_new(listener->server, listener->queue, sock_fd));
+    }
+
+    return NULL;
 }
 
-void http_server_run(http_server_t* server, char* address, uint16_t port) {
+static int http_server_listen(http_server_t* server, struct sockaddr_in* addr,
+                              int reuse_port) {
     int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
     HTTP_EXPECT(sock_fd > 0, "socket()");
 
     int enable = 1;
     HTTP_EXPECT(setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) == 0,
                 "setsockopt()");
+    if (reuse_port) {
+        HTTP_EXPECT(
+            setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) == 0,
+            "setsockopt()");
+    }
+
+    HTTP_EXPECT(bind(sock_fd, (struct sockaddr*)addr, sizeof(*addr)) == 0, "bind()");
+    HTTP_EXPECT(listen(sock_fd, server->backlog) == 0, "listen()");
+
+    return sock_fd;
+}
 
+void http_server_run(http_server_t* server, char* address, uint16_t port) {
     in_addr_t in_addr = inet_addr(address);
     HTTP_EXPECT(in_addr != INADDR_NONE, "inet_addr()");
 
@@ -153,39 +1649,53 @@ void http_server_run(http_server_t* server, char* address, uint16_t port) {
         .sin_addr.s_addr = in_addr,
     };
 
-    HTTP_EXPECT(bind(sock_fd, (struct sockaddr*)&addr, sizeof(addr)) == 0, "bind()");
-
-    HTTP_EXPECT(listen(sock_fd, 5) == 0, "listen()");
-    HTTP_INFO("Listening on http://%s:%d", address, port);
+    size_t cpu_count = http_cpu_count();
+    size_t listener_count = server->listener_count;
+    if (listener_count == 0) {
+        listener_count = cpu_count;
+    }
 
-    while (1) {
-        int client_sock_fd = accept(sock_fd, NULL, NULL);
-        HTTP_EXPECT(client_sock_fd > 0, "accept()");
+    // bind all sockets before starting any thread, so e.g. a port in use fails early
+    http_listener_t* listeners = malloc(sizeof(http_listener_t) * listener_count);
+    HTTP_EXPECT(listeners != NULL, "malloc()");
+    for (size_t i = 0; i < listener_count; i++) {
+        listeners[i].server = server;
+        listeners[i].sock_fd = http_server_listen(server, &addr, listener_count > 1);
+        listeners[i].cpu = server->pin_listeners ? (int)(i % cpu_count) : -1;
+    }
+    HTTP_INFO("Listening on http://%s:%d (%zu listeners, backlog %d)", address, port,
+              listener_count, server->backlog);
 
-        HTTP_DEBUG("Connection accepted, client_sock_fd = %d", client_sock_fd);
+    http_work_queue_t* queue = http_server_start_workers(server);
 
-        http_thread_args_t* args = http_thread_args_new(server, client_sock_fd);
+    // listener 0 runs on the calling thread
+    for (size_t i = 0; i < listener_count; i++) {
+        listeners[i].queue = queue;
+        if (i == 0) {
+            continue;
+        }
 
         pthread_t thread;
-        HTTP_EXPECT(pthread_create(&thread, NULL,
-                                   (void* (*)(void*))http_server_handle_connection,
-                                   args) == 0,
+        HTTP_EXPECT(pthread_create(&thread, NULL, http_listener_run, &listeners[i]) == 0,
                     "pthread_create()");
-
         HTTP_EXPECT(pthread_detach(thread) == 0, "pthread_detach()");
     }
+
+    http_listener_run(&listeners[0]);
 }
 
 http_request_t* http_request_new(http_method_t method, char* path,
                                  http_query_params_t* query_params,
                                  http_headers_t* headers, char* body, size_t body_size) {
-    http_request_t* request = malloc(sizeof(http_request_t));
+    http_request_t* request = http_alloc(sizeof(http_request_t));
     request->method = method;
     request->path = path;
     request->query_params = query_params;
     request->headers = headers;
     request->body = body;
     request->body_size = body_size;
+    request->param_count = 0;
+    request->encoding = HTTP_ENCODING_IDENTITY;
     return request;
 }
 
@@ -268,6 +1778,7 @@ http_request_t* http_request_parse(char* buffer, size_t size) {
             HTTP_DEBUG("header value is missing");
             return NULL;
         }
+        header_value += strspn(header_value, " \t");
 
         http_header_t* header_obj = http_header_new(header_name, header_value);
         LIST_APPEND(headers, header_obj);
@@ -294,7 +1805,19 @@ void http_request_free(http_request_t* request) {
     http_headers_free(request->headers);
     http_query_params_free(request->query_params);
 
-    free(request);
+    http_dealloc(request);
+}
+
+// returns NULL if the route has no parameter with this name
+http_path_param_t* http_request_get_param(http_request_t* request, char* name) {
+    size_t name_size = strlen(name);
+    for (size_t i = 0; i < request->param_count; i++) {
+        http_path_param_t* param = &request->params[i];
+        if (param->name_size == name_size && memcmp(param->name, name, name_size) == 0) {
+            return param;
+        }
+    }
+    return NULL;
 }
 
 void http_request_print(http_request_t* request) {
@@ -311,14 +1834,14 @@ void http_request_print(http_request_t* request) {
 }
 
 http_query_param_t* http_query_param_new(char* name, char* value) {
-    http_query_param_t* param = malloc(sizeof(http_query_param_t));
+    http_query_param_t* param = http_alloc(sizeof(http_query_param_t));
     param->name = name;
     param->value = value;
     return param;
 }
 
 void http_query_param_free(http_query_param_t* param) {
-    free(param);
+    http_dealloc(param);
 }
 
 http_query_params_t* http_query_params_new() {
@@ -348,12 +1871,15 @@ http_query_param_t* http_query_params_get(http_query_params_t* params, char* nam
     return NULL;
 }
 
+// body_release(body_ctx) is called when the response is freed, i.e. after the body
+// has been sent, pass NULL for static bodies
 http_response_t* http_response_new(http_status_t status, http_headers_t* headers,
-                                   char* body, size_t body_size) {
-    http_response_t* response = malloc(sizeof(http_response_t));
-    HTTP_EXPECT(response != NULL, "malloc()");
+                                   char* body, size_t body_size,
+                                   http_body_release_t body_release, void* body_ctx) {
+    http_response_t* response = http_alloc(sizeof(http_response_t));
 
     response->status = status;
+    response->keep_alive = 0;
 
     if (headers != NULL) {
         response->headers = headers;
@@ -369,19 +1895,41 @@ http_response_t* http_response_new(http_status_t status, http_headers_t* headers
         response->body_size = 0;
     }
 
+    response->body_release = body_release;
+    response->body_ctx = body_ctx;
+    response->stream = NULL;
+    response->encoding = HTTP_ENCODING_IDENTITY;
+
+    return response;
+}
+
+// creates a response whose body is produced by the stream callback while it is being
+// sent (chunked transfer encoding), so it never has to be held in memory as a whole
+// the callback is called with ctx on the worker thread, release(ctx) when the response
+// is freed
+http_response_t* http_response_new_stream(http_status_t status, http_headers_t* headers,
+                                          http_stream_callback_t stream,
+                                          http_body_release_t release, void* ctx) {
+    http_response_t* response = http_response_new(status, headers, NULL, 0, release, ctx);
+    response->stream = stream;
     return response;
 }
 
 void http_response_free(http_response_t* response) {
+    if (response->body_release != NULL) {
+        response->body_release(response->body_ctx);
+    }
+
     LIST_FOREACH(response->headers, header) {
         http_header_free(header);
     }
 
     LIST_FREE(response->headers);
 
-    free(response);
+    http_dealloc(response);
 }
 
+// returns the size of the head or 0 if it doesn't fit into the buffer
 size_t http_response_head_to_buffer(http_response_t* response, char* buffer,
                                     size_t size) {
     size_t offset = 0;
@@ -390,24 +1938,42 @@ size_t http_response_head_to_buffer(http_response_t* response, char* buffer,
                        response->status, http_status_to_string(response->status));
 
     LIST_FOREACH(response->headers, header) {
-        offset += snprintf(buffer + offset, size - offset, "%s: %s\r\n", header->name,
-                           header->value);
+        if (offset < size) {
+            offset += snprintf(buffer + offset, size - offset, "%s: %s\r\n",
+                               header->name, header->value);
+        }
     }
 
-    offset += snprintf(buffer + offset, size - offset, "\r\n");
-    return offset;
+    // framing, required for keep-alive connections, a 304 never has a body
+    if (offset < size && response->stream != NULL) {
+        offset += snprintf(buffer + offset, size - offset,
+                           "Transfer-Encoding: chunked\r\n");
+    } else if (offset < size && response->status != HTTP_STATUS_NOT_MODIFIED &&
+               http_headers_get(response->headers, "Content-Length") == NULL) {
+        offset += snprintf(buffer + offset, size - offset, "Content-Length: %zu\r\n",
+                           response->body_size);
+    }
+    if (offset < size) {
+        offset += snprintf(buffer + offset, size - offset, "Connection: %s\r\n",
+                           response->keep_alive ? "keep-alive" : "close");
+    }
+    if (offset < size) {
+        offset += snprintf(buffer + offset, size - offset, "\r\n");
+    }
+
+    // snprintf() returns the size it would have needed
+    return offset < size ? offset : 0;
 }
 
 http_header_t* http_header_new(char* name, char* value) {
-    http_header_t* header = malloc(sizeof(http_header_t));
-    HTTP_EXPECT(header != NULL, "malloc()");
+    http_header_t* header = http_alloc(sizeof(http_header_t));
     header->name = name;
     header->value = value;
     return header;
 }
 
 void http_header_free(http_header_t* header) {
-    free(header);
+    http_dealloc(header);
 }
 
 http_headers_t* http_headers_new() {
@@ -427,9 +1993,10 @@ void http_headers_add(http_headers_t* headers, http_header_t* header) {
     LIST_APPEND(headers, header);
 }
 
+// header names are case-insensitive
 http_header_t* http_headers_get(http_headers_t* headers, char* name) {
     LIST_FOREACH(headers, header) {
-        if (strcmp(header->name, name) == 0) {
+        if (strcasecmp(header->name, name) == 0) {
             return header;
         }
     }
@@ -437,25 +2004,25 @@ http_header_t* http_headers_get(http_headers_t* headers, char* name) {
     return NULL;
 }
 
-http_handler_t* http_handler_new(char* path, http_handler_callback_t callback) {
-    http_handler_t* handler = malloc(sizeof(http_handler_t));
-    handler->path = path;
-    handler->callback = callback;
-    return handler;
-}
-
-void http_handler_free(http_handler_t* handler) {
-    free(handler);
-}
-
-http_thread_args_t* http_thread_args_new(http_server_t* server, int sock_fd) {
+http_thread_args_t* http_thread_args_new(http_server_t* server,
+                                         http_work_queue_t* queue) {
     http_thread_args_t* thread_args = malloc(sizeof(http_thread_args_t));
+    HTTP_EXPECT(thread_args != NULL, "malloc()");
     thread_args->server = server;
-    thread_args->sock_fd = sock_fd;
+    thread_args->queue = queue;
+    thread_args->sock_fd = -1;
+    thread_args->reader = malloc(sizeof(http_reader_t));
+    HTTP_EXPECT(thread_args->reader != NULL, "malloc()");
+    http_reader_init(thread_args->reader);
+    thread_args->arena = arena_new();
+    HTTP_EXPECT(thread_args->arena != NULL, "arena_new()");
     return thread_args;
 }
 
 void http_thread_args_free(http_thread_args_t* thread_args) {
+    http_reader_free(thread_args->reader);
+    free(thread_args->reader);
+    arena_free(thread_args->arena);
     free(thread_args);
 }
 
@@ -463,14 +2030,20 @@ char* http_status_to_string(http_status_t status) {
     switch (status) {
     case HTTP_STATUS_OK:
         return "OK";
+    case HTTP_STATUS_NOT_MODIFIED:
+        return "Not Modified";
     case HTTP_STATUS_BAD_REQUEST:
         return "Bad Request";
     case HTTP_STATUS_NOT_FOUND:
         return "Not Found";
     case HTTP_STATUS_METHOD_NOT_ALLOWED:
         return "Method Not Allowed";
+    case HTTP_STATUS_PAYLOAD_TOO_LARGE:
+        return "Payload Too Large";
     case HTTP_STATUS_INTERNAL_SERVER_ERROR:
         return "Internal Server Error";
+    case HTTP_STATUS_SERVICE_UNAVAILABLE:
+        return "Service Unavailable";
     default:
         return "Unknown";
     }
@@ -10,12 +10,47 @@
 #include <stdlib.h>
 #include <string.h>
 
+// requests and responses are allocated through http_alloc(), this includes their
+// header and query param lists
+void* http_alloc(size_t size);
+void http_dealloc(void* ptr);
+
+#define LIST_ALLOC http_alloc
+#define LIST_DEALLOC http_dealloc
 #include "list.h"
 
 // max size for everything except the body as it is written from a user provided buffer
 #define HTTP_MAX_RESPONSE_HEAD_SIZE 1024
-// max size for a http request (includes body)
-#define HTTP_MAX_REQUEST_SIZE 1024
+// default max size for a http request (includes body), larger requests get a 413
+#define HTTP_MAX_REQUEST_SIZE (1024 * 1024)
+// initial size of the request buffers, they grow up to the max request size as needed
+#define HTTP_REQUEST_BUFFER_SIZE 1024
+// size of the chunks of streamed responses
+#define HTTP_STREAM_CHUNK_SIZE (16 * 1024)
+// max number of chunks a worker produces for a streamed response before the connection
+// goes to the back of the work queue, so other requests get their turn (epoll mode)
+#define HTTP_STREAM_TURN_CHUNKS 16
+// seconds a response may wait for a full socket to become writable again (blocking
+// sends, e.g. streamed responses)
+#define HTTP_SEND_TIMEOUT 30
+// max number of events handled per epoll_wait() call
+#define HTTP_MAX_EVENTS 64
+// default number of queued connections/requests per worker thread
+#define HTTP_QUEUE_SIZE_PER_WORKER 64
+// default seconds before an idle keep-alive connection is closed
+#define HTTP_KEEP_ALIVE_TIMEOUT 5
+// default max number of requests on a single keep-alive connection
+#define HTTP_MAX_KEEP_ALIVE_REQUESTS 100
+// default length of the accept queue of each listening socket (capped by the kernel at
+// net.core.somaxconn)
+#define HTTP_LISTEN_BACKLOG 1024
+// max number of parameters (e.g. :id) in a route pattern
+#define HTTP_MAX_PATH_PARAMS 8
+// default zlib level of compressed responses
+#define HTTP_COMPRESSION_LEVEL 6
+// default size below which bodies are sent uncompressed, the gzip framing alone is 18
+// bytes and small bodies don't shrink much
+#define HTTP_COMPRESSION_MIN_SIZE 1024
 
 #define HTTP_EXPECT(expr, s, ...)                                                        \
     if (!(expr)) {                                                                       \
@@ -31,15 +66,21 @@
 #define HTTP_DEBUG(s, ...) fprintf(stderr, "\033[34mDEBUG\033[0m " s "\n", ##__VA_ARGS__);
 
 typedef struct http_server http_server_t;
-typedef struct http_handler http_handler_t;
 typedef struct http_request http_request_t;
 typedef struct http_query_param http_query_param_t;
+typedef struct http_path_param http_path_param_t;
 typedef struct http_response http_response_t;
 typedef struct http_header http_header_t;
 typedef struct http_thread_args http_thread_args_t;
+typedef struct http_work_queue http_work_queue_t;
+typedef struct http_reader http_reader_t;
+typedef struct arena arena_t;
+typedef struct http_router http_router_t;
+typedef struct http_stream http_stream_t;
 typedef enum http_method http_method_t;
 typedef enum http_status http_status_t;
-LIST_DEF(http_handler_t*, http_handlers_t);
+typedef enum http_encoding http_encoding_t;
+typedef enum http_server_mode http_server_mode_t;
 LIST_DEF(http_header_t*, http_headers_t);
 LIST_DEF(http_query_param_t*, http_query_params_t);
 
@@ -47,24 +88,94 @@ enum http_method {
     HTTP_METHOD_GET = 0,
     HTTP_METHOD_POST = 1,
 };
+#define HTTP_METHOD_COUNT 2
 
 enum http_status {
     HTTP_STATUS_OK = 200,
+    HTTP_STATUS_NOT_MODIFIED = 304,
     HTTP_STATUS_BAD_REQUEST = 400,
     HTTP_STATUS_NOT_FOUND = 404,
     HTTP_STATUS_METHOD_NOT_ALLOWED = 405,
+    HTTP_STATUS_PAYLOAD_TOO_LARGE = 413,
     HTTP_STATUS_INTERNAL_SERVER_ERROR = 500,
+    HTTP_STATUS_SERVICE_UNAVAILABLE = 503,
+};
+
+// content codings of response bodies, negotiated with the request's Accept-Encoding
+enum http_encoding {
+    HTTP_ENCODING_IDENTITY = 0,
+    HTTP_ENCODING_GZIP = 1,
+    HTTP_ENCODING_DEFLATE = 2,
+};
+#define HTTP_ENCODING_COUNT 3
+
+// how http_server_run() handles connections
+// EPOLL: a single edge-triggered epoll loop owns accept, read and write for all sockets,
+//        complete requests are passed to the worker threads
+// THREADS: the worker threads handle whole connections with blocking io
+enum http_server_mode {
+    HTTP_SERVER_MODE_EPOLL = 0,
+    HTTP_SERVER_MODE_THREADS = 1,
 };
 
 struct http_server {
-    http_handlers_t* handlers;
+    http_router_t* router;
+    http_server_mode_t mode;
+    // number of worker threads running the route handlers, 0 = number of cpus
+    size_t worker_count;
+    // max number of connections/requests waiting for a worker,
+    // 0 = worker_count * HTTP_QUEUE_SIZE_PER_WORKER
+    size_t queue_size;
+    // requests (head + body) larger than this are answered with 413
+    size_t max_request_size;
+    // seconds before an idle connection is closed
+    int keep_alive_timeout;
+    // the connection is closed after this many requests
+    size_t max_keep_alive_requests;
+    // number of listening sockets, each with its own accept loop (epoll mode: its own
+    // event loop), 1 = single listener, 0 = one per cpu
+    // multiple listeners share the port via SO_REUSEPORT and the kernel spreads
+    // incoming connections across them
+    size_t listener_count;
+    // length of the accept queue of each listener
+    int backlog;
+    // pin listener i to cpu i (modulo the number of cpus)
+    int pin_listeners;
+    // zlib level (1-9) of responses compressed for clients that accept gzip or deflate,
+    // 0 = never compress
+    int compression_level;
+    // bodies smaller than this are sent uncompressed
+    size_t compression_min_size;
 };
 
 typedef http_response_t* (*http_handler_callback_t)(http_request_t*);
 
-struct http_handler {
-    http_handler_callback_t callback;
-    char* path;
+// releases a response body once it has been sent (or the connection failed)
+// ctx is the owner of the body, e.g. the body itself for free() or the object the
+// body was serialized from
+typedef void (*http_body_release_t)(void* ctx);
+
+// produces the body of a streamed response with http_stream_write(), a part at a time:
+// the callback is called until it returns HTTP_STREAM_DONE, it should return
+// HTTP_STREAM_MORE once http_stream_full() is set and continues where it left off when
+// the queued output has been sent, HTTP_STREAM_ERROR aborts the response
+// a slow client then only holds the callback's ctx, not a worker thread
+typedef int (*http_stream_callback_t)(http_stream_t* stream, void* ctx);
+#define HTTP_STREAM_DONE 0
+#define HTTP_STREAM_MORE 1
+#define HTTP_STREAM_ERROR (-1)
+
+// sees every chunk of a streamed response right before it is sent, e.g. to keep a copy
+// of the body
+typedef void (*http_stream_tap_t)(const char* data, size_t size, void* ctx);
+
+// name and value point into the route pattern and the request path and are not null
+// terminated
+struct http_path_param {
+    char* name;
+    size_t name_size;
+    char* value;
+    size_t value_size;
 };
 
 struct http_request {
@@ -74,6 +185,12 @@ struct http_request {
     http_headers_t* headers;
     char* body;
     size_t body_size;
+    // parameters captured by the route pattern, e.g. id for /stations/:id
+    http_path_param_t params[HTTP_MAX_PATH_PARAMS];
+    size_t param_count;
+    // preferred encoding of the Accept-Encoding header (identity if the server doesn't
+    // compress), set before the handler runs
+    http_encoding_t encoding;
 };
 
 struct http_query_param {
@@ -86,6 +203,16 @@ struct http_response {
     http_headers_t* headers;
     char* body;
     size_t body_size;
+    // called with body_ctx by http_response_free(), NULL if the body is static
+    http_body_release_t body_release;
+    void* body_ctx;
+    // set for streamed responses, called with body_ctx to produce the body
+    http_stream_callback_t stream;
+    // set by the server, the encoding a streamed body is compressed with (unless it
+    // turns out to be smaller than the server's compression_min_size)
+    http_encoding_t encoding;
+    // set by the server, decides the Connection header
+    int keep_alive;
 };
 
 struct http_header {
@@ -93,19 +220,32 @@ struct http_header {
     char* value;
 };
 
+// state of a worker thread
 struct http_thread_args {
     http_server_t* server;
+    http_work_queue_t* queue;
+    // connection currently handled (threads mode)
     int sock_fd;
+    // request buffer reused for every connection (threads mode)
+    http_reader_t* reader;
+    // backs the request/response objects, reset after every response (threads mode)
+    arena_t* arena;
 };
 
 http_server_t* http_server_new();
 void http_server_free(http_server_t* server);
 
+// path is either static (/data) or a pattern with parameters (/stations/:id/data)
+// requests with a method that has no handler on a matching route get a 405
+void http_server_add_route(http_server_t* server, http_method_t method, char* path,
+                           http_handler_callback_t callback);
+// registers the handler for all methods
 void http_server_add_handler(http_server_t* server, char* path,
                              http_handler_callback_t callback);
 void http_server_handle_connection(http_thread_args_t* args);
-void http_server_send_response(http_server_t* server, http_response_t* response,
-                               int sock_fd);
+http_response_t* http_server_dispatch(http_server_t* server, http_request_t* request);
+int http_server_send_response(http_server_t* server, http_response_t* response,
+                              int sock_fd);
 void http_server_run(http_server_t* server, char* address, uint16_t port);
 
 http_request_t* http_request_new(http_method_t method, char* path,
@@ -114,6 +254,7 @@ http_request_t* http_request_new(http_method_t method, char* path,
 http_request_t* http_request_parse(char* buffer, size_t size);
 void http_request_free(http_request_t* request);
 void http_request_print(http_request_t* request);
+http_path_param_t* http_request_get_param(http_request_t* request, char* name);
 
 http_query_param_t* http_query_param_new(char* name, char* value);
 void http_query_param_free(http_query_param_t* param);
@@ -124,7 +265,11 @@ void http_query_params_add(http_query_params_t* params, http_query_param_t* para
 http_query_param_t* http_query_params_get(http_query_params_t* params, char* name);
 
 http_response_t* http_response_new(http_status_t status, http_headers_t* headers,
-                                   char* body, size_t body_size);
+                                   char* body, size_t body_size,
+                                   http_body_release_t body_release, void* body_ctx);
+http_response_t* http_response_new_stream(http_status_t status, http_headers_t* headers,
+                                          http_stream_callback_t stream,
+                                          http_body_release_t release, void* ctx);
 void http_response_free(http_response_t* response);
 size_t http_response_head_to_buffer(http_response_t* response, char* buffer, size_t size);
 
@@ -136,12 +281,24 @@ void http_headers_free(http_headers_t* headers);
 void http_headers_add(http_headers_t* headers, http_header_t* header);
 http_header_t* http_headers_get(http_headers_t* headers, char* name);
 
-http_handler_t* http_handler_new(char* path, http_handler_callback_t callback);
-void http_handler_free(http_handler_t* handler);
-
-http_thread_args_t* http_thread_args_new(http_server_t* server, int sock_fd);
+http_thread_args_t* http_thread_args_new(http_server_t* server,
+                                         http_work_queue_t* queue);
 void http_thread_args_free(http_thread_args_t* thread_args);
 
+int http_stream_write(http_stream_t* stream, const char* data, size_t size);
+int http_stream_write_string(http_stream_t* stream, const char* str);
+char* http_stream_reserve(http_stream_t* stream, size_t size);
+void http_stream_commit(http_stream_t* stream, size_t size);
+void http_stream_set_tap(http_stream_t* stream, http_stream_tap_t tap, void* ctx);
+int http_stream_full(http_stream_t* stream);
+
+// value of the Content-Encoding header, NULL for identity
+extern const char* http_encoding_names[HTTP_ENCODING_COUNT];
+// compresses size bytes of data at once into *out (malloc()ed)
+// returns the compressed size or 0 on failure
+size_t http_compress(http_encoding_t encoding, int level, const char* data, size_t size,
+                     char** out);
+
 char* http_status_to_string(http_status_t status);
 
 // evil macro magic for the HTTP_HEADER macro below
@@ -155,6 +312,9 @@ char* http_status_to_string(http_status_t status);
 // HTTP_RESPONSE("success", HTTP_STATUS_OK) -> status 200, no headers, body length =
 //                                             strlen("success")
 // HTTP_RESPONSE("success", HTTP_STATUS_OK, HTTP_HEADERS(("Content-Type", "text/plain")))
+// HTTP_RESPONSE(body, HTTP_STATUS_OK, NULL, body_size, free) -> free(body) after sending
+// HTTP_RESPONSE(body, HTTP_STATUS_OK, NULL, body_size, release, ctx) -> release(ctx)
+//                                                                     after sending
 
 #define _HTTP_EVAL0(...) __VA_ARGS__
 #define _HTTP_EVAL1(...) _HTTP_EVAL0(_HTTP_EVAL0(_HTTP_EVAL0(__VA_ARGS__)))
@@ -191,18 +351,27 @@ char* http_status_to_string(http_status_t status);
         _http_headers;                                                                   \
     })
 
-#define _HTTP_RESPONSE1(body) http_response_new(HTTP_STATUS_OK, NULL, body, strlen(body))
-#define _HTTP_RESPONSE2(body, status) http_response_new(status, NULL, body, strlen(body))
+#define _HTTP_RESPONSE1(body)                                                            \
+    http_response_new(HTTP_STATUS_OK, NULL, body, strlen(body), NULL, NULL)
+#define _HTTP_RESPONSE2(body, status)                                                    \
+    http_response_new(status, NULL, body, strlen(body), NULL, NULL)
 #define _HTTP_RESPONSE3(body, status, headers)                                           \
-    http_response_new(status, headers, body, strlen(body))
+    http_response_new(status, headers, body, strlen(body), NULL, NULL)
 #define _HTTP_RESPONSE4(body, status, headers, body_size)                                \
-    http_response_new(status, headers, body, body_size)
+    http_response_new(status, headers, body, body_size, NULL, NULL)
+#define _HTTP_RESPONSE5(body, status, headers, body_size, release)                       \
+    ({                                                                                   \
+        char* _http_body = (body);                                                       \
+        http_response_new(status, headers, _http_body, body_size, release, _http_body);  \
+    })
+#define _HTTP_RESPONSE6(body, status, headers, body_size, release, ctx)                  \
+    http_response_new(status, headers, body, body_size, release, ctx)
 
-#define _HTTP_GET_RESPONSE(_1, _2, _3, _4, NAME, ...) NAME
+#define _HTTP_GET_RESPONSE(_1, _2, _3, _4, _5, _6, NAME, ...) NAME
 
 #define HTTP_RESPONSE(...)                                                               \
-    _HTTP_GET_RESPONSE(__VA_ARGS__, _HTTP_RESPONSE4, _HTTP_RESPONSE3, _HTTP_RESPONSE2,   \
-                       _HTTP_RESPONSE1)                                                  \
+    _HTTP_GET_RESPONSE(__VA_ARGS__, _HTTP_RESPONSE6, _HTTP_RESPONSE5, _HTTP_RESPONSE4,   \
+                       _HTTP_RESPONSE3, _HTTP_RESPONSE2, _HTTP_RESPONSE1)                \
     (__VA_ARGS__)
 
 #endif // __HTTP_H
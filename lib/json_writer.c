@@ -0,0 +1,118 @@
+// Copyright (C) 2021 Lennard Walter
+// License: MIT
+
+#include "json_writer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// powers of ten that are exact doubles
+static const double json_pow10[] = {1e0, 1e1, 1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                    1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+// integers below this are exact doubles
+#define JSON_MAX_EXACT_INT 9007199254740992.0
+
+// writes the digits of value in reverse order, returns the number of digits
+static size_t json_write_digits_reversed(char* out, uint64_t value) {
+    size_t size = 0;
+    do {
+        out[size++] = '0' + value % 10;
+        value /= 10;
+    } while (value > 0);
+    return size;
+}
+
+size_t json_write_int(char* out, int64_t value) {
+    size_t size = 0;
+    uint64_t magnitude = value;
+    if (value < 0) {
+        out[size++] = '-';
+        magnitude = -magnitude;
+    }
+
+    char digits[JSON_INT_MAX_SIZE];
+    size_t digit_count = json_write_digits_reversed(digits, magnitude);
+    while (digit_count > 0) {
+        out[size++] = digits[--digit_count];
+    }
+    return size;
+}
+
+// fast path for values with few decimals (sensor readings are usually like 1013.1):
+// finds the smallest number of decimals d for which the integer m nearest to
+// value * 10^d gives back value, m / 10^d is correctly rounded because both operands are
+// exact, so the result reads back as exactly value
+// returns 0 if there is no such d (then the slow path takes over)
+static size_t json_write_fixed(char* out, double value) {
+    double magnitude = fabs(value);
+
+    for (size_t decimals = 0; decimals < sizeof(json_pow10) / sizeof(json_pow10[0]);
+         decimals++) {
+        double scaled = magnitude * json_pow10[decimals];
+        if (scaled >= JSON_MAX_EXACT_INT) {
+            return 0;
+        }
+
+        // rounded to the nearest integer, nearbyint() is a lot slower
+        uint64_t mantissa = (uint64_t)(scaled + 0.5);
+        if ((double)mantissa / json_pow10[decimals] != magnitude) {
+            continue;
+        }
+
+        char digits[24];
+        size_t digit_count = json_write_digits_reversed(digits, mantissa);
+        // leading zeros, e.g. 5 with 2 decimals is 0.05
+        while (digit_count <= decimals) {
+            digits[digit_count++] = '0';
+        }
+
+        size_t size = 0;
+        if (signbit(value)) {
+            out[size++] = '-';
+        }
+        while (digit_count > decimals) {
+            out[size++] = digits[--digit_count];
+        }
+        out[size++] = '.';
+        if (decimals == 0) {
+            out[size++] = '0';
+        }
+        while (digit_count > 0) {
+            out[size++] = digits[--digit_count];
+        }
+        return size;
+    }
+
+    return 0;
+}
+
+size_t json_write_double(char* out, double value) {
+    if (!isfinite(value)) {
+        return JSON_WRITE_LITERAL(out, "null");
+    }
+
+    size_t size = json_write_fixed(out, value);
+    if (size > 0) {
+        return size;
+    }
+
+    // slow path for very large/small values and ones with many digits: the shortest of
+    // 15, 16 and 17 significant digits that reads back as value (17 always does)
+    char buffer[JSON_DOUBLE_MAX_SIZE];
+    for (int precision = 15; precision <= 17; precision++) {
+        size = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (precision == 17 || strtod(buffer, NULL) == value) {
+            break;
+        }
+    }
+
+    memcpy(out, buffer, size);
+    if (strpbrk(buffer, ".e") == NULL) {
+        out[size++] = '.';
+        out[size++] = '0';
+    }
+    return size;
+}
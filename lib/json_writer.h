@@ -0,0 +1,31 @@
+// Copyright (C) 2021 Lennard Walter
+// License: MIT
+
+#ifndef __JSON_WRITER_H
+#define __JSON_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// formats json values straight into a caller provided buffer (e.g. memory reserved in a
+// streamed response), nothing is allocated
+// the caller makes sure the buffer has room for the max size of each value
+
+// max number of bytes written by json_write_double() / json_write_int()
+#define JSON_DOUBLE_MAX_SIZE 32
+#define JSON_INT_MAX_SIZE 20
+
+// copies a string literal without the terminating \0, returns the number of bytes written
+#define JSON_WRITE_LITERAL(out, literal)                                                 \
+    (memcpy((out), (literal), sizeof(literal) - 1), sizeof(literal) - 1)
+
+// writes the shortest decimal representation that reads back as exactly the same
+// double, integral values keep a trailing ".0" (like json-c) so they stay recognizable
+// as doubles, non-finite values are written as null
+// returns the number of bytes written
+size_t json_write_double(char* out, double value);
+// returns the number of bytes written
+size_t json_write_int(char* out, int64_t value);
+
+#endif // __JSON_WRITER_H
@@ -9,6 +9,15 @@
 // disable -Wunused-value warnings (compiler complains because of compound expressions)
 #pragma GCC diagnostic ignored "-Wunused-value"
 
+// allocator used for lists and nodes, define both before including this header to
+// use a custom allocator
+#ifndef LIST_ALLOC
+#define LIST_ALLOC malloc
+#endif
+#ifndef LIST_DEALLOC
+#define LIST_DEALLOC free
+#endif
+
 #define _LIST_NODE_TYPE(type) type##_node_t
 #define _LIST_NODE_TYPE_P(type) _LIST_NODE_TYPE(type)*
 
@@ -28,7 +37,7 @@
 
 #define LIST_NEW(listtype)                                                               \
     ({                                                                                   \
-        listtype* __list_tmp = malloc(sizeof(listtype));                                 \
+        listtype* __list_tmp = LIST_ALLOC(sizeof(listtype));                             \
         __list_tmp->head = NULL;                                                         \
         __list_tmp->tail = NULL;                                                         \
         __list_tmp->node_size = sizeof(_LIST_NODE_TYPE(listtype));                       \
@@ -41,15 +50,15 @@
         typeof(list->head) node = list->head;                                            \
         while (node) {                                                                   \
             typeof(node->next) next = node->next;                                        \
-            free(node);                                                                  \
+            LIST_DEALLOC(node);                                                          \
             node = next;                                                                 \
         }                                                                                \
-        free(list);                                                                      \
+        LIST_DEALLOC(list);                                                              \
     } while (0)
 
 #define LIST_APPEND(list, value_)                                                        \
     do {                                                                                 \
-        typeof(list->head) node = malloc(list->node_size);                               \
+        typeof(list->head) node = LIST_ALLOC(list->node_size);                           \
         node->value = value_;                                                            \
         node->next = NULL;                                                               \
         node->prev = list->tail;                                                         \
@@ -65,7 +74,7 @@
 
 #define LIST_PREPEND(list, value_)                                                       \
     do {                                                                                 \
-        typeof(list->head) node = malloc(list->node_size);                               \
+        typeof(list->head) node = LIST_ALLOC(list->node_size);                           \
         node->value = value_;                                                            \
         node->next = list->head;                                                         \
         node->prev = NULL;                                                               \
@@ -102,7 +111,7 @@
 
 #define LIST_INSERT(list, index, value_)                                                 \
     do {                                                                                 \
-        typeof(list->head) node = malloc(list->node_size);                               \
+        typeof(list->head) node = LIST_ALLOC(list->node_size);                           \
         node->value = value_;                                                            \
         node->next = NULL;                                                               \
         node->prev = NULL;                                                               \
@@ -134,7 +143,7 @@
         } else {                                                                         \
             list->tail = node->prev;                                                     \
         }                                                                                \
-        free(node);                                                                      \
+        LIST_DEALLOC(node);                                                              \
         list->length--;                                                                  \
     } while (0)
 
@@ -0,0 +1,302 @@
+// Copyright (C) 2021 Lennard Walter
+// License: MIT
+
+#include "router.h"
+
+// method names for the Allow header, indexed by http_method_t
+static const char* http_method_names[HTTP_METHOD_COUNT] = {"GET", "POST"};
+
+// seeded FNV-1a, the seed is picked by http_router_build_table() so that no two static
+// routes share a slot
+static uint64_t http_router_hash(const char* str, size_t size, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash ^ (hash >> 32);
+}
+
+// searches for a seed without collisions, doubling the table every few hundred
+// attempts, with dozens of routes this takes a couple of tries at startup
+static void http_router_build_table(http_router_t* router) {
+    size_t table_size = 8;
+    while (table_size < router->static_count * 2) {
+        table_size *= 2;
+    }
+
+    http_route_t** table = NULL;
+    uint64_t seed = 0;
+    while (1) {
+        table = realloc(table, sizeof(http_route_t*) * table_size);
+        HTTP_EXPECT(table != NULL, "realloc()");
+
+        for (int attempt = 0; attempt < 256; attempt++, seed++) {
+            memset(table, 0, sizeof(http_route_t*) * table_size);
+
+            size_t i;
+            for (i = 0; i < router->static_count; i++) {
+                char* path = router->static_routes[i]->path;
+                size_t slot =
+                    http_router_hash(path, strlen(path), seed) & (table_size - 1);
+                if (table[slot] != NULL) {
+                    break;
+                }
+                table[slot] = router->static_routes[i];
+            }
+
+            if (i == router->static_count) {
+                free(router->table);
+                router->table = table;
+                router->table_mask = table_size - 1;
+                router->seed = seed;
+                return;
+            }
+        }
+
+        table_size *= 2;
+    }
+}
+
+static http_route_t* http_route_new(char* path) {
+    http_route_t* route = malloc(sizeof(http_route_t));
+    HTTP_EXPECT(route != NULL, "malloc()");
+    route->path = path;
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        route->callbacks[i] = NULL;
+    }
+    route->allow[0] = '\0';
+    return route;
+}
+
+static void http_route_set(http_route_t* route, http_method_t method,
+                           http_handler_callback_t callback) {
+    route->callbacks[method] = callback;
+
+    char* allow = route->allow;
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++) {
+        if (route->callbacks[i] != NULL) {
+            allow += sprintf(allow, "%s%s", allow == route->allow ? "" : ", ",
+                             http_method_names[i]);
+        }
+    }
+}
+
+static http_route_node_t* http_route_node_new(char* prefix, size_t prefix_size) {
+    http_route_node_t* node = malloc(sizeof(http_route_node_t));
+    HTTP_EXPECT(node != NULL, "malloc()");
+    node->prefix = prefix;
+    node->prefix_size = prefix_size;
+    node->param_name = NULL;
+    node->param_name_size = 0;
+    node->children = NULL;
+    node->child_count = 0;
+    node->param_child = NULL;
+    node->route = NULL;
+    return node;
+}
+
+static void http_route_node_free(http_route_node_t* node) {
+    for (size_t i = 0; i < node->child_count; i++) {
+        http_route_node_free(node->children[i]);
+    }
+    if (node->param_child != NULL) {
+        http_route_node_free(node->param_child);
+    }
+    free(node->children);
+    free(node->route);
+    free(node);
+}
+
+static void http_route_node_add_child(http_route_node_t* node,
+                                      http_route_node_t* child) {
+    node->children =
+        realloc(node->children, sizeof(http_route_node_t*) * (node->child_count + 1));
+    HTTP_EXPECT(node->children != NULL, "realloc()");
+    node->children[node->child_count++] = child;
+}
+
+// inserts the rest of a pattern below node (whose own prefix/parameter is already
+// consumed) and returns the node the pattern ends at
+static http_route_node_t* http_route_node_insert(http_route_node_t* node, char* pattern,
+                                                 size_t param_count) {
+    if (*pattern == '\0') {
+        return node;
+    }
+
+    if (*pattern == ':') {
+        char* name = pattern + 1;
+        size_t name_size = strcspn(name, "/");
+        if (name_size == 0) {
+            HTTP_ERROR("empty parameter name in route pattern");
+        }
+        if (param_count == HTTP_MAX_PATH_PARAMS) {
+            HTTP_ERROR("more than %d parameters in route pattern", HTTP_MAX_PATH_PARAMS);
+        }
+
+        http_route_node_t* child = node->param_child;
+        if (child == NULL) {
+            child = http_route_node_new(NULL, 0);
+            child->param_name = name;
+            child->param_name_size = name_size;
+            node->param_child = child;
+        } else if (child->param_name_size != name_size ||
+                   memcmp(child->param_name, name, name_size) != 0) {
+            HTTP_ERROR("conflicting parameter names :%.*s and :%.*s in route patterns",
+                       (int)child->param_name_size, child->param_name, (int)name_size,
+                       name);
+        }
+
+        return http_route_node_insert(child, name + name_size, param_count + 1);
+    }
+
+    size_t static_size = strcspn(pattern, ":");
+
+    for (size_t i = 0; i < node->child_count; i++) {
+        http_route_node_t* child = node->children[i];
+        if (child->prefix[0] != pattern[0]) {
+            continue;
+        }
+
+        size_t common = 1;
+        while (common < child->prefix_size && common < static_size &&
+               child->prefix[common] == pattern[common]) {
+            common++;
+        }
+
+        // the pattern diverges inside the child's prefix, split the child
+        if (common < child->prefix_size) {
+            http_route_node_t* split = http_route_node_new(child->prefix, common);
+            child->prefix += common;
+            child->prefix_size -= common;
+            http_route_node_add_child(split, child);
+            node->children[i] = split;
+            child = split;
+        }
+
+        return http_route_node_insert(child, pattern + common, param_count);
+    }
+
+    http_route_node_t* child = http_route_node_new(pattern, static_size);
+    http_route_node_add_child(node, child);
+    return http_route_node_insert(child, pattern + static_size, param_count);
+}
+
+// static children are tried before the parameter child, so /stations/list wins over
+// /stations/:id, on a dead end the search backtracks
+static http_route_t* http_route_node_match(http_route_node_t* node, char* path,
+                                           http_request_t* request) {
+    if (node->param_name != NULL) {
+        size_t value_size = strcspn(path, "/");
+        if (value_size == 0) {
+            return NULL;
+        }
+
+        http_path_param_t* param = &request->params[request->param_count++];
+        param->name = node->param_name;
+        param->name_size = node->param_name_size;
+        param->value = path;
+        param->value_size = value_size;
+        path += value_size;
+    } else {
+        if (strncmp(node->prefix, path, node->prefix_size) != 0) {
+            return NULL;
+        }
+        path += node->prefix_size;
+    }
+
+    if (*path == '\0') {
+        if (node->route != NULL) {
+            return node->route;
+        }
+    } else {
+        for (size_t i = 0; i < node->child_count; i++) {
+            if (node->children[i]->prefix[0] == *path) {
+                http_route_t* route =
+                    http_route_node_match(node->children[i], path, request);
+                if (route != NULL) {
+                    return route;
+                }
+                break;
+            }
+        }
+
+        if (node->param_child != NULL) {
+            http_route_t* route = http_route_node_match(node->param_child, path, request);
+            if (route != NULL) {
+                return route;
+            }
+        }
+    }
+
+    if (node->param_name != NULL) {
+        request->param_count--;
+    }
+    return NULL;
+}
+
+http_router_t* http_router_new() {
+    http_router_t* router = malloc(sizeof(http_router_t));
+    HTTP_EXPECT(router != NULL, "malloc()");
+    router->table = NULL;
+    router->table_mask = 0;
+    router->seed = 0;
+    router->static_routes = NULL;
+    router->static_count = 0;
+    router->root = http_route_node_new("", 0);
+    http_router_build_table(router);
+    return router;
+}
+
+void http_router_free(http_router_t* router) {
+    for (size_t i = 0; i < router->static_count; i++) {
+        free(router->static_routes[i]);
+    }
+    free(router->static_routes);
+    free(router->table);
+    http_route_node_free(router->root);
+    free(router);
+}
+
+void http_router_add(http_router_t* router, http_method_t method, char* path,
+                     http_handler_callback_t callback) {
+    if (strchr(path, ':') != NULL) {
+        http_route_node_t* node = http_route_node_insert(router->root, path, 0);
+        if (node->route == NULL) {
+            node->route = http_route_new(path);
+        }
+        http_route_set(node->route, method, callback);
+        return;
+    }
+
+    for (size_t i = 0; i < router->static_count; i++) {
+        if (strcmp(router->static_routes[i]->path, path) == 0) {
+            http_route_set(router->static_routes[i], method, callback);
+            return;
+        }
+    }
+
+    http_route_t* route = http_route_new(path);
+    http_route_set(route, method, callback);
+
+    router->static_routes = realloc(router->static_routes,
+                                    sizeof(http_route_t*) * (router->static_count + 1));
+    HTTP_EXPECT(router->static_routes != NULL, "realloc()");
+    router->static_routes[router->static_count++] = route;
+
+    http_router_build_table(router);
+}
+
+http_route_t* http_router_match(http_router_t* router, http_request_t* request) {
+    char* path = request->path;
+    size_t path_size = strlen(path);
+
+    size_t slot = http_router_hash(path, path_size, router->seed) & router->table_mask;
+    http_route_t* route = router->table[slot];
+    if (route != NULL && strcmp(route->path, path) == 0) {
+        return route;
+    }
+
+    request->param_count = 0;
+    return http_route_node_match(router->root, path, request);
+}
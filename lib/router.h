@@ -0,0 +1,64 @@
+// Copyright (C) 2021 Lennard Walter
+// License: MIT
+
+#ifndef __ROUTER_H
+#define __ROUTER_H
+
+#include "http.h"
+
+// maps request paths to route handlers, one handler per method
+// static paths (no parameters) are looked up in a collision free hash table that is
+// rebuilt whenever a route is added, patterns like /stations/:id/data live in a radix
+// tree that is only searched if there is no static match
+// routes are added before the server starts, lookups don't lock and don't allocate
+
+typedef struct http_route http_route_t;
+typedef struct http_route_node http_route_node_t;
+
+struct http_route {
+    // the path/pattern the route was registered with
+    char* path;
+    // handler per method, NULL = method not allowed
+    http_handler_callback_t callbacks[HTTP_METHOD_COUNT];
+    // value of the Allow header of 405 responses, e.g. "GET, POST"
+    char allow[32];
+};
+
+struct http_route_node {
+    // static part of the path matched by this node, points into the route pattern
+    char* prefix;
+    size_t prefix_size;
+    // set on parameter nodes, which match a single non-empty path segment instead of
+    // the prefix, points into the route pattern (not null terminated)
+    char* param_name;
+    size_t param_name_size;
+    // static children, their prefixes start with distinct characters
+    http_route_node_t** children;
+    size_t child_count;
+    http_route_node_t* param_child;
+    // route ending at this node, NULL if none
+    http_route_t* route;
+};
+
+struct http_router {
+    // routes without parameters, table_mask + 1 slots indexed by http_router_hash()
+    http_route_t** table;
+    size_t table_mask;
+    uint64_t seed;
+    // all routes without parameters, the table is built from these
+    http_route_t** static_routes;
+    size_t static_count;
+    // root of the radix tree holding the routes with parameters
+    http_route_node_t* root;
+};
+
+http_router_t* http_router_new();
+void http_router_free(http_router_t* router);
+
+void http_router_add(http_router_t* router, http_method_t method, char* path,
+                     http_handler_callback_t callback);
+// finds the route for request->path and stores the captured parameters in the request
+// returns NULL if no route matches
+http_route_t* http_router_match(http_router_t* router, http_request_t* request);
+
+#endif // __ROUTER_H
@@ -0,0 +1,292 @@
+#include "recent.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// the writer publishes readings by storing head (release), readers load head (acquire)
+// and only look at readings before it
+// before writing to the slots the writer announces how far it is going to write in
+// claimed, readers check claimed after copying (acquire fence), the copy is intact if
+// none of the copied readings is within capacity of claimed
+// the copies race with the writer by design, torn values are detected and thrown away
+
+static void recent_append(recent_t* recent, const data_point_t* points, size_t count,
+                          int64_t lost) {
+    uint64_t mask = recent->capacity - 1;
+    uint64_t index = recent->head;
+    int64_t newest = index > 0 ? recent->timestamps[(index - 1) & mask] : INT64_MIN;
+    int64_t horizon = (int64_t)time(NULL) + DATA_MAX_CLOCK_SKEW;
+    int64_t future = INT64_MAX;
+
+    __atomic_store_n(&recent->claimed, index + count, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (size_t i = 0; i < count; i++) {
+        const data_point_t* point = &points[i];
+        // ahead of the clock, it must not become the newest reading, the readings after
+        // it would all be out of order
+        if (point->timestamp > horizon) {
+            future = point->timestamp < future ? point->timestamp : future;
+            continue;
+        }
+        // out of order, the ring no longer holds all readings from here on
+        if (point->timestamp < newest) {
+            lost = point->timestamp > lost ? point->timestamp : lost;
+            continue;
+        }
+
+        uint64_t slot = index & mask;
+        if (index >= recent->capacity) {
+            int64_t overwritten = recent->timestamps[slot];
+            lost = overwritten > lost ? overwritten : lost;
+        }
+        recent->timestamps[slot] = point->timestamp;
+        recent->values[0][slot] = point->temperature;
+        recent->values[1][slot] = point->humidity;
+        recent->values[2][slot] = point->windspeed;
+        recent->values[3][slot] = point->pressure;
+        recent->values[4][slot] = point->rain;
+        newest = point->timestamp;
+        index++;
+    }
+
+    if (lost != INT64_MIN && lost >= recent->covered_from) {
+        __atomic_store_n(&recent->covered_from, lost + 1, __ATOMIC_RELAXED);
+    }
+    if (future <= recent->covered_to) {
+        __atomic_store_n(&recent->covered_to, future - 1, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&recent->claimed, index, __ATOMIC_RELAXED);
+    __atomic_store_n(&recent->head, index, __ATOMIC_RELEASE);
+}
+
+static recent_t* recent_new(uint64_t capacity, int64_t covered_from, int64_t covered_to) {
+    recent_t* recent = calloc(1, sizeof(recent_t));
+    if (recent == NULL) {
+        return NULL;
+    }
+    recent->capacity = capacity;
+    recent->covered_from = covered_from;
+    recent->covered_to = covered_to;
+    recent->staged_lost = INT64_MIN;
+
+    // capacity is a multiple of the alignment, cache line aligned for vectorized scans
+    recent->timestamps = aligned_alloc(64, sizeof(int64_t) * capacity);
+    int failed = recent->timestamps == NULL;
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        recent->values[i] = aligned_alloc(64, sizeof(double) * capacity);
+        failed |= recent->values[i] == NULL;
+    }
+    if (failed) {
+        recent_free(recent);
+        return NULL;
+    }
+    return recent;
+}
+
+// loads the readings from from to to in chunks
+static int recent_load(recent_t* recent, sqlite3* reader, int64_t from, int64_t to) {
+    char* sql = "SELECT temperature, humidity, windspeed, pressure, rain, timestamp "
+                "FROM data WHERE id >= ?1 << 20 AND id < (?2 + 1) << 20 ORDER BY id";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(reader, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64(stmt, 1, from);
+    sqlite3_bind_int64(stmt, 2, to);
+
+    data_point_t points[RECENT_BLOCK_SIZE];
+    size_t count = 0;
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        data_point_t* point = &points[count++];
+        point->temperature = sqlite3_column_double(stmt, 0);
+        point->humidity = sqlite3_column_double(stmt, 1);
+        point->windspeed = sqlite3_column_double(stmt, 2);
+        point->pressure = sqlite3_column_double(stmt, 3);
+        point->rain = sqlite3_column_double(stmt, 4);
+        point->timestamp = sqlite3_column_int64(stmt, 5);
+        if (count == RECENT_BLOCK_SIZE) {
+            recent_append(recent, points, count, INT64_MIN);
+            count = 0;
+        }
+    }
+    recent_append(recent, points, count, INT64_MIN);
+
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+}
+
+recent_t* recent_open(db_t* db, int64_t window) {
+    sqlite3* reader = db_reader_acquire(db);
+    if (reader == NULL) {
+        printf("\033[31mERROR\033[0m No idle database reader\n");
+        return NULL;
+    }
+
+    // newest reading that isn't ahead of the clock (?2), number of readings in the
+    // window before it and the first reading ahead of the clock
+    char* sql = "WITH newest AS (SELECT MAX(id) >> 20 AS timestamp FROM data "
+                "WHERE id < (?2 + 1) << 20) "
+                "SELECT timestamp, (SELECT count(*) FROM data "
+                "WHERE id >= (timestamp - ?1) << 20 AND id < (?2 + 1) << 20), "
+                "(SELECT MIN(id) >> 20 FROM data WHERE id >= (?2 + 1) << 20) FROM newest";
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(reader, sql, -1, &stmt, NULL) != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(reader));
+        db_reader_release(db, reader);
+        return NULL;
+    }
+    int64_t horizon = (int64_t)time(NULL) + DATA_MAX_CLOCK_SKEW;
+    sqlite3_bind_int64(stmt, 1, window);
+    sqlite3_bind_int64(stmt, 2, horizon);
+    int rc = sqlite3_step(stmt);
+
+    // an empty database holds all readings since the beginning of time
+    int empty = rc != SQLITE_ROW || sqlite3_column_type(stmt, 0) == SQLITE_NULL;
+    int64_t from = empty ? INT64_MIN : sqlite3_column_int64(stmt, 0) - window;
+    uint64_t count = rc == SQLITE_ROW ? sqlite3_column_int64(stmt, 1) : 0;
+    int64_t to = rc == SQLITE_ROW && sqlite3_column_type(stmt, 2) != SQLITE_NULL
+                     ? sqlite3_column_int64(stmt, 2) - 1
+                     : INT64_MAX;
+    sqlite3_finalize(stmt);
+
+    uint64_t capacity = RECENT_MIN_CAPACITY;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+
+    recent_t* recent = NULL;
+    if (rc != SQLITE_ROW) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(reader));
+    } else if ((recent = recent_new(capacity, from, to)) == NULL) {
+        printf("\033[31mERROR\033[0m Could not allocate %lu recent readings\n",
+               (unsigned long)capacity);
+    } else if (!empty && recent_load(recent, reader, from, horizon) != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(reader));
+        recent_free(recent);
+        recent = NULL;
+    }
+
+    db_reader_release(db, reader);
+    return recent;
+}
+
+void recent_free(recent_t* recent) {
+    free(recent->timestamps);
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        free(recent->values[i]);
+    }
+    free(recent->staged);
+    free(recent);
+}
+
+void recent_stage(recent_t* recent, const data_point_t* points, size_t count) {
+    size_t needed = recent->staged_count + count;
+    if (needed > recent->staged_capacity) {
+        size_t capacity = needed > 64 ? needed * 2 : 128;
+        data_point_t* staged = realloc(recent->staged, sizeof(data_point_t) * capacity);
+        if (staged == NULL) {
+            for (size_t i = 0; i < count; i++) {
+                if (points[i].timestamp > recent->staged_lost) {
+                    recent->staged_lost = points[i].timestamp;
+                }
+            }
+            return;
+        }
+        recent->staged = staged;
+        recent->staged_capacity = capacity;
+    }
+
+    memcpy(&recent->staged[recent->staged_count], points, sizeof(data_point_t) * count);
+    recent->staged_count = needed;
+}
+
+void recent_publish(recent_t* recent, int rc) {
+    if (rc == SQLITE_OK) {
+        recent_append(recent, recent->staged, recent->staged_count, recent->staged_lost);
+    }
+    recent->staged_count = 0;
+    recent->staged_lost = INT64_MIN;
+}
+
+// whether the copies of the readings from index on are intact
+static int recent_intact(recent_t* recent, uint64_t index) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t claimed = __atomic_load_n(&recent->claimed, __ATOMIC_RELAXED);
+    return claimed <= recent->capacity || index >= claimed - recent->capacity;
+}
+
+// first index in [low, high) whose timestamp is greater than timestamp (after is set)
+// or not less than it, *first_probe is lowered to the lowest index looked at
+static uint64_t recent_search(recent_t* recent, uint64_t low, uint64_t high,
+                              int64_t timestamp, int after, uint64_t* first_probe) {
+    uint64_t mask = recent->capacity - 1;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        int64_t probe = recent->timestamps[middle & mask];
+        *first_probe = middle < *first_probe ? middle : *first_probe;
+        if (after ? probe <= timestamp : probe < timestamp) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+int recent_find(recent_t* recent, int64_t from, int64_t to, uint64_t* begin,
+                uint64_t* end) {
+    uint64_t head = __atomic_load_n(&recent->head, __ATOMIC_ACQUIRE);
+    if (from < __atomic_load_n(&recent->covered_from, __ATOMIC_RELAXED) ||
+        to > __atomic_load_n(&recent->covered_to, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+
+    uint64_t low = head > recent->capacity ? head - recent->capacity : 0;
+    uint64_t first_probe = head;
+    *begin = recent_search(recent, low, head, from, 0, &first_probe);
+    *end = to < from ? *begin : recent_search(recent, *begin, head, to, 1, &first_probe);
+    return recent_intact(recent, first_probe) ? 0 : -1;
+}
+
+int recent_read(recent_t* recent, uint64_t* index, uint64_t end, recent_block_t* block) {
+    uint64_t count = end - *index < RECENT_BLOCK_SIZE ? end - *index : RECENT_BLOCK_SIZE;
+    uint64_t slot = *index & (recent->capacity - 1);
+    // the readings may wrap around the end of the ring
+    uint64_t first = count < recent->capacity - slot ? count : recent->capacity - slot;
+
+    uint64_t rest = count - first;
+
+    memcpy(block->timestamps, &recent->timestamps[slot], sizeof(int64_t) * first);
+    memcpy(&block->timestamps[first], recent->timestamps, sizeof(int64_t) * rest);
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        memcpy(block->values[i], &recent->values[i][slot], sizeof(double) * first);
+        memcpy(&block->values[i][first], recent->values[i], sizeof(double) * rest);
+    }
+
+    if (!recent_intact(recent, *index)) {
+        return -1;
+    }
+    block->count = count;
+    *index += count;
+    return 0;
+}
+
+int recent_scan(recent_t* recent, uint64_t begin, uint64_t end,
+                recent_scan_callback_t callback, void* ctx) {
+    for (uint64_t index = begin; index < end;) {
+        uint64_t slot = index & (recent->capacity - 1);
+        uint64_t count = end - index < recent->capacity - slot ? end - index
+                                                               : recent->capacity - slot;
+        const double* values[DATA_POINT_VALUE_COUNT];
+        for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            values[i] = &recent->values[i][slot];
+        }
+        callback(&recent->timestamps[slot], values, count, ctx);
+        index += count;
+    }
+    return recent_intact(recent, begin) ? 0 : -1;
+}
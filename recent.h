@@ -0,0 +1,104 @@
+#ifndef __RECENT_H
+#define __RECENT_H
+
+#include "data_point.h"
+#include "db.h"
+
+#include <stdint.h>
+
+// in-memory copy of the most recent readings, so queries for the last hours are answered
+// without touching the database
+// the readings are kept ordered by time in a ring buffer with one array per column
+// (structure of arrays), a time range is a binary search over the timestamps followed by
+// a sequential scan of the columns
+// the writer thread appends the readings of a transaction once it is committed, the
+// queries read without locks: they copy readings out of the ring and check afterwards
+// that the writer hasn't overwritten them in the meantime (like a seqlock)
+// every reading since covered_from is in the ring, a range starting earlier has to be
+// read from the database, covered_from moves forward when old readings are overwritten
+// and when a reading older than the newest one is posted (the ring stays ordered, the
+// reading only goes to the database)
+// the order is bounded by the clock: readings more than DATA_MAX_CLOCK_SKEW ahead of it
+// (ingest rejects them, but older databases may have some) never become the newest one,
+// they stay in the database and covered_to ends before them
+
+// the ring holds at least this many readings
+#define RECENT_MIN_CAPACITY 65536
+
+// number of readings copied by recent_read() at once
+#define RECENT_BLOCK_SIZE 256
+
+typedef struct recent recent_t;
+typedef struct recent_block recent_block_t;
+
+// a run of readings in consecutive slots of the ring, values[i] are the values of
+// measured value i
+typedef void (*recent_scan_callback_t)(const int64_t* timestamps,
+                                       const double* const values[DATA_POINT_VALUE_COUNT],
+                                       size_t count, void* ctx);
+
+struct recent {
+    // power of 2, the reading with index i is in slot i & (capacity - 1)
+    uint64_t capacity;
+    int64_t* timestamps;
+    // per measured value, in the order of data_point_fields
+    double* values[DATA_POINT_VALUE_COUNT];
+
+    // number of readings appended so far, the queries see the readings before head
+    uint64_t head;
+    // the writer is appending the readings before claimed, the slots they go to may
+    // be overwritten already
+    uint64_t claimed;
+    // time range the ring holds all readings of
+    int64_t covered_from;
+    int64_t covered_to;
+
+    // only used by the writer thread
+    // readings of the current transaction
+    data_point_t* staged;
+    size_t staged_count;
+    size_t staged_capacity;
+    // newest timestamp of the readings that couldn't be staged, INT64_MIN = none
+    int64_t staged_lost;
+};
+
+// readings copied out of the ring
+struct recent_block {
+    size_t count;
+    int64_t timestamps[RECENT_BLOCK_SIZE];
+    double values[DATA_POINT_VALUE_COUNT][RECENT_BLOCK_SIZE];
+};
+
+// fills the ring with the readings of the last window seconds (up to the newest reading
+// in the database), sized for twice as many readings
+// returns NULL and logs the error on failure
+recent_t* recent_open(db_t* db, int64_t window);
+// no queries may be running anymore
+void recent_free(recent_t* recent);
+
+// adds inserted readings to the current transaction, runs on the writer thread
+// never fails, readings that can't be kept are left to the database
+void recent_stage(recent_t* recent, const data_point_t* points, size_t count);
+// appends the readings of the transaction if it was committed (rc is SQLITE_OK) or drops
+// them, runs on the writer thread
+void recent_publish(recent_t* recent, int rc);
+
+// finds the readings between from and to (inclusive), [*begin, *end) are their indexes
+// for recent_read()
+// returns -1 if the ring doesn't hold all of them, the range has to be read from the
+// database then
+int recent_find(recent_t* recent, int64_t from, int64_t to, uint64_t* begin,
+                uint64_t* end);
+// copies the readings from *index until end (at most RECENT_BLOCK_SIZE) into block and
+// advances *index
+// returns -1 if they were overwritten while being copied (the reader fell more than the
+// capacity of the ring behind the writer)
+int recent_read(recent_t* recent, uint64_t* index, uint64_t end, recent_block_t* block);
+// calls callback with the readings [begin, end) where they are (without copying them),
+// in up to two runs as they may wrap around the end of the ring
+// returns -1 if they were overwritten in the meantime, callback may have seen torn
+// values then
+int recent_scan(recent_t* recent, uint64_t begin, uint64_t end,
+                recent_scan_callback_t callback, void* ctx);
+
+#endif // __RECENT_H
@@ -0,0 +1,158 @@
+#include "rollup.h"
+
+#include "db.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ROLLUP_MERGE(value)                                                              \
+    value "_sum = " value "_sum + excluded." value "_sum, "                              \
+    value "_min = min(" value "_min, excluded." value "_min), "                          \
+    value "_max = max(" value "_max, excluded." value "_max)"
+
+// ?1 = start, ?2 = count, then sum, min and max per measured value
+#define ROLLUP_UPSERT(table)                                                             \
+    "INSERT INTO " table " VALUES (?1, ?2, ?3, ?4, ?5, ?6, ?7, ?8, ?9, ?10, ?11, ?12, "  \
+    "?13, ?14, ?15, ?16, ?17) ON CONFLICT (start) DO UPDATE SET "                        \
+    "count = count + excluded.count, " ROLLUP_ALL_VALUES(ROLLUP_MERGE)
+
+#define ROLLUP_SELECT(table)                                                             \
+    "SELECT * FROM " table " WHERE start >= ?1 AND start < ?2 ORDER BY start"
+
+const rollup_t rollups[ROLLUP_COUNT] = {
+    {"rollup_minute", 60, ROLLUP_UPSERT("rollup_minute"), ROLLUP_SELECT("rollup_minute")},
+    {"rollup_hour", 3600, ROLLUP_UPSERT("rollup_hour"), ROLLUP_SELECT("rollup_hour")},
+    {"rollup_day", 86400, ROLLUP_UPSERT("rollup_day"), ROLLUP_SELECT("rollup_day")},
+};
+
+static int rollup_upsert(sqlite3_stmt* stmt, int64_t start,
+                         const aggregate_t* aggregate) {
+    int rc = sqlite3_bind_int64(stmt, 1, start);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_bind_int64(stmt, 2, aggregate->count);
+    }
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT && rc == SQLITE_OK; i++) {
+        if ((rc = sqlite3_bind_double(stmt, 3 + 3 * i, aggregate->sum[i])) != SQLITE_OK ||
+            (rc = sqlite3_bind_double(stmt, 4 + 3 * i, aggregate->min[i])) != SQLITE_OK) {
+            break;
+        }
+        rc = sqlite3_bind_double(stmt, 5 + 3 * i, aggregate->max[i]);
+    }
+    if (rc == SQLITE_OK && sqlite3_step(stmt) != SQLITE_DONE) {
+        rc = SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    }
+    sqlite3_reset(stmt);
+    return rc;
+}
+
+// number of recent periods a reading is merged into before a new one is started, older
+// periods with the same start are just written separately (and merged by the upsert)
+#define ROLLUP_PENDING_SEARCH 8
+
+// period aggregates of the current transaction that haven't been written yet, only used
+// by the writer thread
+typedef struct rollup_pending {
+    int64_t start;
+    aggregate_t aggregate;
+} rollup_pending_t;
+
+static rollup_pending_t* rollup_pending[ROLLUP_COUNT];
+static size_t rollup_pending_count[ROLLUP_COUNT];
+static size_t rollup_pending_capacity[ROLLUP_COUNT];
+
+int rollup_add(const data_point_t* points, size_t count) {
+    // make room first so that a failure doesn't leave half of the readings behind
+    for (int r = 0; r < ROLLUP_COUNT; r++) {
+        size_t needed = rollup_pending_count[r] + count;
+        if (needed > rollup_pending_capacity[r]) {
+            size_t capacity = needed > 64 ? needed * 2 : 128;
+            rollup_pending_t* pending =
+                realloc(rollup_pending[r], sizeof(rollup_pending_t) * capacity);
+            if (pending == NULL) {
+                return SQLITE_NOMEM;
+            }
+            rollup_pending[r] = pending;
+            rollup_pending_capacity[r] = capacity;
+        }
+    }
+
+    for (int r = 0; r < ROLLUP_COUNT; r++) {
+        int64_t size = rollups[r].size;
+        rollup_pending_t* pending = rollup_pending[r];
+        for (size_t i = 0; i < count; i++) {
+            const data_point_t* point = &points[i];
+            int64_t start = point->timestamp - point->timestamp % size;
+
+            size_t j = rollup_pending_count[r];
+            size_t search_end = j > ROLLUP_PENDING_SEARCH ? j - ROLLUP_PENDING_SEARCH : 0;
+            while (j > search_end && pending[j - 1].start != start) {
+                j--;
+            }
+            if (j == search_end) {
+                j = ++rollup_pending_count[r];
+                pending[j - 1].start = start;
+                aggregate_init(&pending[j - 1].aggregate);
+            }
+
+            double values[DATA_POINT_VALUE_COUNT] = {point->temperature, point->humidity,
+                                                     point->windspeed, point->pressure,
+                                                     point->rain};
+            aggregate_add(&pending[j - 1].aggregate, values);
+        }
+    }
+
+    return SQLITE_OK;
+}
+
+int rollup_flush(sqlite3* conn, void* ctx) {
+    int rc = SQLITE_OK;
+    for (int r = 0; r < ROLLUP_COUNT; r++) {
+        if (rc == SQLITE_OK && rollup_pending_count[r] > 0) {
+            db_stmt_t* upsert = db_prepare(conn, rollups[r].upsert_sql);
+            if (upsert == NULL) {
+                rc = SQLITE_ERROR;
+            }
+            for (size_t i = 0; i < rollup_pending_count[r] && rc == SQLITE_OK; i++) {
+                rc = rollup_upsert(upsert->stmt, rollup_pending[r][i].start,
+                                   &rollup_pending[r][i].aggregate);
+            }
+            if (upsert != NULL) {
+                db_release(upsert);
+            }
+        }
+
+        // if writing fails the transaction is rolled back, so the aggregates are
+        // dropped either way
+        rollup_pending_count[r] = 0;
+    }
+    return rc;
+}
+
+const rollup_t* rollup_find(int64_t bucket_size, int64_t from, int64_t to,
+                            int64_t* periods_from, int64_t* periods_to) {
+    for (int r = ROLLUP_COUNT - 1; r >= 0; r--) {
+        const rollup_t* rollup = &rollups[r];
+        // start of the first whole period in the range and end of the last one
+        int64_t first = (from + rollup->size - 1) / rollup->size * rollup->size;
+        int64_t end = (to + 1) / rollup->size * rollup->size;
+        if (bucket_size % rollup->size == 0 && first < end) {
+            *periods_from = first;
+            *periods_to = end;
+            return rollup;
+        }
+    }
+    return NULL;
+}
+
+int64_t rollup_read(sqlite3_stmt* stmt, aggregate_t* aggregate) {
+    aggregate->count = sqlite3_column_int64(stmt, 1);
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        aggregate->sum[i] = sqlite3_column_double(stmt, 2 + 3 * i);
+        aggregate->min[i] = sqlite3_column_double(stmt, 3 + 3 * i);
+        aggregate->max[i] = sqlite3_column_double(stmt, 4 + 3 * i);
+    }
+    return sqlite3_column_int64(stmt, 0);
+}
@@ -0,0 +1,90 @@
+#ifndef __ROLLUP_H
+#define __ROLLUP_H
+
+#include "aggregate.h"
+#include "data_point.h"
+
+#include <sqlite3.h>
+
+// rollup tables hold the aggregate (count and sum, min, max per measured value) of all
+// readings of a minute, hour and day, keyed by the start of the period
+// they are updated in the transaction inserting the readings, so they are always in sync
+// with the data table, and queries for buckets of whole minutes/hours/days read one row
+// per period instead of every reading
+// the readings of a transaction are aggregated in memory first and written right before
+// the commit, with group commit the many single inserts of a transaction mostly share a
+// minute and cost one upsert per rollup table together
+
+#define ROLLUP_COUNT 3
+
+typedef struct rollup rollup_t;
+
+struct rollup {
+    const char* table;
+    // length of the period in seconds, periods start at multiples of it since the epoch
+    int64_t size;
+    // adds an aggregate to a period
+    const char* upsert_sql;
+    // periods from ?1 to ?2 (exclusive), columns as in the table
+    const char* select_sql;
+};
+
+// from the finest to the coarsest
+extern const rollup_t rollups[ROLLUP_COUNT];
+
+// the macros below are part of migration 3 (see server.c), don't change them, add a
+// migration instead
+
+// columns of a rollup table: start, count, then sum, min and max per measured value
+#define ROLLUP_VALUE_COLUMNS(value)                                                      \
+    value "_sum REAL NOT NULL, " value "_min REAL NOT NULL, " value "_max REAL NOT NULL"
+#define ROLLUP_CREATE_TABLE(table)                                                       \
+    "CREATE TABLE " table " (start INTEGER PRIMARY KEY, count INTEGER NOT NULL, "        \
+    ROLLUP_VALUE_COLUMNS("temperature") ", " ROLLUP_VALUE_COLUMNS("humidity") ", "       \
+    ROLLUP_VALUE_COLUMNS("windspeed") ", " ROLLUP_VALUE_COLUMNS("pressure") ", "         \
+    ROLLUP_VALUE_COLUMNS("rain") ");"
+
+// aggregates of a value over readings (NULL counts as 0 like everywhere else) and over
+// rollup rows
+#define ROLLUP_FROM_DATA(value)                                                          \
+    "total(" value "), min(IFNULL(" value ", 0)), max(IFNULL(" value ", 0))"
+#define ROLLUP_FROM_ROLLUP(value)                                                        \
+    "sum(" value "_sum), min(" value "_min), max(" value "_max)"
+#define ROLLUP_ALL_VALUES(macro)                                                         \
+    macro("temperature") ", " macro("humidity") ", " macro("windspeed") ", "             \
+    macro("pressure") ", " macro("rain")
+
+// fills the empty rollup tables from the data table, the hours are computed from the
+// minutes and the days from the hours
+#define ROLLUP_FILL                                                                      \
+    "INSERT INTO rollup_minute SELECT timestamp - timestamp % 60, count(*), "            \
+    ROLLUP_ALL_VALUES(ROLLUP_FROM_DATA) " FROM data GROUP BY 1;"                         \
+    "INSERT INTO rollup_hour SELECT start - start % 3600, sum(count), "                  \
+    ROLLUP_ALL_VALUES(ROLLUP_FROM_ROLLUP) " FROM rollup_minute GROUP BY 1;"              \
+    "INSERT INTO rollup_day SELECT start - start % 86400, sum(count), "                  \
+    ROLLUP_ALL_VALUES(ROLLUP_FROM_ROLLUP) " FROM rollup_hour GROUP BY 1;"
+
+// recomputes the rollup tables, e.g. after rows were added to the data table by other
+// means than the server
+#define ROLLUP_REBUILD                                                                   \
+    "DELETE FROM rollup_minute; DELETE FROM rollup_hour; DELETE FROM rollup_day;"        \
+    ROLLUP_FILL
+
+// adds readings to the pending aggregates of the current transaction, runs on the writer
+// thread once they are inserted
+// returns an sqlite result code, on failure none of the readings were added
+int rollup_add(const data_point_t* points, size_t count);
+// writes the pending aggregates to the rollup tables, db_config_t.before_commit callback
+int rollup_flush(sqlite3* conn, void* ctx);
+
+// the coarsest rollup that can answer buckets of bucket_size seconds between from and to
+// (inclusive), i.e. whose periods fit evenly into the buckets and which has at least one
+// whole period in the range, the whole periods are [*periods_from, *periods_to)
+// returns NULL if there is none
+const rollup_t* rollup_find(int64_t bucket_size, int64_t from, int64_t to,
+                            int64_t* periods_from, int64_t* periods_to);
+
+// reads the start and aggregate of the current row of a select_sql statement
+int64_t rollup_read(sqlite3_stmt* stmt, aggregate_t* aggregate);
+
+#endif // __ROLLUP_H
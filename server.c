@@ -1,25 +1,53 @@
+#define _GNU_SOURCE // memmem()
+
+#include "aggregate.h"
+#include "cache.h"
+#include "data_point.h"
+#include "db.h"
+#include "recent.h"
+#include "rollup.h"
+#include "stats.h"
+
 #include <ctype.h>
 #include <http.h>
 #include <json-c/json.h>
+#include <json_writer.h>
+#include <math.h>
 #include <sqlite3.h>
+#include <stddef.h>
+#include <strings.h>
 #include <time.h>
+#include <unistd.h>
 
 // error and exit
 #define ERROR(s, ...)                                                                    \
     fprintf(stderr, "\033[31mERROR\033[0m " s "\n", ##__VA_ARGS__), exit(EXIT_FAILURE);
 
-// macro to check for errors when calling sqlite functions
-// if there is an error, print the error message and return internal server error
-#define SQLITE_TRY(x)                                                                    \
-    if (x != SQLITE_OK) {                                                                \
-        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(db));                         \
-        return HTTP_RESPONSE("Internal Server Error",                                    \
-                             HTTP_STATUS_INTERNAL_SERVER_ERROR);                         \
-    }
+// global db handle (reader pool and writer thread)
+// initialized in main()
+db_t* db;
 
-// global db handle
+// in-memory copy of the recent readings, NULL if disabled (-H 0)
 // initialized in main()
-sqlite3* db;
+recent_t* recent;
+
+// cache of GET /data responses, NULL if disabled (-C 0)
+// initialized in main()
+cache_t* cache;
+
+// max number of readings in a GET /data response (-L), larger ranges are split into
+// pages
+// set in main()
+#define DATA_PAGE_SIZE 100000
+int64_t data_page_size = DATA_PAGE_SIZE;
+
+// db_config_t.after_commit callback, the readings of a committed transaction go into the
+// recent readings
+void publish_data_points(int rc, void* ctx) {
+    if (recent != NULL) {
+        recent_publish(recent, rc);
+    }
+}
 
 // helper function to check if a string is a valid integer
 // used before calling atoi()
@@ -32,138 +60,1701 @@ int str_is_number(char* str) {
     return 1;
 }
 
-// handle POST requests to /data
-// inserts a new row into the database and
-http_response_t* handle_data_post(http_request_t* request) {
-    // parse the request body as json
-    struct json_object* body = json_tokener_parse(request->body);
-    if (body == NULL) {
+// schema migrations, migrations[i] upgrades the database from version i to i + 1
+// (PRAGMA user_version), never change a migration once it has been released
+const char* migrations[] = {
+    // 1: the original table, databases created before versioning are at this layout
+    //    with user_version 0, so fresh and old databases migrate through the same steps
+    "CREATE TABLE IF NOT EXISTS data ("
+    "temperature REAL, "
+    "humidity REAL, "
+    "windspeed REAL, "
+    "pressure REAL, "
+    "rain REAL, "
+    "timestamp INTEGER"
+    ")",
+
+    // 2: cluster the rows by time
+    //    the rowid (id) is timestamp << 20 plus a sequence number for readings within
+    //    the same second, so the table itself is ordered by time and a time range is a
+    //    rowid range
+    "CREATE TABLE data_v2 ("
+    "id INTEGER PRIMARY KEY, "
+    "temperature REAL, "
+    "humidity REAL, "
+    "windspeed REAL, "
+    "pressure REAL, "
+    "rain REAL, "
+    "timestamp INTEGER NOT NULL"
+    ");"
+    "INSERT INTO data_v2 (id, temperature, humidity, windspeed, pressure, rain, timestamp) "
+    "SELECT (timestamp << 20) + row_number() OVER (PARTITION BY timestamp ORDER BY rowid) "
+    "- 1, temperature, humidity, windspeed, pressure, rain, timestamp FROM data "
+    "WHERE timestamp IS NOT NULL;"
+    "DROP TABLE data;"
+    "ALTER TABLE data_v2 RENAME TO data;",
+
+    // 3: minute, hour and day aggregates of the readings, maintained by
+    //    insert_data_points(), see rollup.h
+    ROLLUP_CREATE_TABLE("rollup_minute") ROLLUP_CREATE_TABLE("rollup_hour")
+        ROLLUP_CREATE_TABLE("rollup_day") ROLLUP_FILL,
+};
+
+// a batch of rows for insert_data_points()
+typedef struct data_points {
+    data_point_t* points;
+    size_t count;
+} data_points_t;
+
+// db_write() callback, runs on the writer thread
+// all rows go through the same statement, if one of them fails the writer rolls back
+// the whole batch
+// the rollup tables are updated in the same transaction, see rollup.h, and the recent
+// readings once it is committed, see recent.h
+int insert_data_points(sqlite3* conn, void* ctx) {
+    data_points_t* batch = ctx;
+
+    // the id is the next free one within the reading's second (?6)
+    char* sql = "INSERT INTO data (id, temperature, humidity, windspeed, pressure, rain, "
+                "timestamp) VALUES "
+                "((SELECT IFNULL(MAX(id) + 1, ?6 << 20) FROM data "
+                "WHERE id >= ?6 << 20 AND id < (?6 + 1) << 20), "
+                "?1, ?2, ?3, ?4, ?5, ?6)";
+
+    db_stmt_t* insert = db_prepare(conn, sql);
+    if (insert == NULL) {
+        return SQLITE_ERROR;
+    }
+
+    // sqlite_step returns SQLITE_DONE on success instead of SQLITE_OK
+    sqlite3_stmt* stmt = insert->stmt;
+    int rc = SQLITE_OK;
+    for (size_t i = 0; i < batch->count && rc == SQLITE_OK; i++) {
+        data_point_t* point = &batch->points[i];
+        if (sqlite3_bind_double(stmt, 1, point->temperature) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 2, point->humidity) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 3, point->windspeed) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 4, point->pressure) != SQLITE_OK ||
+            sqlite3_bind_double(stmt, 5, point->rain) != SQLITE_OK ||
+            sqlite3_bind_int64(stmt, 6, point->timestamp) != SQLITE_OK ||
+            sqlite3_step(stmt) != SQLITE_DONE) {
+            printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(conn));
+            rc = SQLITE_ERROR;
+        }
+        sqlite3_reset(stmt);
+    }
+
+    // the statement goes back to the cache
+    db_release(insert);
+
+    // written to the rollup tables before the transaction is committed
+    if (rc == SQLITE_OK) {
+        rc = rollup_add(batch->points, batch->count);
+    }
+    if (rc == SQLITE_OK && recent != NULL) {
+        recent_stage(recent, batch->points, batch->count);
+    }
+    return rc;
+}
+
+static int compare_timestamps(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// drops the cached responses the inserted readings belong to
+void invalidate_data_points(data_points_t* rows) {
+    int64_t* timestamps = malloc(sizeof(int64_t) * rows->count);
+    if (timestamps == NULL) {
+        // can't be precise, drop every response that might contain one of them
+        cache_clear(cache);
+        return;
+    }
+    for (size_t i = 0; i < rows->count; i++) {
+        timestamps[i] = rows->points[i].timestamp;
+    }
+    qsort(timestamps, rows->count, sizeof(int64_t), compare_timestamps);
+    cache_invalidate(cache, timestamps, rows->count);
+    free(timestamps);
+}
+
+// collects the valid readings of a bulk request and the errors of the invalid ones
+typedef struct data_batch {
+    data_points_t rows;
+    struct json_object* errors;
+} data_batch_t;
+
+// adds key: value to a json object and takes ownership of value
+// returns -1 if value is NULL (json-c couldn't allocate it) or couldn't be added
+static int json_add(struct json_object* object, const char* key,
+                    struct json_object* value) {
+    if (value == NULL || json_object_object_add(object, key, value) != 0) {
+        json_object_put(value);
+        return -1;
+    }
+    return 0;
+}
+
+// adds the result of parsing the reading at index, on success the reading was parsed
+// into the next free row
+// returns -1 if the error couldn't be allocated
+int data_batch_add(data_batch_t* batch, size_t index, data_point_status_t status,
+                   data_point_parser_t* parser) {
+    if (status == DATA_POINT_OK) {
+        batch->rows.count++;
+        return 0;
+    }
+
+    char error[64];
+    snprintf(error, sizeof(error), "%s%s",
+             status == DATA_POINT_SYNTAX_ERROR ? "invalid JSON: " : "", parser->error);
+
+    // the item belongs to the array once it is added
+    struct json_object* item = json_object_new_object();
+    if (item == NULL || json_object_array_add(batch->errors, item) != 0) {
+        json_object_put(item);
+        return -1;
+    }
+    if (json_add(item, "index", json_object_new_int64(index)) != 0 ||
+        json_add(item, "offset", json_object_new_int64(parser->error_offset)) != 0 ||
+        json_add(item, "error", json_object_new_string(error)) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// 400 response for a body that isn't valid json, says what is wrong and where, e.g.
+// Invalid JSON body: expected ':' at offset 17
+http_response_t* invalid_json_response(data_point_parser_t* parser) {
+    char* message = malloc(128);
+    if (message == NULL) {
         return HTTP_RESPONSE("Invalid JSON body", HTTP_STATUS_BAD_REQUEST);
     }
+    int size = snprintf(message, 128, "Invalid JSON body: %s at offset %zu",
+                        parser->error, parser->error_offset);
+    return HTTP_RESPONSE(message, HTTP_STATUS_BAD_REQUEST, NULL, size, free);
+}
+
+// handle bulk POST requests to /data, body is a json array of readings or
+// newline-delimited json (one reading per line)
+// valid readings are inserted in one transaction, the response reports how many were
+// accepted and why the others were not:
+// { "accepted": 2, "errors": [ { "index": 1, "offset": 57, "error": "missing rain" } ] }
+// the index counts the array elements or the non-empty lines, the offset is the position
+// of the error in the body
+// an array containing invalid json is rejected as a whole, in newline-delimited json an
+// invalid line is reported like an invalid reading
+http_response_t* handle_data_post_bulk(char* body, size_t body_size, int ndjson) {
+    // every reading is an object/a line, so this is an upper bound for the row count
+    size_t capacity = 1;
+    for (size_t i = 0; i < body_size; i++) {
+        capacity += body[i] == (ndjson ? '\n' : '{');
+    }
 
-    // extract data from json body
-    struct json_object* temperature = json_object_object_get(body, "temperature");
-    struct json_object* humidity = json_object_object_get(body, "humidity");
-    struct json_object* windspeed = json_object_object_get(body, "windspeed");
-    struct json_object* pressure = json_object_object_get(body, "pressure");
-    struct json_object* rain = json_object_object_get(body, "rain");
+    data_batch_t batch = {
+        .rows = {.points = malloc(sizeof(data_point_t) * capacity), .count = 0},
+        .errors = json_object_new_array(),
+    };
 
-    // check if all data is present
-    if (temperature == NULL || humidity == NULL || windspeed == NULL ||
-        pressure == NULL || rain == NULL) {
-        return HTTP_RESPONSE("Missing data", HTTP_STATUS_BAD_REQUEST);
+    if (batch.rows.points == NULL || batch.errors == NULL) {
+        free(batch.rows.points);
+        json_object_put(batch.errors);
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    // get current unix timestamp
-    time_t ts = time(NULL);
+    data_point_parser_t parser;
+    data_point_parser_init(&parser, body, body_size, time(NULL));
 
-    // insert data into database
+    data_point_status_t parse_status;
+    size_t index = 0;
+    int failed = 0;
+    while (!failed) {
+        data_point_t* point = &batch.rows.points[batch.rows.count];
+        parse_status = ndjson ? data_point_parse_line(&parser, point)
+                              : data_point_parse_array_item(&parser, point);
+        if (parse_status == DATA_POINT_END ||
+            (!ndjson && parse_status == DATA_POINT_SYNTAX_ERROR)) {
+            break;
+        }
+        failed = data_batch_add(&batch, index++, parse_status, &parser) != 0;
+    }
 
-    char* sql = "INSERT INTO data (temperature, humidity, windspeed, pressure, rain, "
-                "timestamp) VALUES "
-                "(?, ?, ?, ?, ?, ?)";
-
-    sqlite3_stmt* stmt;
-    SQLITE_TRY(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
-    SQLITE_TRY(sqlite3_bind_double(stmt, 1, json_object_get_double(temperature)));
-    SQLITE_TRY(sqlite3_bind_double(stmt, 2, json_object_get_double(humidity)));
-    SQLITE_TRY(sqlite3_bind_double(stmt, 3, json_object_get_double(windspeed)));
-    SQLITE_TRY(sqlite3_bind_double(stmt, 4, json_object_get_double(pressure)));
-    SQLITE_TRY(sqlite3_bind_double(stmt, 5, json_object_get_double(rain)));
-    SQLITE_TRY(sqlite3_bind_int(stmt, 6, ts));
-    // sqlite_step returns SQLITE_DONE on success instead of SQLITE_OK
-    // so we need to check manually (not using SQLITE_TRY)
-    if (sqlite3_step(stmt) != SQLITE_DONE) {
+    if (failed) {
+        free(batch.rows.points);
+        json_object_put(batch.errors);
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if (parse_status == DATA_POINT_SYNTAX_ERROR) {
+        free(batch.rows.points);
+        json_object_put(batch.errors);
+        return invalid_json_response(&parser);
+    }
+
+    // insert data into database, blocks until the batch is committed
+    int rc = SQLITE_OK;
+    if (batch.rows.count > 0) {
+        rc = db_write(db, insert_data_points, &batch.rows);
+    }
+
+    size_t accepted = batch.rows.count;
+    size_t rejected = json_object_array_length(batch.errors);
+    if (rc == SQLITE_OK && accepted > 0 && cache != NULL) {
+        invalidate_data_points(&batch.rows);
+    }
+    free(batch.rows.points);
+
+    if (rc != SQLITE_OK) {
+        json_object_put(batch.errors);
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    struct json_object* result = json_object_new_object();
+    if (result == NULL ||
+        json_add(result, "accepted", json_object_new_int64(accepted)) != 0) {
+        json_object_put(result);
+        json_object_put(batch.errors);
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    // json_add() takes ownership of the errors even if it fails
+    if (json_add(result, "errors", batch.errors) != 0) {
+        json_object_put(result);
         return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
     }
 
-    // free resources
-    SQLITE_TRY(sqlite3_finalize(stmt));
-    json_object_put(body);
+    size_t json_size;
+    const char* json_string =
+        json_object_to_json_string_length(result, JSON_C_TO_STRING_SPACED, &json_size);
+    char* json = json_string != NULL ? strdup(json_string) : NULL;
+    json_object_put(result);
+    if (json == NULL) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    // nothing accepted because every reading was invalid
+    http_status_t status =
+        accepted == 0 && rejected > 0 ? HTTP_STATUS_BAD_REQUEST : HTTP_STATUS_OK;
+    return HTTP_RESPONSE(json, status, HTTP_HEADERS(("Content-Type", "application/json")),
+                         json_size, free);
+}
+
+// handle POST requests to /data
+// a single reading object is inserted as one row, arrays and newline-delimited json
+// (Content-Type: application/x-ndjson) are bulk requests, see handle_data_post_bulk()
+http_response_t* handle_data_post(http_request_t* request) {
+    http_header_t* content_type = http_headers_get(request->headers, "Content-Type");
+    char* type = content_type != NULL ? content_type->value : "";
+    if (strncasecmp(type, "application/x-ndjson", 20) == 0 ||
+        strncasecmp(type, "application/ndjson", 18) == 0) {
+        return handle_data_post_bulk(request->body, request->body_size, 1);
+    }
+
+    // readings without timestamp get the current one
+    data_point_parser_t parser;
+    data_point_parser_init(&parser, request->body, request->body_size, time(NULL));
+    if (data_point_parser_peek(&parser) == '[') {
+        return handle_data_post_bulk(request->body, request->body_size, 0);
+    }
+
+    // parse the request body straight into the row
+    data_point_t point;
+    data_point_status_t status = data_point_parse(&parser, &point);
+    if (status == DATA_POINT_SYNTAX_ERROR) {
+        return invalid_json_response(&parser);
+    }
+    if (status != DATA_POINT_OK) {
+        return HTTP_RESPONSE((char*)parser.error, HTTP_STATUS_BAD_REQUEST);
+    }
+
+    // insert data into database, blocks until the batch with the insert is committed
+    data_points_t rows = {.points = &point, .count = 1};
+    if (db_write(db, insert_data_points, &rows) != SQLITE_OK) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if (cache != NULL) {
+        int64_t timestamp = point.timestamp;
+        cache_invalidate(cache, &timestamp, 1);
+    }
 
     // return success
     return HTTP_RESPONSE("OK", HTTP_STATUS_OK);
 }
 
-// handle GET requests to /data
-// returns a json array of all data points
-http_response_t* handle_data_get(http_request_t* request) {
-
+// reads the from and to query parameters (unix seconds)
+// returns 0 if one of them is missing or not a number
+int get_time_range(http_request_t* request, time_t* from, time_t* to) {
     http_query_param_t* from_param = http_query_params_get(request->query_params, "from");
     http_query_param_t* to_param = http_query_params_get(request->query_params, "to");
 
     // check if from and to parameters are valid
     if (from_param == NULL || to_param == NULL) {
-        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+        return 0;
     }
 
     // check if from and to parameters are valid integers
     if (!str_is_number(from_param->value) || !str_is_number(to_param->value)) {
-        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+        return 0;
     }
 
     // get from and to parameters as integers/time_t
-    time_t from_ts = atoi(from_param->value);
-    time_t to_ts = atoi(to_param->value);
+    *from = atoi(from_param->value);
+    *to = atoi(to_param->value);
+    return 1;
+}
+
+// the readings from ?1 to ?2 (inclusive) ordered by time, a rowid range, see migration 2
+const char* data_select_sql =
+    "SELECT temperature, humidity, windspeed, pressure, rain, timestamp "
+    "FROM data WHERE id >= ?1 << 20 AND id < (?2 + 1) << 20 ORDER BY id";
+
+// the readings with an id from ?1 to ?2 (exclusive), a page of GET /data, the id lets
+// a stream continue after the last row it has read
+const char* data_page_sql =
+    "SELECT temperature, humidity, windspeed, pressure, rain, timestamp, id "
+    "FROM data WHERE id >= ?1 AND id < ?2 ORDER BY id";
+
+// the number of readings with an id from ?1 to ?2 (exclusive)
+const char* data_count_sql = "SELECT count(*) FROM data WHERE id >= ?1 AND id < ?2";
+
+// the id of the reading ?3 readings after the first one with an id from ?1 to ?2
+// (exclusive), a seek on the rowid followed by a scan of at most a page
+const char* data_seek_sql =
+    "SELECT id FROM data WHERE id >= ?1 AND id < ?2 ORDER BY id LIMIT 1 OFFSET ?3";
+
+// release callback for streamed responses backed by a prepared statement
+// the reader connection goes back to the pool together with the statement
+void release_stmt(void* ctx) {
+    db_stmt_t* stmt = ctx;
+    sqlite3* reader = stmt->db;
+    db_release(stmt);
+    db_reader_release(db, reader);
+}
+
+// upper bound for the size of a row serialized by write_data_row() or
+// write_data_csv_row()
+#define DATA_ROW_MAX_SIZE (128 + 5 * JSON_DOUBLE_MAX_SIZE + JSON_INT_MAX_SIZE)
+
+// serializes a row of a GET /data response (measured values in the order of
+// data_point_fields) in the format of json-c's JSON_C_TO_STRING_SPACED (same field names
+// and order), preceded by the array separator
+// returns the number of bytes written, at most DATA_ROW_MAX_SIZE
+size_t write_data_row(char* out, const double values[DATA_POINT_VALUE_COUNT],
+                      int64_t timestamp, int first) {
+    char* p = out;
+    p += first ? JSON_WRITE_LITERAL(p, " { \"temperature\": ")
+               : JSON_WRITE_LITERAL(p, ", { \"temperature\": ");
+    p += json_write_double(p, values[0]);
+    p += JSON_WRITE_LITERAL(p, ", \"humidity\": ");
+    p += json_write_double(p, values[1]);
+    p += JSON_WRITE_LITERAL(p, ", \"windspeed\": ");
+    p += json_write_double(p, values[2]);
+    p += JSON_WRITE_LITERAL(p, ", \"pressure\": ");
+    p += json_write_double(p, values[3]);
+    p += JSON_WRITE_LITERAL(p, ", \"rain\": ");
+    p += json_write_double(p, values[4]);
+    p += JSON_WRITE_LITERAL(p, ", \"timestamp\": ");
+    p += json_write_int(p, timestamp);
+    p += JSON_WRITE_LITERAL(p, " }");
+    return p - out;
+}
+
+// serializes a row as a csv line: the timestamp followed by the measured values, same
+// number format as the json rows
+// returns the number of bytes written, at most DATA_ROW_MAX_SIZE
+size_t write_data_csv_row(char* out, const double values[DATA_POINT_VALUE_COUNT],
+                          int64_t timestamp, int first) {
+    char* p = out;
+    p += json_write_int(p, timestamp);
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        *p++ = ',';
+        p += json_write_double(p, values[i]);
+    }
+    *p++ = '\n';
+    return p - out;
+}
+
+// serializes a row of a text format, see data_format_t
+typedef size_t (*data_row_writer_t)(char* out,
+                                    const double values[DATA_POINT_VALUE_COUNT],
+                                    int64_t timestamp, int first);
+
+// output formats of the readings of GET /data, see data_format_negotiate()
+typedef enum data_format_id {
+    DATA_FORMAT_JSON = 0,
+    DATA_FORMAT_CSV = 1,
+    // columnar binary, see stream_data_columns()
+    DATA_FORMAT_BINARY = 2,
+} data_format_id_t;
+#define DATA_FORMAT_COUNT 3
+
+typedef struct data_format {
+    data_format_id_t id;
+    // value of the format parameter
+    char* name;
+    char* content_type;
+    // text formats: written before and after the rows, NULL for the binary format
+    char* header;
+    char* footer;
+    data_row_writer_t write_row;
+} data_format_t;
+
+static const data_format_t data_formats[DATA_FORMAT_COUNT] = {
+    {DATA_FORMAT_JSON, "json", "application/json", "[", " ]", write_data_row},
+    {DATA_FORMAT_CSV, "csv", "text/csv",
+     "timestamp,temperature,humidity,windspeed,pressure,rain\n", "", write_data_csv_row},
+    {DATA_FORMAT_BINARY, "binary", "application/octet-stream", NULL, NULL, NULL},
+};
+
+// picks the format of a GET /data response: format=json|csv|binary, otherwise the
+// supported media type of the Accept header with the highest weight (json for */* or
+// without a match)
+// aggregated buckets only come as json
+// returns NULL if the format parameter is invalid
+const data_format_t* data_format_negotiate(http_request_t* request, int buckets) {
+    http_query_param_t* format_param =
+        http_query_params_get(request->query_params, "format");
+    if (format_param != NULL) {
+        for (int i = 0; i < DATA_FORMAT_COUNT; i++) {
+            if (strcmp(format_param->value, data_formats[i].name) == 0) {
+                return buckets && i != DATA_FORMAT_JSON ? NULL : &data_formats[i];
+            }
+        }
+        return NULL;
+    }
+
+    http_header_t* accept = http_headers_get(request->headers, "Accept");
+    if (accept == NULL || buckets) {
+        return &data_formats[DATA_FORMAT_JSON];
+    }
+
+    const data_format_t* format = &data_formats[DATA_FORMAT_JSON];
+    double best_weight = 0;
+    const char* p = accept->value;
+    while (*p != '\0') {
+        p += strspn(p, " \t,");
+        size_t element_size = strcspn(p, ",");
+        size_t type_size = strcspn(p, " \t;,");
+
+        // the only parameter that matters is the weight
+        const char* q = memmem(p + type_size, element_size - type_size, "q=", 2);
+        double weight = q != NULL ? strtod(q + 2, NULL) : 1;
+        for (int i = 0; i < DATA_FORMAT_COUNT; i++) {
+            const char* type = data_formats[i].content_type;
+            if (weight > best_weight && strlen(type) == type_size &&
+                strncasecmp(p, type, type_size) == 0) {
+                format = &data_formats[i];
+                best_weight = weight;
+            }
+        }
+
+        p += element_size;
+    }
+    return format;
+}
+
+// indexes of the recent readings of a GET /data response, see recent_find()
+typedef struct data_range {
+    uint64_t index;
+    uint64_t end;
+} data_range_t;
+
+// readings of a page gathered into columns, for the binary format
+typedef struct data_columns {
+    size_t count;
+    size_t capacity;
+    int64_t* timestamps;
+    double* values[DATA_POINT_VALUE_COUNT];
+} data_columns_t;
+
+// a GET /data response with the readings as they are
+typedef struct data_rows {
+    // reader and readings of the page, NULL if it is answered from the recent readings
+    // or in the binary format, and while the text formats wait for the client
+    sqlite3* reader;
+    db_stmt_t* select;
+    // ids of the readings of the page still to be read from the database, next to end
+    // (exclusive)
+    int64_t next;
+    int64_t end;
+    data_range_t recent;
+    // the page read from the database in the binary format
+    data_columns_t columns;
+    const data_format_t* format;
+    // progress of the stream callback: whether the header went out and the number of
+    // rows (binary format: values) written so far
+    int started;
+    uint64_t written;
+} data_rows_t;
+
+// NULL if calloc() failed
+data_rows_t* data_rows_new(const data_format_t* format) {
+    data_rows_t* rows = calloc(1, sizeof(data_rows_t));
+    if (rows == NULL) {
+        return NULL;
+    }
+    rows->format = format;
+    return rows;
+}
+
+void release_data_rows(void* ctx) {
+    data_rows_t* rows = ctx;
+    if (rows->select != NULL) {
+        db_release(rows->select);
+    }
+    if (rows->reader != NULL) {
+        db_reader_release(db, rows->reader);
+    }
+    free(rows->columns.timestamps);
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        free(rows->columns.values[i]);
+    }
+    free(rows);
+}
+
+// appends a reading to the columns, growing them as needed
+// returns -1 if out of memory
+static int data_columns_add(data_columns_t* columns, int64_t timestamp,
+                            const double values[DATA_POINT_VALUE_COUNT]) {
+    if (columns->count == columns->capacity) {
+        size_t capacity = columns->capacity > 0 ? columns->capacity * 2 : 1024;
+        int64_t* timestamps = realloc(columns->timestamps, capacity * sizeof(int64_t));
+        if (timestamps == NULL) {
+            return -1;
+        }
+        columns->timestamps = timestamps;
+        for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            double* column = realloc(columns->values[i], capacity * sizeof(double));
+            if (column == NULL) {
+                return -1;
+            }
+            columns->values[i] = column;
+        }
+        columns->capacity = capacity;
+    }
+
+    columns->timestamps[columns->count] = timestamp;
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        columns->values[i][columns->count] = values[i];
+    }
+    columns->count++;
+    return 0;
+}
+
+// reads the readings of a data_page_sql statement into the columns, in a single pass
+// returns -1 on error
+static int data_columns_read(data_columns_t* columns, sqlite3_stmt* stmt) {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        double values[DATA_POINT_VALUE_COUNT];
+        for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            values[i] = sqlite3_column_double(stmt, i);
+        }
+        if (data_columns_add(columns, sqlite3_column_int64(stmt, 5), values) != 0) {
+            printf("\033[31mERROR\033[0m Out of memory reading %zu readings\n",
+                   columns->count);
+            return -1;
+        }
+    }
+
+    if (rc != SQLITE_DONE) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+        return -1;
+    }
+    return 0;
+}
+
+// gives the reader back while the client receives what has been written
+static void data_rows_detach(data_rows_t* rows) {
+    db_release(rows->select);
+    db_reader_release(db, rows->reader);
+    rows->select = NULL;
+    rows->reader = NULL;
+}
+
+// queries the rest of the page, rows->next onwards
+// returns -1 on error
+static int data_rows_attach(data_rows_t* rows) {
+    if ((rows->reader = db_reader_acquire(db)) == NULL) {
+        printf("\033[31mERROR\033[0m No idle database reader\n");
+        return -1;
+    }
+    if ((rows->select = db_prepare(rows->reader, data_page_sql)) == NULL) {
+        return -1;
+    }
+    if (sqlite3_bind_int64(rows->select->stmt, 1, rows->next) != SQLITE_OK ||
+        sqlite3_bind_int64(rows->select->stmt, 2, rows->end) != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(rows->reader));
+        return -1;
+    }
+    return 0;
+}
+
+// stream callback for GET /data in the text formats
+// writes the rows one by one while stepping through the query results, so memory use
+// doesn't depend on the size of the requested range
+// the rows are serialized straight into the chunk buffer of the stream, nothing is
+// allocated or copied per row
+// returns HTTP_STREAM_MORE once a chunk is waiting to be sent, the reader is given back
+// then and the next call continues after the last row read
+int stream_data(http_stream_t* stream, void* ctx) {
+    data_rows_t* rows = ctx;
+    const data_format_t* format = rows->format;
+    if (rows->select == NULL && data_rows_attach(rows) != 0) {
+        return HTTP_STREAM_ERROR;
+    }
+    sqlite3_stmt* stmt = rows->select->stmt;
+
+    if (!rows->started) {
+        if (http_stream_write_string(stream, format->header) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        rows->started = 1;
+    }
+
+    while (!http_stream_full(stream)) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) {
+            return http_stream_write_string(stream, format->footer) == 0
+                       ? HTTP_STREAM_DONE
+                       : HTTP_STREAM_ERROR;
+        } else if (rc != SQLITE_ROW) {
+            printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+            return HTTP_STREAM_ERROR;
+        }
+
+        char* out = http_stream_reserve(stream, DATA_ROW_MAX_SIZE);
+        if (out == NULL) {
+            return HTTP_STREAM_ERROR;
+        }
+        double values[DATA_POINT_VALUE_COUNT];
+        for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            values[i] = sqlite3_column_double(stmt, i);
+        }
+        size_t size = format->write_row(out, values, sqlite3_column_int64(stmt, 5),
+                                        rows->written++ == 0);
+        http_stream_commit(stream, size);
+        rows->next = sqlite3_column_int64(stmt, 6) + 1;
+    }
+
+    data_rows_detach(rows);
+    return HTTP_STREAM_MORE;
+}
+
+// stream callback for GET /data ranges within the recent readings, same output as
+// stream_data() without a database query
+// if the writer overtakes a (very) slow client the response is cut off
+int stream_recent_data(http_stream_t* stream, void* ctx) {
+    data_rows_t* rows = ctx;
+    data_range_t* range = &rows->recent;
+    const data_format_t* format = rows->format;
+
+    if (!rows->started) {
+        if (http_stream_write_string(stream, format->header) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        rows->started = 1;
+    }
+
+    recent_block_t block;
+    while (range->index < range->end) {
+        if (http_stream_full(stream)) {
+            return HTTP_STREAM_MORE;
+        }
+        if (recent_read(recent, &range->index, range->end, &block) != 0) {
+            printf("\033[31mERROR\033[0m Recent readings overwritten while streaming\n");
+            return HTTP_STREAM_ERROR;
+        }
+        for (size_t i = 0; i < block.count; i++) {
+            char* out = http_stream_reserve(stream, DATA_ROW_MAX_SIZE);
+            if (out == NULL) {
+                return HTTP_STREAM_ERROR;
+            }
+            double values[DATA_POINT_VALUE_COUNT];
+            for (int j = 0; j < DATA_POINT_VALUE_COUNT; j++) {
+                values[j] = block.values[j][i];
+            }
+            size_t size = format->write_row(out, values, block.timestamps[i],
+                                            rows->written++ == 0);
+            http_stream_commit(stream, size);
+        }
+    }
+
+    return http_stream_write_string(stream, format->footer) == 0 ? HTTP_STREAM_DONE
+                                                                 : HTTP_STREAM_ERROR;
+}
+
+// the binary format is little-endian, like the hosts it runs on, so the columns are
+// written as they are in memory
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__ || \
+    __FLOAT_WORD_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the binary format of GET /data expects a little-endian host"
+#endif
+
+// head of the binary format, followed by the int64 timestamps and the float64 values
+// of each measured value (in the order of data_point_fields), count of each
+typedef struct data_columns_head {
+    // "WSC1"
+    char magic[4];
+    uint32_t field_count;
+    uint64_t count;
+} data_columns_head_t;
+
+// the head and the columns are written as they are in memory, so their layout is pinned
+_Static_assert(sizeof(data_columns_head_t) == 16, "binary head must be 16 bytes");
+_Static_assert(offsetof(data_columns_head_t, count) == 8, "binary head count at 8");
+_Static_assert(sizeof(int64_t) == 8 && sizeof(double) == 8, "binary values are 8 bytes");
+
+// stream callback for GET /data in the binary format
+// columnar: the head with the number of readings, then all timestamps, then all values
+// of each measured value, so a column can be loaded with a single memcpy()
+// the page has been read into rows->columns by the handler, from the database or the
+// recent readings, it is written a chunk's worth of values at a time
+int stream_data_columns(http_stream_t* stream, void* ctx) {
+    data_rows_t* rows = ctx;
+    data_columns_t* columns = &rows->columns;
+
+    if (!rows->started) {
+        data_columns_head_t head = {
+            .magic = {'W', 'S', 'C', '1'},
+            .field_count = DATA_POINT_VALUE_COUNT,
+            .count = columns->count,
+        };
+        if (http_stream_write(stream, (char*)&head, sizeof(head)) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        rows->started = 1;
+    }
+
+    // rows->written counts the values of all columns, the timestamps first
+    uint64_t total = columns->count * (DATA_POINT_VALUE_COUNT + 1);
+    while (rows->written < total) {
+        if (http_stream_full(stream)) {
+            return HTTP_STREAM_MORE;
+        }
+        int column = rows->written / columns->count - 1;
+        size_t index = rows->written % columns->count;
+        size_t count = columns->count - index;
+        if (count > HTTP_STREAM_CHUNK_SIZE / 8) {
+            count = HTTP_STREAM_CHUNK_SIZE / 8;
+        }
+
+        const char* data = column < 0 ? (const char*)&columns->timestamps[index]
+                                      : (const char*)&columns->values[column][index];
+        if (http_stream_write(stream, data, count * 8) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        rows->written += count;
+    }
+    return HTTP_STREAM_DONE;
+}
+
+// copies the recent readings of range into the columns, a block at a time so each block
+// is checked to be intact before it's used
+// returns -1 if the ring was lapped meanwhile (or out of memory)
+static int data_columns_read_recent(data_columns_t* columns, data_range_t range) {
+    recent_block_t block;
+    while (range.index < range.end) {
+        if (recent_read(recent, &range.index, range.end, &block) != 0) {
+            return -1;
+        }
+        for (size_t i = 0; i < block.count; i++) {
+            double values[DATA_POINT_VALUE_COUNT];
+            for (int j = 0; j < DATA_POINT_VALUE_COUNT; j++) {
+                values[j] = block.values[j][i];
+            }
+            if (data_columns_add(columns, block.timestamps[i], values) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// GET /data?points=N uses the smallest of these bucket sizes (seconds) that gives at most
+// N buckets, ranges too long for that use a multiple of a day
+static const int64_t data_bucket_sizes[] = {1,    5,    10,    15,    30,    60,
+                                            120,  300,  600,   900,   1800,  3600,
+                                            7200, 10800, 21600, 43200, 86400};
+
+#define DATA_BUCKET_DAY 86400
+
+// max number of buckets of GET /data?points=N
+#define DATA_MAX_POINTS 10000
+
+// buckets are aligned to multiples of their size since the epoch (so a day is a utc day),
+// bucket_start() is the start of the bucket containing timestamp
+static int64_t bucket_start(int64_t timestamp, int64_t size) {
+    return timestamp - timestamp % size;
+}
+
+static int64_t bucket_count(int64_t from, int64_t to, int64_t size) {
+    return to < from ? 0 : to / size - from / size + 1;
+}
+
+// smallest bucket size for at most points buckets between from and to
+int64_t data_bucket_size(int64_t from, int64_t to, int64_t points) {
+    size_t size_count = sizeof(data_bucket_sizes) / sizeof(data_bucket_sizes[0]);
+    for (size_t i = 0; i < size_count; i++) {
+        if (bucket_count(from, to, data_bucket_sizes[i]) <= points) {
+            return data_bucket_sizes[i];
+        }
+    }
+
+    int64_t days = (to - from) / (DATA_BUCKET_DAY * points) + 1;
+    while (bucket_count(from, to, days * DATA_BUCKET_DAY) > points) {
+        days++;
+    }
+    return days * DATA_BUCKET_DAY;
+}
+
+// a source of the buckets of a GET /data response: the readings (rollup is NULL) or
+// the periods of a rollup table, with an id (readings) or start (periods) from next to
+// end (exclusive)
+// next follows the rows as they are read, so the query can continue from there with
+// another reader
+typedef struct data_segment {
+    const rollup_t* rollup;
+    int64_t next;
+    int64_t end;
+} data_segment_t;
+
+// max number of segments of a response: the readings before and after the rollup
+// periods and the periods
+#define DATA_MAX_SEGMENTS 3
+
+// a GET /data response with one row per bucket, see stream_data_buckets()
+typedef struct data_buckets {
+    // the reader is only held while the stream callback runs (and from the handler until
+    // its first call), select is the query of the current segment
+    sqlite3* reader;
+    db_stmt_t* select;
+    data_segment_t segments[DATA_MAX_SEGMENTS];
+    size_t segment_count;
+    size_t segment;
+    // the recent readings of the range if there are no segments
+    data_range_t recent;
+    // bucket size in seconds
+    int64_t size;
+    // mask of aggregate_function_t
+    unsigned functions;
+    // the bucket being accumulated and the number of buckets written so far
+    aggregate_t aggregate;
+    int64_t start;
+    size_t count;
+    // whether the opening bracket went out
+    int started;
+} data_buckets_t;
+
+// buckets of size seconds, without a source of readings yet, NULL if malloc() failed
+data_buckets_t* data_buckets_new(int64_t size, unsigned functions) {
+    data_buckets_t* buckets = malloc(sizeof(data_buckets_t));
+    if (buckets == NULL) {
+        return NULL;
+    }
+    buckets->reader = NULL;
+    buckets->select = NULL;
+    buckets->segment_count = 0;
+    buckets->segment = 0;
+    buckets->recent.index = 0;
+    buckets->recent.end = 0;
+    buckets->size = size;
+    buckets->functions = functions;
+    aggregate_init(&buckets->aggregate);
+    buckets->start = 0;
+    buckets->count = 0;
+    buckets->started = 0;
+    return buckets;
+}
+
+// adds a segment unless it is empty
+static void data_buckets_add_segment(data_buckets_t* buckets, const rollup_t* rollup,
+                                     int64_t next, int64_t end) {
+    if (next < end) {
+        buckets->segments[buckets->segment_count++] =
+            (data_segment_t){.rollup = rollup, .next = next, .end = end};
+    }
+}
+
+// gives the reader back, the current segment is queried again from where it left off
+static void data_buckets_detach(data_buckets_t* buckets) {
+    if (buckets->select != NULL) {
+        db_release(buckets->select);
+        buckets->select = NULL;
+    }
+    if (buckets->reader != NULL) {
+        db_reader_release(db, buckets->reader);
+        buckets->reader = NULL;
+    }
+}
+
+// prepares the query of the current segment, acquiring a reader if needed
+// returns SQLITE_BUSY if no reader became idle in time, else an sqlite result code
+static int data_buckets_attach(data_buckets_t* buckets) {
+    data_segment_t* segment = &buckets->segments[buckets->segment];
+    if (buckets->reader == NULL && (buckets->reader = db_reader_acquire(db)) == NULL) {
+        printf("\033[31mERROR\033[0m No idle database reader\n");
+        return SQLITE_BUSY;
+    }
+
+    const char* sql =
+        segment->rollup != NULL ? segment->rollup->select_sql : data_page_sql;
+    if ((buckets->select = db_prepare(buckets->reader, sql)) == NULL) {
+        return SQLITE_ERROR;
+    }
+    int rc = sqlite3_bind_int64(buckets->select->stmt, 1, segment->next);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3_bind_int64(buckets->select->stmt, 2, segment->end);
+    }
+    if (rc != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(buckets->reader));
+    }
+    return rc;
+}
+
+void release_data_buckets(void* ctx) {
+    data_buckets_t* buckets = ctx;
+    data_buckets_detach(buckets);
+    free(buckets);
+}
+
+// upper bound for the size of a bucket serialized by write_data_bucket()
+#define DATA_BUCKET_MAX_SIZE                                                             \
+    (64 + 2 * JSON_INT_MAX_SIZE +                                                        \
+     DATA_POINT_VALUE_COUNT *                                                            \
+         (32 + AGGREGATE_FUNCTION_COUNT * (16 + JSON_DOUBLE_MAX_SIZE)))
+
+// serializes a bucket as
+// { "timestamp": 1600000000, "count": 60, "temperature": { "avg": 16.9 }, ... }
+// with the timestamp of the bucket start, the count if requested and an object of the
+// requested functions per measured value, preceded by the array separator
+// returns the number of bytes written, at most DATA_BUCKET_MAX_SIZE
+size_t write_data_bucket(char* out, int64_t start, aggregate_t* aggregate,
+                         unsigned functions, int first) {
+    char* p = out;
+    p += first ? JSON_WRITE_LITERAL(p, " { \"timestamp\": ")
+               : JSON_WRITE_LITERAL(p, ", { \"timestamp\": ");
+    p += json_write_int(p, start);
+    if (functions & AGGREGATE_COUNT) {
+        p += JSON_WRITE_LITERAL(p, ", \"count\": ");
+        p += json_write_int(p, aggregate->count);
+    }
+
+    if (functions & ~AGGREGATE_COUNT) {
+        for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            p += sprintf(p, ", \"%s\": {", data_point_fields[i]);
+            char* separator = " ";
+            for (int j = 0; j < AGGREGATE_FUNCTION_COUNT; j++) {
+                aggregate_function_t function = 1 << j;
+                if (function == AGGREGATE_COUNT || !(functions & function)) {
+                    continue;
+                }
+                p += sprintf(p, "%s\"%s\": ", separator, aggregate_function_names[j]);
+                p += json_write_double(p, aggregate_get(aggregate, function, i));
+                separator = ", ";
+            }
+            p += JSON_WRITE_LITERAL(p, " }");
+        }
+    }
+
+    p += JSON_WRITE_LITERAL(p, " }");
+    return p - out;
+}
+
+// writes the current bucket unless it is empty
+static int data_buckets_flush(data_buckets_t* buckets, http_stream_t* stream) {
+    if (buckets->aggregate.count == 0) {
+        return 0;
+    }
+
+    char* out = http_stream_reserve(stream, DATA_BUCKET_MAX_SIZE);
+    if (out == NULL) {
+        return -1;
+    }
+    size_t size = write_data_bucket(out, buckets->start, &buckets->aggregate,
+                                    buckets->functions, buckets->count++ == 0);
+    http_stream_commit(stream, size);
+    aggregate_init(&buckets->aggregate);
+    return 0;
+}
+
+// makes the bucket containing timestamp the current one, the rows come ordered by time,
+// so the previous bucket is complete once a row of the next one arrives
+static int data_buckets_advance(data_buckets_t* buckets, http_stream_t* stream,
+                                int64_t timestamp) {
+    int64_t start = bucket_start(timestamp, buckets->size);
+    if (start != buckets->start && data_buckets_flush(buckets, stream) != 0) {
+        return -1;
+    }
+    buckets->start = start;
+    return 0;
+}
+
+// the data_buckets_add_*() functions return HTTP_STREAM_DONE once their source is
+// exhausted and HTTP_STREAM_MORE if the stream filled up before, the next call continues
+// where they left off
+
+// adds the readings of a data_page_sql query
+static int data_buckets_add_readings(data_buckets_t* buckets, http_stream_t* stream,
+                                     sqlite3_stmt* stmt, data_segment_t* segment) {
+    while (!http_stream_full(stream)) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) {
+            return HTTP_STREAM_DONE;
+        } else if (rc != SQLITE_ROW) {
+            printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+            return HTTP_STREAM_ERROR;
+        }
+
+        if (data_buckets_advance(buckets, stream, sqlite3_column_int64(stmt, 5)) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        double values[DATA_POINT_VALUE_COUNT];
+        for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            values[i] = sqlite3_column_double(stmt, i);
+        }
+        aggregate_add(&buckets->aggregate, values);
+        segment->next = sqlite3_column_int64(stmt, 6) + 1;
+    }
+    return HTTP_STREAM_MORE;
+}
+
+// adds the periods of a rollup table query
+static int data_buckets_add_periods(data_buckets_t* buckets, http_stream_t* stream,
+                                    sqlite3_stmt* stmt, data_segment_t* segment) {
+    while (!http_stream_full(stream)) {
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_DONE) {
+            return HTTP_STREAM_DONE;
+        } else if (rc != SQLITE_ROW) {
+            printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+            return HTTP_STREAM_ERROR;
+        }
+
+        aggregate_t period;
+        int64_t start = rollup_read(stmt, &period);
+        if (data_buckets_advance(buckets, stream, start) != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        aggregate_merge(&buckets->aggregate, &period);
+        segment->next = start + 1;
+    }
+    return HTTP_STREAM_MORE;
+}
+
+// adds the recent readings of the range
+static int data_buckets_add_recent(data_buckets_t* buckets, http_stream_t* stream) {
+    data_range_t* range = &buckets->recent;
+    recent_block_t block;
+    while (range->index < range->end) {
+        if (http_stream_full(stream)) {
+            return HTTP_STREAM_MORE;
+        }
+        if (recent_read(recent, &range->index, range->end, &block) != 0) {
+            printf("\033[31mERROR\033[0m Recent readings overwritten while streaming\n");
+            return HTTP_STREAM_ERROR;
+        }
+        for (size_t i = 0; i < block.count; i++) {
+            if (data_buckets_advance(buckets, stream, block.timestamps[i]) != 0) {
+                return HTTP_STREAM_ERROR;
+            }
+
+            double values[DATA_POINT_VALUE_COUNT];
+            for (int j = 0; j < DATA_POINT_VALUE_COUNT; j++) {
+                values[j] = block.values[j][i];
+            }
+            aggregate_add(&buckets->aggregate, values);
+        }
+    }
+    return HTTP_STREAM_DONE;
+}
+
+// stream callback for GET /data with buckets
+// a single pass over the rows that only keeps the current bucket in memory, the
+// response size only depends on the number of buckets
+// whole rollup periods are read from the rollup table, only the readings before the
+// first and after the last period come from the data table
+// ranges within the recent readings don't touch the database at all
+// the reader is given back whenever the stream is full, so a slow client doesn't hold
+// one while its socket drains, the next call queries the segment again from where it
+// left off
+int stream_data_buckets(http_stream_t* stream, void* ctx) {
+    data_buckets_t* buckets = ctx;
+
+    if (!buckets->started) {
+        if (http_stream_write_string(stream, "[") != 0) {
+            return HTTP_STREAM_ERROR;
+        }
+        buckets->started = 1;
+    }
+
+    if (buckets->segment_count == 0) {
+        int result = data_buckets_add_recent(buckets, stream);
+        if (result != HTTP_STREAM_DONE) {
+            return result;
+        }
+    }
+
+    while (buckets->segment < buckets->segment_count) {
+        data_segment_t* segment = &buckets->segments[buckets->segment];
+        if (buckets->select == NULL && data_buckets_attach(buckets) != SQLITE_OK) {
+            return HTTP_STREAM_ERROR;
+        }
+
+        sqlite3_stmt* select = buckets->select->stmt;
+        int result = segment->rollup != NULL
+                         ? data_buckets_add_periods(buckets, stream, select, segment)
+                         : data_buckets_add_readings(buckets, stream, select, segment);
+        if (result == HTTP_STREAM_MORE) {
+            data_buckets_detach(buckets);
+        }
+        if (result != HTTP_STREAM_DONE) {
+            return result;
+        }
+
+        db_release(buckets->select);
+        buckets->select = NULL;
+        buckets->segment++;
+    }
+    data_buckets_detach(buckets);
+
+    if (data_buckets_flush(buckets, stream) != 0 ||
+        http_stream_write_string(stream, " ]") != 0) {
+        return HTTP_STREAM_ERROR;
+    }
+    return HTTP_STREAM_DONE;
+}
+
+// position of a page of GET /data: the first reading with timestamp (or later), after
+// skipping skip readings, so pages can split the readings of a second
+// the cursor parameter is the hex encoded "<timestamp>.<skip>", clients only pass it on
+typedef struct data_cursor {
+    int64_t timestamp;
+    int64_t skip;
+} data_cursor_t;
+
+// upper bound for the size of a cursor formatted by data_cursor_write()
+#define DATA_CURSOR_MAX_SIZE 36
+
+size_t data_cursor_write(char* out, data_cursor_t cursor) {
+    return sprintf(out, "%llx.%llx", (unsigned long long)cursor.timestamp,
+                   (unsigned long long)cursor.skip);
+}
+
+// returns 0 if str is a valid cursor
+int data_cursor_parse(const char* str, data_cursor_t* cursor) {
+    char* end;
+    if (!isxdigit(str[0])) {
+        return -1;
+    }
+    cursor->timestamp = strtoll(str, &end, 16);
+    if (*end != '.' || !isxdigit(end[1])) {
+        return -1;
+    }
+    cursor->skip = strtoll(end + 1, &end, 16);
+    return *end == '\0' && cursor->timestamp >= 0 && cursor->skip >= 0 ? 0 : -1;
+}
+
+// a page of the readings of GET /data, up to limit readings from cursor until to
+typedef struct data_page {
+    data_cursor_t cursor;
+    int64_t to;
+    int64_t limit;
+    // set if there are readings after the page, next is where they continue
+    int more;
+    data_cursor_t next;
+} data_page_t;
+
+// finds the page within the recent readings, range is set to its indexes
+// returns -1 if it has to be read from the database
+int data_page_find_recent(data_page_t* page, data_range_t* range) {
+    uint64_t begin, end;
+    if (recent_find(recent, page->cursor.timestamp, page->to, &begin, &end) != 0) {
+        return -1;
+    }
+    range->index = end - begin > (uint64_t)page->cursor.skip ? begin + page->cursor.skip
+                                                              : end;
+    range->end = end - range->index > (uint64_t)page->limit ? range->index + page->limit
+                                                             : end;
+    page->more = range->end < end;
+    if (!page->more) {
+        return 0;
+    }
+
+    // the next page starts at the first reading after the page
+    recent_block_t block;
+    uint64_t index = range->end;
+    uint64_t next_begin, next_end;
+    if (recent_read(recent, &index, range->end + 1, &block) != 0 ||
+        recent_find(recent, block.timestamps[0], block.timestamps[0], &next_begin,
+                    &next_end) != 0) {
+        return -1;
+    }
+    page->next.timestamp = block.timestamps[0];
+    page->next.skip = range->end - next_begin;
+    return 0;
+}
+
+// steps a data_seek_sql or data_count_sql statement bound to from, to and offset,
+// *value is set to the first column
+// returns 1 if there is a row, 0 if not and -1 on error
+static int data_query_int(sqlite3* reader, const char* sql, int64_t from, int64_t to,
+                          int64_t offset, int64_t* value) {
+    db_stmt_t* stmt = db_prepare(reader, sql);
+    if (stmt == NULL) {
+        return -1;
+    }
+
+    int rc = SQLITE_ERROR;
+    if (sqlite3_bind_int64(stmt->stmt, 1, from) == SQLITE_OK &&
+        sqlite3_bind_int64(stmt->stmt, 2, to) == SQLITE_OK &&
+        (sqlite3_bind_parameter_count(stmt->stmt) < 3 ||
+         sqlite3_bind_int64(stmt->stmt, 3, offset) == SQLITE_OK)) {
+        rc = sqlite3_step(stmt->stmt);
+    }
+    if (rc == SQLITE_ROW) {
+        *value = sqlite3_column_int64(stmt->stmt, 0);
+    } else if (rc != SQLITE_DONE) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(reader));
+    }
+    db_release(stmt);
+    return rc == SQLITE_ROW ? 1 : rc == SQLITE_DONE ? 0 : -1;
+}
+
+// finds the page in the database, [*begin, *end) is the id range of its readings
+// keyset pagination: the start of the page is a seek on the rowid, only the readings of
+// the page are scanned for its end, so later pages cost the same as the first one
+// returns -1 on error
+int data_page_find(sqlite3* reader, data_page_t* page, int64_t* begin, int64_t* end) {
+    int64_t range_end = (page->to + 1) << 20;
+    *begin = page->cursor.timestamp << 20;
+    *end = range_end;
+    page->more = 0;
+
+    int rc = 1;
+    if (page->cursor.skip > 0) {
+        rc = data_query_int(reader, data_seek_sql, *begin, range_end, page->cursor.skip,
+                            begin);
+        if (rc == 0) {
+            *begin = range_end;
+        }
+    }
+    if (rc == 1) {
+        rc = data_query_int(reader, data_seek_sql, *begin, range_end, page->limit, end);
+    }
+    if (rc != 1) {
+        return rc;
+    }
+
+    // the reading after the page, the next page skips the ones of the same second that
+    // are on this page
+    page->more = 1;
+    page->next.timestamp = *end >> 20;
+    return data_query_int(reader, data_count_sql, page->next.timestamp << 20, *end, 0,
+                          &page->next.skip) == 1
+               ? 0
+               : -1;
+}
+
+// the Link header pointing to the page after page of the request
+http_header_t* data_page_link(http_request_t* request, int64_t from, data_page_t* page,
+                              const data_format_t* format) {
+    char cursor[DATA_CURSOR_MAX_SIZE];
+    data_cursor_write(cursor, page->next);
+
+    size_t size = strlen(request->path) + 4 * JSON_INT_MAX_SIZE + sizeof(cursor) + 128;
+    char* link = http_alloc(size);
+    snprintf(link, size,
+             "<%s?from=%lld&to=%lld&limit=%lld&cursor=%s&format=%s>; rel=\"next\"",
+             request->path, (long long)from, (long long)page->to, (long long)page->limit,
+             cursor, format->name);
+    return http_header_new("Link", link);
+}
+
+// the response to a GET /data request, its body goes into the cache (if enabled) unless
+// readings are inserted into [from, to] in the meantime
+static http_response_t* data_response(const char* key, int64_t from, int64_t to,
+                                      uint64_t generation, http_headers_t* headers,
+                                      http_stream_callback_t stream,
+                                      http_body_release_t release, void* ctx) {
+    if (cache == NULL) {
+        return http_response_new_stream(HTTP_STATUS_OK, headers, stream, release, ctx);
+    }
+    return cache_stream(cache, key, from, to, generation, headers, stream, release, ctx);
+}
+
+// the response to a GET /data request for the readings as they are, a page of them
+// from is the from parameter of the request, for the link to the next page
+static http_response_t* data_rows_response(http_request_t* request, const char* key,
+                                           uint64_t generation, http_headers_t* headers,
+                                           const data_format_t* format, int64_t from,
+                                           data_page_t* page) {
+    data_rows_t* rows = data_rows_new(format);
+    if (rows == NULL) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    int64_t page_from = page->cursor.timestamp;
+
+    // the binary format copies the page out of the ring before the response starts, if
+    // the writer laps it meanwhile the page is read from the database instead
+    if (recent != NULL && data_page_find_recent(page, &rows->recent) == 0) {
+        if (format->id != DATA_FORMAT_BINARY ||
+            data_columns_read_recent(&rows->columns, rows->recent) == 0) {
+            if (page->more) {
+                http_headers_add(headers, data_page_link(request, from, page, format));
+            }
+            return data_response(key, page_from, page->to, generation, headers,
+                                 format->id == DATA_FORMAT_BINARY ? stream_data_columns
+                                                                  : stream_recent_data,
+                                 release_data_rows, rows);
+        }
+        rows->columns.count = 0;
+    }
 
     // get data from database
-    char* sql = "SELECT * FROM data WHERE timestamp >= ? AND timestamp <= ?";
-    sqlite3_stmt* stmt;
-    SQLITE_TRY(sqlite3_prepare_v2(db, sql, -1, &stmt, NULL));
-    SQLITE_TRY(sqlite3_bind_int(stmt, 1, from_ts));
-    SQLITE_TRY(sqlite3_bind_int(stmt, 2, to_ts));
-
-    // create json array
-    struct json_object* array = json_object_new_array();
-
-    // iterate over results
-    while (sqlite3_step(stmt) == SQLITE_ROW) {
-        // create json object
-        struct json_object* obj = json_object_new_object();
-
-        // add data to json object
-        json_object_object_add(obj, "temperature",
-                               json_object_new_double(sqlite3_column_double(stmt, 0)));
-        json_object_object_add(obj, "humidity",
-                               json_object_new_double(sqlite3_column_double(stmt, 1)));
-        json_object_object_add(obj, "windspeed",
-                               json_object_new_double(sqlite3_column_double(stmt, 2)));
-        json_object_object_add(obj, "pressure",
-                               json_object_new_double(sqlite3_column_double(stmt, 3)));
-        json_object_object_add(obj, "rain",
-                               json_object_new_double(sqlite3_column_double(stmt, 4)));
-        json_object_object_add(obj, "timestamp",
-                               json_object_new_int(sqlite3_column_int(stmt, 5)));
-
-        // add json object to array
-        json_object_array_add(array, obj);
-    }
-
-    const char* json_str = json_object_to_json_string(array);
-    // printf("%s\n", json_str);
-
-    // free resources
-    SQLITE_TRY(sqlite3_finalize(stmt));
-    // TODO: memory leak - free json object, can't atm because we need to return the
-    // string representation, this is a design problem with the http server library
-    // json_object_put(array);
-
-    return HTTP_RESPONSE((char*)json_str, HTTP_STATUS_OK,
-                         HTTP_HEADERS(("Access-Control-Allow-Origin", "*"), // allow cors
-                                      ("Content-Type", "application/json")));
-}
-
-// route handler for the '/data' endpoint
-// forwards the request to the appropriate functions depending on the method
-// or returns an error if the method is not supported
-http_response_t* handle_data(http_request_t* request) {
-    if (request->method == HTTP_METHOD_POST) {
-        return handle_data_post(request);
-    } else if (request->method == HTTP_METHOD_GET) {
-        return handle_data_get(request);
+    // the statement is stepped by the stream callback, which gives the reader back
+    // whenever it waits for the client
+    rows->reader = db_reader_acquire(db);
+    if (rows->reader == NULL) {
+        release_data_rows(rows);
+        return HTTP_RESPONSE("Service Unavailable", HTTP_STATUS_SERVICE_UNAVAILABLE);
+    }
+    int64_t begin, end;
+    if (data_page_find(rows->reader, page, &begin, &end) != 0 ||
+        (rows->select = db_prepare(rows->reader, data_page_sql)) == NULL) {
+        release_data_rows(rows);
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if (sqlite3_bind_int64(rows->select->stmt, 1, begin) != SQLITE_OK ||
+        sqlite3_bind_int64(rows->select->stmt, 2, end) != SQLITE_OK) {
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(rows->reader));
+        release_data_rows(rows);
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    rows->next = begin;
+    rows->end = end;
+
+    // the binary format starts with the number of readings, so the page (at most -L
+    // readings) is read into columns in one pass before the response starts, which also
+    // gives the reader back right away
+    if (format->id == DATA_FORMAT_BINARY) {
+        int rc = data_columns_read(&rows->columns, rows->select->stmt);
+        db_release(rows->select);
+        db_reader_release(db, rows->reader);
+        rows->select = NULL;
+        rows->reader = NULL;
+        if (rc != 0) {
+            release_data_rows(rows);
+            return HTTP_RESPONSE("Internal Server Error",
+                                 HTTP_STATUS_INTERNAL_SERVER_ERROR);
+        }
+    }
+
+    if (page->more) {
+        http_headers_add(headers, data_page_link(request, from, page, format));
+    }
+    return data_response(key, page_from, page->to, generation, headers,
+                         format->id == DATA_FORMAT_BINARY ? stream_data_columns
+                                                          : stream_data,
+                         release_data_rows, rows);
+}
+
+// handle GET requests to /data
+// streams a json array of all data points in the requested range (from/to, unix seconds)
+// format=csv|binary or an Accept header naming text/csv or application/octet-stream
+// selects a csv table or the columnar binary format instead, see data_format_negotiate()
+// the readings come in pages of at most limit (and -L) readings, a Link header with the
+// cursor of the next page is sent if there are more, see data_page_find()
+// with bucket=<seconds> or points=<max number of buckets> the rows are aggregated into
+// time buckets instead, agg=avg,min,max,sum,count selects the aggregate functions
+// (defaults to avg), see write_data_bucket() for the format
+// ranges within the recent readings are answered from memory, see recent.h
+// responses are cached by their normalized parameters, repeated requests get the body
+// from memory or a 304 if they send its ETag, see cache.h
+http_response_t* handle_data_get(http_request_t* request) {
+
+    http_query_param_t* bucket_param =
+        http_query_params_get(request->query_params, "bucket");
+    http_query_param_t* points_param =
+        http_query_params_get(request->query_params, "points");
+    http_query_param_t* agg_param = http_query_params_get(request->query_params, "agg");
+
+    time_t from_ts, to_ts;
+    if (!get_time_range(request, &from_ts, &to_ts)) {
+        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+    }
+
+    // bucket size in seconds, 0 = raw rows
+    int64_t bucket = 0;
+    if (bucket_param != NULL && points_param != NULL) {
+        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+    }
+    if (bucket_param != NULL) {
+        bucket = str_is_number(bucket_param->value) ? atoll(bucket_param->value) : 0;
+        if (bucket <= 0) {
+            return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+        }
+    }
+    if (points_param != NULL) {
+        int64_t points =
+            str_is_number(points_param->value) ? atoll(points_param->value) : 0;
+        if (points <= 0 || points > DATA_MAX_POINTS) {
+            return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+        }
+        bucket = data_bucket_size(from_ts, to_ts, points);
+    }
+
+    unsigned functions = AGGREGATE_AVG;
+    if (agg_param != NULL) {
+        functions = bucket > 0 ? aggregate_parse_functions(agg_param->value) : 0;
+        if (functions == 0) {
+            return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+        }
+    }
+
+    const data_format_t* format = data_format_negotiate(request, bucket > 0);
+    if (format == NULL) {
+        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+    }
+
+    http_headers_t* headers =
+        HTTP_HEADERS(("Access-Control-Allow-Origin", "*"), // allow cors
+                     ("Content-Type", format->content_type),
+                     ("Vary", "Accept, Accept-Encoding"));
+
+    // the readings as they are come in pages of at most limit readings, see data_page_t
+    http_query_param_t* limit_param =
+        http_query_params_get(request->query_params, "limit");
+    http_query_param_t* cursor_param =
+        http_query_params_get(request->query_params, "cursor");
+    data_page_t page = {
+        .cursor = {.timestamp = from_ts, .skip = 0},
+        .to = to_ts,
+        .limit = data_page_size,
+        .more = 0,
+    };
+    if (bucket > 0 && (limit_param != NULL || cursor_param != NULL)) {
+        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+    }
+    if (limit_param != NULL) {
+        int64_t limit = str_is_number(limit_param->value) ? atoll(limit_param->value) : 0;
+        if (limit <= 0) {
+            return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+        }
+        page.limit = limit < data_page_size ? limit : data_page_size;
+    }
+    if (cursor_param != NULL &&
+        (data_cursor_parse(cursor_param->value, &page.cursor) != 0 ||
+         page.cursor.timestamp < from_ts || page.cursor.timestamp > to_ts)) {
+        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+    }
+    if (bucket == 0) {
+        // let browsers read the link to the next page
+        http_headers_add(headers,
+                         http_header_new("Access-Control-Expose-Headers", "Link"));
+    }
+
+    char cursor[DATA_CURSOR_MAX_SIZE];
+    data_cursor_write(cursor, page.cursor);
+    char key[256];
+    snprintf(key, sizeof(key),
+             "data?from=%lld&to=%lld&bucket=%lld&agg=%u&format=%s&limit=%lld&cursor=%s",
+             (long long)from_ts, (long long)to_ts, (long long)bucket, functions,
+             format->name, (long long)page.limit, cursor);
+    uint64_t generation = 0;
+    if (cache != NULL) {
+        http_response_t* cached =
+            cache_response(cache, key, request, headers, &generation);
+        if (cached != NULL) {
+            return cached;
+        }
+    }
+
+    if (bucket == 0) {
+        return data_rows_response(request, key, generation, headers, format, from_ts,
+                                  &page);
+    }
+
+    data_buckets_t* buckets = data_buckets_new(bucket, functions);
+    if (buckets == NULL) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    if (recent != NULL && recent_find(recent, from_ts, to_ts, &buckets->recent.index,
+                                      &buckets->recent.end) == 0) {
+        return data_response(key, from_ts, to_ts, generation, headers,
+                             stream_data_buckets, release_data_buckets, buckets);
+    }
+    buckets->recent.index = 0;
+    buckets->recent.end = 0;
+
+    // buckets of whole minutes/hours/days are read from the rollup tables where
+    // possible, the readings are only queried until the first and after the last period
+    int64_t periods_from = to_ts + 1;
+    int64_t periods_to = to_ts + 1;
+    const rollup_t* rollup =
+        rollup_find(bucket, from_ts, to_ts, &periods_from, &periods_to);
+    data_buckets_add_segment(buckets, NULL, from_ts << 20, periods_from << 20);
+    if (rollup != NULL) {
+        data_buckets_add_segment(buckets, rollup, periods_from, periods_to);
+        data_buckets_add_segment(buckets, NULL, periods_to << 20, (to_ts + 1) << 20);
+    }
+
+    // get data from database
+    // the first query is prepared here to fail with a proper status, the stream callback
+    // steps through the segments
+    int rc = buckets->segment_count > 0 ? data_buckets_attach(buckets) : SQLITE_OK;
+    if (rc != SQLITE_OK) {
+        release_data_buckets(buckets);
+        return rc == SQLITE_BUSY ? HTTP_RESPONSE("Service Unavailable",
+                                                 HTTP_STATUS_SERVICE_UNAVAILABLE)
+                                 : HTTP_RESPONSE("Internal Server Error",
+                                                 HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    return data_response(key, from_ts, to_ts, generation, headers, stream_data_buckets,
+                         release_data_buckets, buckets);
+}
+
+// upper bound for the size of a GET /stats response
+#define STATS_RESPONSE_MAX_SIZE                                                          \
+    (64 + JSON_INT_MAX_SIZE + DATA_POINT_VALUE_COUNT * (128 + 5 * JSON_DOUBLE_MAX_SIZE))
+
+// recent_scan() callback, the stats run on the ring's columns in place
+static void stats_add_recent(const int64_t* timestamps,
+                             const double* const values[DATA_POINT_VALUE_COUNT],
+                             size_t count, void* ctx) {
+    stats_add(ctx, values, count);
+}
+
+// adds the readings between from and to from the database, gathered into columns of
+// STATS_BLOCK_SIZE values for the kernels
+// returns an sqlite result code, SQLITE_BUSY if no reader became idle in time
+static int stats_add_readings(stats_t* stats, int64_t from, int64_t to) {
+    double(*columns)[STATS_BLOCK_SIZE] =
+        malloc(sizeof(double) * DATA_POINT_VALUE_COUNT * STATS_BLOCK_SIZE);
+    if (columns == NULL) {
+        return SQLITE_NOMEM;
+    }
+
+    sqlite3* reader = db_reader_acquire(db);
+    if (reader == NULL) {
+        free(columns);
+        return SQLITE_BUSY;
+    }
+    db_stmt_t* select = db_prepare(reader, data_select_sql);
+    if (select == NULL) {
+        db_reader_release(db, reader);
+        free(columns);
+        return SQLITE_ERROR;
+    }
+
+    const double* column_pointers[DATA_POINT_VALUE_COUNT];
+    for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        column_pointers[i] = columns[i];
+    }
+
+    int rc = SQLITE_OK;
+    if (sqlite3_bind_int64(select->stmt, 1, from) != SQLITE_OK ||
+        sqlite3_bind_int64(select->stmt, 2, to) != SQLITE_OK) {
+        rc = SQLITE_ERROR;
+    }
+
+    size_t count = 0;
+    while (rc == SQLITE_OK && (rc = sqlite3_step(select->stmt)) == SQLITE_ROW) {
+        for (int i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            columns[i][count] = sqlite3_column_double(select->stmt, i);
+        }
+        if (++count == STATS_BLOCK_SIZE) {
+            stats_add(stats, column_pointers, count);
+            count = 0;
+        }
+        rc = SQLITE_OK;
+    }
+
+    if (rc == SQLITE_DONE) {
+        stats_add(stats, column_pointers, count);
+        rc = SQLITE_OK;
     } else {
-        return HTTP_RESPONSE("Method not allowed", HTTP_STATUS_METHOD_NOT_ALLOWED);
+        printf("\033[31mERROR\033[0m %s\n", sqlite3_errmsg(reader));
     }
+
+    release_stmt(select);
+    free(columns);
+    return rc;
+}
+
+// handle GET requests to /stats
+// summary of the readings between from and to (unix seconds, inclusive) as
+// { "count": 1440, "temperature": { "sum": 24336.0, "min": 9.1, "max": 23.4,
+//   "mean": 16.9, "variance": 12.25 }, ... }
+// with the population variance, min, max, mean and variance are null without readings
+// ranges within the recent readings are computed right on the ring's columns
+http_response_t* handle_stats_get(http_request_t* request) {
+    time_t from_ts, to_ts;
+    if (!get_time_range(request, &from_ts, &to_ts)) {
+        return HTTP_RESPONSE("Invalid query parameters", HTTP_STATUS_BAD_REQUEST);
+    }
+
+    stats_t stats;
+    stats_init(&stats);
+
+    uint64_t begin, end;
+    int in_recent =
+        recent != NULL && recent_find(recent, from_ts, to_ts, &begin, &end) == 0;
+    if (in_recent && recent_scan(recent, begin, end, stats_add_recent, &stats) != 0) {
+        // overwritten while scanning, start over with the database
+        stats_init(&stats);
+        in_recent = 0;
+    }
+    int rc = in_recent ? SQLITE_OK : stats_add_readings(&stats, from_ts, to_ts);
+    if (rc == SQLITE_BUSY) {
+        return HTTP_RESPONSE("Service Unavailable", HTTP_STATUS_SERVICE_UNAVAILABLE);
+    } else if (rc != SQLITE_OK) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+
+    char* json = malloc(STATS_RESPONSE_MAX_SIZE);
+    if (json == NULL) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    char* p = json;
+    p += JSON_WRITE_LITERAL(p, "{ \"count\": ");
+    p += json_write_int(p, stats.count);
+    for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        p += sprintf(p, ", \"%s\": { \"sum\": ", data_point_fields[i]);
+        p += json_write_double(p, stats.sum[i]);
+        p += JSON_WRITE_LITERAL(p, ", \"min\": ");
+        p += json_write_double(p, stats.count > 0 ? stats.min[i] : NAN);
+        p += JSON_WRITE_LITERAL(p, ", \"max\": ");
+        p += json_write_double(p, stats.count > 0 ? stats.max[i] : NAN);
+        p += JSON_WRITE_LITERAL(p, ", \"mean\": ");
+        p += json_write_double(p, stats.count > 0 ? stats.mean[i] : NAN);
+        p += JSON_WRITE_LITERAL(p, ", \"variance\": ");
+        p += json_write_double(p, stats_variance(&stats, i));
+        p += JSON_WRITE_LITERAL(p, " }");
+    }
+    p += JSON_WRITE_LITERAL(p, " }");
+
+    http_headers_t* headers =
+        HTTP_HEADERS(("Access-Control-Allow-Origin", "*"), // allow cors
+                     ("Content-Type", "application/json"));
+    return HTTP_RESPONSE(json, HTTP_STATUS_OK, headers, p - json, free);
+}
+
+// handle GET requests to /cache (only routed if the cache is enabled)
+// counters of the response cache as
+// { "hits": 120, "misses": 8, "not_modified": 40, "invalidations": 3, "evictions": 0,
+//   "entries": 5, "size": 81920 }
+http_response_t* handle_cache_get(http_request_t* request) {
+    char* json = malloc(CACHE_COUNTERS_MAX_SIZE);
+    if (json == NULL) {
+        return HTTP_RESPONSE("Internal Server Error", HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    }
+    size_t size = cache_write_counters(cache, json);
+
+    http_headers_t* headers =
+        HTTP_HEADERS(("Access-Control-Allow-Origin", "*"), // allow cors
+                     ("Content-Type", "application/json"));
+    return HTTP_RESPONSE(json, HTTP_STATUS_OK, headers, size, free);
 }
 
 http_response_t* handle_index(http_request_t* request) {
@@ -175,55 +1766,236 @@ http_response_t* handle_index(http_request_t* request) {
         HTTP_STATUS_OK, HTTP_HEADERS(("Content-Type", "text/html")));
 }
 
+#define USAGE                                                                            \
+    "Usage: %s [-m epoll|threads] [-w workers] [-r max request size] [-l listeners] "    \
+    "[-b backlog] [-p] [-c readers] [-P pragma]... [-B batch size] [-W commit window] "  \
+    "[-d off|normal|full] [-H hours] [-C cache MiB] [-z level] [-L page size] <host> "   \
+    "<port> <db file>\n"                                                                 \
+    "       %s -R <db file>"
+
 int main(int argc, char** argv) {
 
-    // second argv: host
-    // third argv: port
-    // fourth argv: db file
-    if (argc != 4) {
-        ERROR("Usage: %s <host> <port> <db file>", argv[0]);
+    // create the server
+    http_server_t* server = http_server_new();
+
+    // options:
+    // -m: connection handling mode, epoll (default) or threads (workers handle whole
+    //     connections)
+    // -w: number of worker threads running the route handlers, defaults to the
+    //     number of cpus
+    // -r: max request size in bytes (head + body), larger requests get a 413
+    // -l: number of SO_REUSEPORT listeners with their own accept loops, 0 = one per cpu
+    // -b: length of the accept queue of each listener
+    // -p: pin each listener to a cpu
+    // -c: number of read-only database connections, defaults to the number of cpus
+    // -P: sqlite pragma applied to every connection (e.g. cache_size=-8000), can be
+    //     repeated
+    // -B: max number of inserts committed in one transaction
+    // -W: ms the writer waits for more inserts before committing, defaults to 0 (only
+    //     inserts that arrived during the previous commit are batched)
+    // -d: durability of commits, sqlite's synchronous mode of the writer (off, normal or
+    //     full), defaults to normal
+    // -H: hours of readings (before the newest one) loaded into memory at startup,
+    //     queries within the recent readings don't touch the database, 0 = disabled,
+    //     defaults to 24
+    // -C: MiB of GET /data responses kept in memory, 0 = disabled, defaults to 64
+    // -z: zlib level (1-9) of responses compressed for clients accepting gzip or deflate,
+    //     0 = no compression, defaults to 6
+    // -L: max number of readings in a GET /data response, larger ranges are split into
+    //     pages, defaults to 100000
+    // -R: rebuild the rollup tables from the data table and exit, only takes the db file
+    db_config_t db_config = {
+        .reader_count = 0,
+        .pragmas = malloc(sizeof(char*) * argc),
+        .pragma_count = 0,
+        .batch_size = DB_BATCH_SIZE,
+        .commit_window = 0,
+        .synchronous = "NORMAL",
+        .before_commit = rollup_flush,
+        .before_commit_ctx = NULL,
+        .after_commit = publish_data_points,
+        .after_commit_ctx = NULL,
+    };
+    int recent_hours = 24;
+    int cache_mib = 64;
+    int rebuild_rollups = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:w:r:l:b:pc:P:B:W:d:H:C:z:L:R")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "epoll") == 0) {
+                server->mode = HTTP_SERVER_MODE_EPOLL;
+            } else if (strcmp(optarg, "threads") == 0) {
+                server->mode = HTTP_SERVER_MODE_THREADS;
+            } else {
+                ERROR("Invalid mode: %s", optarg);
+            }
+            break;
+        case 'w':
+            if (!str_is_number(optarg) || atoi(optarg) < 1) {
+                ERROR("Invalid worker count: %s", optarg);
+            }
+            server->worker_count = atoi(optarg);
+            break;
+        case 'r':
+            if (!str_is_number(optarg) || atoi(optarg) < 1) {
+                ERROR("Invalid max request size: %s", optarg);
+            }
+            server->max_request_size = atoi(optarg);
+            break;
+        case 'l':
+            if (!str_is_number(optarg)) {
+                ERROR("Invalid listener count: %s", optarg);
+            }
+            server->listener_count = atoi(optarg);
+            break;
+        case 'b':
+            if (!str_is_number(optarg) || atoi(optarg) < 1) {
+                ERROR("Invalid backlog: %s", optarg);
+            }
+            server->backlog = atoi(optarg);
+            break;
+        case 'p':
+            server->pin_listeners = 1;
+            break;
+        case 'c':
+            if (!str_is_number(optarg) || atoi(optarg) < 1) {
+                ERROR("Invalid reader count: %s", optarg);
+            }
+            db_config.reader_count = atoi(optarg);
+            break;
+        case 'P':
+            db_config.pragmas[db_config.pragma_count++] = optarg;
+            break;
+        case 'B':
+            if (!str_is_number(optarg) || atoi(optarg) < 1) {
+                ERROR("Invalid batch size: %s", optarg);
+            }
+            db_config.batch_size = atoi(optarg);
+            break;
+        case 'W':
+            if (!str_is_number(optarg)) {
+                ERROR("Invalid commit window: %s", optarg);
+            }
+            db_config.commit_window = atoi(optarg);
+            break;
+        case 'd':
+            if (strcasecmp(optarg, "off") != 0 && strcasecmp(optarg, "normal") != 0 &&
+                strcasecmp(optarg, "full") != 0) {
+                ERROR("Invalid durability: %s", optarg);
+            }
+            db_config.synchronous = optarg;
+            break;
+        case 'H':
+            if (!str_is_number(optarg)) {
+                ERROR("Invalid recent hours: %s", optarg);
+            }
+            recent_hours = atoi(optarg);
+            break;
+        case 'C':
+            if (!str_is_number(optarg)) {
+                ERROR("Invalid cache size: %s", optarg);
+            }
+            cache_mib = atoi(optarg);
+            break;
+        case 'z':
+            if (!str_is_number(optarg) || atoi(optarg) > 9) {
+                ERROR("Invalid compression level: %s", optarg);
+            }
+            server->compression_level = atoi(optarg);
+            break;
+        case 'L':
+            if (!str_is_number(optarg) || atoll(optarg) < 1) {
+                ERROR("Invalid page size: %s", optarg);
+            }
+            data_page_size = atoll(optarg);
+            break;
+        case 'R':
+            rebuild_rollups = 1;
+            break;
+        default:
+            ERROR(USAGE, argv[0], argv[0]);
+        }
+    }
+
+    // remaining arguments: host, port, db file (only the db file with -R)
+    if (argc - optind != (rebuild_rollups ? 1 : 3)) {
+        ERROR(USAGE, argv[0], argv[0]);
     }
+    char* host = argv[optind];
+    char* port = argv[optind + 1];
+    char* db_file = argv[argc - 1];
 
     // check if port is valid
-    if (!str_is_number(argv[2])) {
-        ERROR("Invalid port: %s", argv[2]);
+    if (!rebuild_rollups && !str_is_number(port)) {
+        ERROR("Invalid port: %s", port);
     }
 
     // open the database file
-    // don't use SQLITE_TRY() here, because we want to terminate the program instead of
-    // returning an HTTP error
-    if (sqlite3_open(argv[3], &db) != SQLITE_OK) {
-        ERROR("Could not open database file: %s", sqlite3_errmsg(db));
+    // terminate the program here instead of returning an HTTP error
+    db = db_open(db_file, &db_config);
+    if (db == NULL) {
+        ERROR("Could not open database file: %s", db_file);
     }
 
-    // create the table if it doesn't exist
-    char* sql = "CREATE TABLE IF NOT EXISTS data ("
-                "temperature REAL, "
-                "humidity REAL, "
-                "windspeed REAL, "
-                "pressure REAL, "
-                "rain REAL, "
-                "timestamp INTEGER"
-                ")";
+    // create or upgrade the tables
+    if (db_migrate(db, migrations, sizeof(migrations) / sizeof(migrations[0])) !=
+        SQLITE_OK) {
+        ERROR("Could not migrate database");
+    }
 
-    if (sqlite3_exec(db, sql, NULL, NULL, NULL)) {
-        ERROR("Could not create table: %s", sqlite3_errmsg(db));
+    if (rebuild_rollups) {
+        if (db_exec(db, ROLLUP_REBUILD) != SQLITE_OK) {
+            ERROR("Could not rebuild the rollup tables");
+        }
+        http_server_free(server);
+        db_close(db);
+        free(db_config.pragmas);
+        return 0;
     }
 
-    // create the server
-    http_server_t* server = http_server_new();
+    // vectorized kernels of GET /stats
+    stats_select_kernel();
+
+    // load the recent readings before any can be posted
+    if (recent_hours > 0) {
+        recent = recent_open(db, (int64_t)recent_hours * 3600);
+        if (recent == NULL) {
+            ERROR("Could not load the recent readings");
+        }
+    }
+
+    if (cache_mib > 0) {
+        cache = cache_new((size_t)cache_mib * 1024 * 1024, server->compression_level,
+                          server->compression_min_size);
+        if (cache == NULL) {
+            ERROR("Could not create the response cache");
+        }
+    }
 
     // register the route handlers
-    http_server_add_handler(server, "/", handle_index);
-    http_server_add_handler(server, "/data", handle_data);
+    http_server_add_route(server, HTTP_METHOD_GET, "/", handle_index);
+    http_server_add_route(server, HTTP_METHOD_GET, "/data", handle_data_get);
+    http_server_add_route(server, HTTP_METHOD_GET, "/stats", handle_stats_get);
+    http_server_add_route(server, HTTP_METHOD_POST, "/data", handle_data_post);
+    if (cache != NULL) {
+        http_server_add_route(server, HTTP_METHOD_GET, "/cache", handle_cache_get);
+    }
 
     // finally run the server on the specified host and port
-    http_server_run(server, argv[1], atoi(argv[2]));
+    http_server_run(server, host, atoi(port));
 
     // http_server_run is not supposed to return and process termination
     // will free all resources anyway... but just do it for good measure
     http_server_free(server);
-    sqlite3_close(db);
+    db_close(db);
+    if (recent != NULL) {
+        recent_free(recent);
+    }
+    if (cache != NULL) {
+        cache_free(cache);
+    }
+    free(db_config.pragmas);
 
     return 0;
 }
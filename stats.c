@@ -0,0 +1,167 @@
+#include "stats.h"
+
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define STATS_X86
+#include <immintrin.h>
+#endif
+
+// adds values[i..count) to sums one at a time
+static inline void stats_kernel_tail(const double* values, size_t i, size_t count,
+                                     double shift, stats_sums_t* sums) {
+    for (; i < count; i++) {
+        double value = values[i];
+        double difference = value - shift;
+        sums->sum += difference;
+        sums->sum_squares += difference * difference;
+        sums->min = value < sums->min ? value : sums->min;
+        sums->max = value > sums->max ? value : sums->max;
+    }
+}
+
+void stats_kernel_scalar(const double* values, size_t count, double shift,
+                         stats_sums_t* sums) {
+    sums->sum = 0;
+    sums->sum_squares = 0;
+    sums->min = values[0];
+    sums->max = values[0];
+    stats_kernel_tail(values, 0, count, shift, sums);
+}
+
+#ifdef STATS_X86
+
+// the vector kernels keep two sets of accumulators, so consecutive additions don't wait
+// for each other, and finish the last few values with the scalar loop
+
+__attribute__((target("avx2"))) static void
+stats_kernel_avx2(const double* values, size_t count, double shift, stats_sums_t* sums) {
+    __m256d shifts = _mm256_set1_pd(shift);
+    __m256d sum0 = _mm256_setzero_pd(), sum1 = sum0;
+    __m256d squares0 = sum0, squares1 = sum0;
+    __m256d min0 = _mm256_set1_pd(values[0]), min1 = min0;
+    __m256d max0 = min0, max1 = min0;
+
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256d x0 = _mm256_loadu_pd(&values[i]);
+        __m256d x1 = _mm256_loadu_pd(&values[i + 4]);
+        __m256d d0 = _mm256_sub_pd(x0, shifts);
+        __m256d d1 = _mm256_sub_pd(x1, shifts);
+        sum0 = _mm256_add_pd(sum0, d0);
+        sum1 = _mm256_add_pd(sum1, d1);
+        squares0 = _mm256_add_pd(squares0, _mm256_mul_pd(d0, d0));
+        squares1 = _mm256_add_pd(squares1, _mm256_mul_pd(d1, d1));
+        min0 = _mm256_min_pd(min0, x0);
+        min1 = _mm256_min_pd(min1, x1);
+        max0 = _mm256_max_pd(max0, x0);
+        max1 = _mm256_max_pd(max1, x1);
+    }
+
+    double sum[4], squares[4], min[4], max[4];
+    _mm256_storeu_pd(sum, _mm256_add_pd(sum0, sum1));
+    _mm256_storeu_pd(squares, _mm256_add_pd(squares0, squares1));
+    _mm256_storeu_pd(min, _mm256_min_pd(min0, min1));
+    _mm256_storeu_pd(max, _mm256_max_pd(max0, max1));
+    sums->sum = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+    sums->sum_squares = (squares[0] + squares[1]) + (squares[2] + squares[3]);
+    sums->min = fmin(fmin(min[0], min[1]), fmin(min[2], min[3]));
+    sums->max = fmax(fmax(max[0], max[1]), fmax(max[2], max[3]));
+    stats_kernel_tail(values, i, count, shift, sums);
+}
+
+__attribute__((target("sse2"))) static void
+stats_kernel_sse2(const double* values, size_t count, double shift, stats_sums_t* sums) {
+    __m128d shifts = _mm_set1_pd(shift);
+    __m128d sum0 = _mm_setzero_pd(), sum1 = sum0;
+    __m128d squares0 = sum0, squares1 = sum0;
+    __m128d min0 = _mm_set1_pd(values[0]), min1 = min0;
+    __m128d max0 = min0, max1 = min0;
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128d x0 = _mm_loadu_pd(&values[i]);
+        __m128d x1 = _mm_loadu_pd(&values[i + 2]);
+        __m128d d0 = _mm_sub_pd(x0, shifts);
+        __m128d d1 = _mm_sub_pd(x1, shifts);
+        sum0 = _mm_add_pd(sum0, d0);
+        sum1 = _mm_add_pd(sum1, d1);
+        squares0 = _mm_add_pd(squares0, _mm_mul_pd(d0, d0));
+        squares1 = _mm_add_pd(squares1, _mm_mul_pd(d1, d1));
+        min0 = _mm_min_pd(min0, x0);
+        min1 = _mm_min_pd(min1, x1);
+        max0 = _mm_max_pd(max0, x0);
+        max1 = _mm_max_pd(max1, x1);
+    }
+
+    double sum[2], squares[2], min[2], max[2];
+    _mm_storeu_pd(sum, _mm_add_pd(sum0, sum1));
+    _mm_storeu_pd(squares, _mm_add_pd(squares0, squares1));
+    _mm_storeu_pd(min, _mm_min_pd(min0, min1));
+    _mm_storeu_pd(max, _mm_max_pd(max0, max1));
+    sums->sum = sum[0] + sum[1];
+    sums->sum_squares = squares[0] + squares[1];
+    sums->min = fmin(min[0], min[1]);
+    sums->max = fmax(max[0], max[1]);
+    stats_kernel_tail(values, i, count, shift, sums);
+}
+
+#endif // STATS_X86
+
+stats_kernel_t stats_kernel = stats_kernel_scalar;
+const char* stats_kernel_name = "scalar";
+
+void stats_select_kernel(void) {
+#ifdef STATS_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        stats_kernel = stats_kernel_avx2;
+        stats_kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        stats_kernel = stats_kernel_sse2;
+        stats_kernel_name = "sse2";
+    }
+#endif
+}
+
+void stats_init(stats_t* stats) {
+    stats->count = 0;
+    for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+        stats->sum[i] = 0;
+        stats->min[i] = INFINITY;
+        stats->max[i] = -INFINITY;
+        stats->mean[i] = 0;
+        stats->m2[i] = 0;
+    }
+}
+
+void stats_add(stats_t* stats, const double* const columns[DATA_POINT_VALUE_COUNT],
+               size_t count) {
+    for (size_t start = 0; start < count; start += STATS_BLOCK_SIZE) {
+        size_t size = count - start < STATS_BLOCK_SIZE ? count - start : STATS_BLOCK_SIZE;
+        double total = stats->count + size;
+
+        for (size_t i = 0; i < DATA_POINT_VALUE_COUNT; i++) {
+            const double* values = &columns[i][start];
+            double shift = values[0];
+            stats_sums_t sums;
+            stats_kernel(values, size, shift, &sums);
+
+            // mean and squared differences of the block, merged with the previous blocks
+            double mean = shift + sums.sum / size;
+            double m2 = sums.sum_squares - sums.sum * sums.sum / size;
+            double delta = mean - stats->mean[i];
+            stats->mean[i] += delta * size / total;
+            stats->m2[i] += (m2 > 0 ? m2 : 0) + delta * delta * stats->count * size / total;
+
+            stats->sum[i] += shift * size + sums.sum;
+            stats->min[i] = sums.min < stats->min[i] ? sums.min : stats->min[i];
+            stats->max[i] = sums.max > stats->max[i] ? sums.max : stats->max[i];
+        }
+        stats->count += size;
+    }
+}
+
+double stats_variance(const stats_t* stats, size_t i) {
+    return stats->count > 0 ? stats->m2[i] / stats->count : NAN;
+}
@@ -0,0 +1,65 @@
+#ifndef __STATS_H
+#define __STATS_H
+
+#include "data_point.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// summary statistics (count, sum, min, max, mean and variance) of the measured values
+// over a range of readings, computed in one pass over column arrays (all values of a
+// field next to each other, like in the recent readings)
+// the columns are processed in blocks by a vectorized kernel (avx2 or sse2, picked at
+// runtime by what the cpu supports, plain c otherwise) that sums up the values and their
+// squares relative to the first value of the block (so the variance doesn't suffer from
+// cancellation) and keeps the min and max, the blocks are then merged (Chan et al.)
+
+// number of values per kernel call
+#define STATS_BLOCK_SIZE 4096
+
+typedef struct stats stats_t;
+typedef struct stats_sums stats_sums_t;
+
+// per measured value, in the order of data_point_fields
+struct stats {
+    uint64_t count;
+    double sum[DATA_POINT_VALUE_COUNT];
+    double min[DATA_POINT_VALUE_COUNT];
+    double max[DATA_POINT_VALUE_COUNT];
+    double mean[DATA_POINT_VALUE_COUNT];
+    // sum of the squared differences from the mean
+    double m2[DATA_POINT_VALUE_COUNT];
+};
+
+// result of a kernel, the sums are of value - shift
+struct stats_sums {
+    double sum;
+    double sum_squares;
+    double min;
+    double max;
+};
+
+// sums of count (> 0) values
+typedef void (*stats_kernel_t)(const double* values, size_t count, double shift,
+                               stats_sums_t* sums);
+
+// the kernel used by stats_add() and its name ("avx2", "sse2" or "scalar")
+extern stats_kernel_t stats_kernel;
+extern const char* stats_kernel_name;
+
+// the plain c kernel, e.g. to compare against
+void stats_kernel_scalar(const double* values, size_t count, double shift,
+                         stats_sums_t* sums);
+
+// picks the fastest kernel the cpu supports, call once before using stats_add()
+void stats_select_kernel(void);
+
+// resets to the statistics of no readings
+void stats_init(stats_t* stats);
+// adds count readings, columns[i] holds the values of measured value i
+void stats_add(stats_t* stats, const double* const columns[DATA_POINT_VALUE_COUNT],
+               size_t count);
+// population variance of measured value i, NaN without readings
+double stats_variance(const stats_t* stats, size_t i);
+
+#endif // __STATS_H